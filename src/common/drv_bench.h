@@ -0,0 +1,53 @@
+#ifndef DRV_BENCH_H
+#define DRV_BENCH_H
+
+#include <kunit/test.h>         // Needed for kunit_info
+#include <linux/ktime.h>        // Needed for ktime_get_ns
+#include <linux/timex.h>        // Needed for get_cycles
+#include <linux/math64.h>       // Needed for div64_u64/div_u64_rem
+
+// ----------------------------------------------------------------------------
+// Benchmark reports
+//
+// Shared by the drivers' KUnit benchmarks (the *_kunit.c files), so that
+// their results can be collected by scripts. A benchmark times a number of
+// operations (what an operation is being up to the benchmark: a byte
+// transformed, a die rolled, a page written...), and reports them as a
+// single line of the following form (a KUnit diagnostic, in the test's log):
+//
+//   # <test>: bench: name=<name> op=<op> ops=<count> ns_per_op=<ns> cycles_per_op=<cycles>
+//
+// where ns_per_op and cycles_per_op have three decimals. Cycles are counted
+// with get_cycles(): on x86, the TSC (which ticks at a constant rate,
+// whatever the core's frequency); on architectures that have no cycle
+// counter (such as UML), it always returns 0.
+
+struct drv_bench {
+    u64 start_ns;
+    cycles_t start_cycles;
+};
+
+static inline void drv_bench_start(struct drv_bench *bench)
+{
+    bench->start_ns = ktime_get_ns();
+    bench->start_cycles = get_cycles();
+}
+
+// Reports the time taken by 'ops' operations since drv_bench_start().
+static inline void drv_bench_report(struct kunit *test, const struct drv_bench *bench, const char *name, const char *op, u64 ops)
+{
+    u64 cycles = (u64)(get_cycles() - bench->start_cycles);
+    u64 ns = ktime_get_ns() - bench->start_ns;
+    // In thousandths of a nanosecond (resp. cycle) per operation.
+    u64 ns_per_op = div64_u64(ns * 1000, max_t(u64, ops, 1));
+    u64 cycles_per_op = div64_u64(cycles * 1000, max_t(u64, ops, 1));
+    u32 ns_frac;
+    u32 cycles_frac;
+
+    ns_per_op = div_u64_rem(ns_per_op, 1000, &ns_frac);
+    cycles_per_op = div_u64_rem(cycles_per_op, 1000, &cycles_frac);
+    kunit_info(test, "bench: name=%s op=%s ops=%llu ns_per_op=%llu.%03u cycles_per_op=%llu.%03u\n",
+               name, op, ops, ns_per_op, ns_frac, cycles_per_op, cycles_frac);
+}
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef DRV_STATS_H
+#define DRV_STATS_H
+
+#include <linux/percpu.h>       // Needed for alloc_percpu and the this_cpu_* operations
+#include <linux/fs.h>           // Needed for file_inode
+#include <linux/debugfs.h>      // Needed for debugfs_create_dir/file
+#include <linux/seq_file.h>     // Needed for seq_printf and single_open
+#include <linux/sched/clock.h>  // Needed for local_clock
+
+// ----------------------------------------------------------------------------
+// Operation statistics
+//
+// Shared by the character drivers, in place of logging on their hot paths.
+// Each driver keeps one struct drv_stats, whose counters are per CPU:
+// updating them takes no lock and touches no cache line shared with other
+// CPUs. They are only summed when read, through debugfs:
+//
+//   cat /sys/kernel/debug/<driver>/stats
+//
+// Counters are kept per operation type:
+// - calls: number of calls;
+// - bytes: bytes transferred by successful calls;
+// - errors: number of failed calls (-EAGAIN, which non-blocking callers
+//   expect, does not count as a failure);
+// - lock_ns: time spent acquiring the driver's locks, in nanoseconds.
+//
+// Writing anything to the file resets the counters.
+
+enum drv_stats_op {
+    DRV_STATS_READ,
+    DRV_STATS_WRITE,
+    DRV_STATS_IOCTL,
+    DRV_STATS_NUM_OPS
+};
+
+struct drv_stats_counters {
+    u64 calls;
+    u64 bytes;
+    u64 errors;
+    u64 lock_ns;
+};
+
+struct drv_stats_cpu {
+    struct drv_stats_counters ops[DRV_STATS_NUM_OPS];
+};
+
+struct drv_stats {
+    struct drv_stats_cpu __percpu *cpu;
+    struct dentry* dir;
+};
+
+static const char* const drv_stats_op_names[DRV_STATS_NUM_OPS] = { "read", "write", "ioctl" };
+
+// Accounts for a call, given its result (a byte count or an error code).
+static inline void drv_stats_account(struct drv_stats *stats, enum drv_stats_op op, ssize_t result)
+{
+    this_cpu_inc(stats->cpu->ops[op].calls);
+    if (result > 0)
+    {
+        this_cpu_add(stats->cpu->ops[op].bytes, result);
+    }
+    else if (result < 0 && result != -EAGAIN)
+    {
+        this_cpu_inc(stats->cpu->ops[op].errors);
+    }
+}
+
+// Lock acquisitions are timed as follows:
+//
+//   u64 start = drv_stats_clock();
+//   mutex_lock(...);
+//   drv_stats_lock_time(stats, op, start);
+static inline u64 drv_stats_clock(void)
+{
+    return local_clock();
+}
+
+static inline void drv_stats_lock_time(struct drv_stats *stats, enum drv_stats_op op, u64 start)
+{
+    this_cpu_add(stats->cpu->ops[op].lock_ns, local_clock() - start);
+}
+
+static int drv_stats_show(struct seq_file *s, void *unused)
+{
+    struct drv_stats *stats = s->private;
+
+    seq_printf(s, "%-8s %16s %20s %16s %20s\n", "op", "calls", "bytes", "errors", "lock_ns");
+    for (int op = 0; op < DRV_STATS_NUM_OPS; op++)
+    {
+        struct drv_stats_counters sum = { 0 };
+        int cpu;
+        for_each_possible_cpu(cpu)
+        {
+            const struct drv_stats_counters *counters = &per_cpu_ptr(stats->cpu, cpu)->ops[op];
+            sum.calls += READ_ONCE(counters->calls);
+            sum.bytes += READ_ONCE(counters->bytes);
+            sum.errors += READ_ONCE(counters->errors);
+            sum.lock_ns += READ_ONCE(counters->lock_ns);
+        }
+        seq_printf(s, "%-8s %16llu %20llu %16llu %20llu\n", drv_stats_op_names[op], sum.calls, sum.bytes, sum.errors, sum.lock_ns);
+    }
+    return 0;
+}
+
+static int drv_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, drv_stats_show, inode->i_private);
+}
+
+static ssize_t drv_stats_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    struct drv_stats *stats = file_inode(file)->i_private;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        memset(per_cpu_ptr(stats->cpu, cpu), 0, sizeof(struct drv_stats_cpu));
+    }
+    return count;
+}
+
+static const struct file_operations drv_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = drv_stats_open,
+    .read = seq_read,
+    .write = drv_stats_write,
+    .llseek = seq_lseek,
+    .release = single_release
+};
+
+// Allocates the counters and exposes them under debugfs. Failing to create
+// the debugfs entries is not an error: the statistics are then simply not
+// visible (as when debugfs is not mounted or not built in).
+static inline int drv_stats_init(struct drv_stats *stats, const char *name)
+{
+    stats->cpu = alloc_percpu(struct drv_stats_cpu);
+    if (!stats->cpu)
+    {
+        return -ENOMEM;
+    }
+    stats->dir = debugfs_create_dir(name, NULL);
+    debugfs_create_file("stats", 0644, stats->dir, stats, &drv_stats_fops);
+    return 0;
+}
+
+static inline void drv_stats_destroy(struct drv_stats *stats)
+{
+    debugfs_remove_recursive(stats->dir);
+    free_percpu(stats->cpu);
+    stats->cpu = NULL;
+}
+
+#endif
@@ -8,6 +8,19 @@
 #include <linux/sched.h>        // Needed for the 'current' macro
 #include <linux/mutex.h>        // Needed for mutex
 #include <linux/proc_fs.h>      // Needed for proc-related functions
+#include <linux/seq_file.h>     // Needed for the seq_file interface
+#include <linux/percpu.h>       // Needed for DEFINE_PER_CPU and get/put_cpu_ptr
+#include <linux/fs.h>           // Needed for alloc/unregister_chrdev_region
+#include <linux/cdev.h>         // Needed for cdev_xxxx functions
+#include <linux/slab.h>         // Needed for kzalloc/kfree
+#include <linux/log2.h>         // Needed for roundup_pow_of_two
+#include <linux/mm.h>           // Needed for vm_area_struct and remap_vmalloc_range
+#include <linux/ioctl.h>        // Needed for the IOCTL-related macros
+
+#include "dice_ioctl.h"
+#include "dice_expr.h"
+#include "dice_random.h"
+#include "../common/drv_stats.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("yduchesne");
@@ -20,17 +33,37 @@ MODULE_DESCRIPTION("Takes dice count has input; returns dice roll result as outp
 #define DICE_BUF_LEN 256
 #define DICE_INPUT_LEN 1
 #define DICE_DEFAULT_DICE_COUNT 2
+#define DICE_DEVICE_NAME "dice"
+#define DICE_CLASS_NAME "dice_class"
+#define DICE_BIN_CHUNK 256
+#define DICE_REFILL_CHUNK (64 * 1024)
+#define DICE_DEFAULT_RING_LEN (64 * 1024)
+#define DICE_COUNT_FLUSH (1u << 24)
+
+#define DICE_IOCTL_SIDES _IOW(DICE_IOCTL_MAGIC, DICE_IOCTL_SIDES_CMD, __u32)
+#define DICE_IOCTL_REFILL _IO(DICE_IOCTL_MAGIC, DICE_IOCTL_REFILL_CMD)
+
+// ----------------------------------------------------------------------------
+// Parameters
+
+static unsigned int sides = DICE_SIDES;
+module_param(sides, uint, 0444);
+MODULE_PARM_DESC(sides, "Default number of sides of the dice rolled through /dev/dice (max: 255)");
+
+static unsigned long ring_size = DICE_DEFAULT_RING_LEN;
+module_param(ring_size, ulong, 0444);
+MODULE_PARM_DESC(ring_size, "Capacity in bytes of the rings mapped from /dev/dice (rounded up to a power of two)");
 
 // ----------------------------------------------------------------------------
 // Module state
 
 static struct proc_dir_entry *proc_dice;
 
-
+// The expression with which files are opened ('expr', protected by 
+// 'crit_sec_mutex'): each open file then has its own (see dice_session).
 typedef struct _proc_device_data 
 {
-    char* buffer;
-    int dice_count;
+    struct dice_expr expr;
     size_t size;
     struct mutex crit_sec_mutex;
 
@@ -38,171 +71,606 @@ typedef struct _proc_device_data
 
 
 proc_device_data mod_data;
+static struct drv_stats dice_stats;
+
+static inline void dice_lock(enum drv_stats_op op)
+{
+    u64 start = drv_stats_clock();
+    mutex_lock(&mod_data.crit_sec_mutex);
+    drv_stats_lock_time(&dice_stats, op, start);
+}
+
+// ----------------------------------------------------------------------------
+// Random numbers
+//
+// Each CPU keeps a pool of random words (see dice_random.h). The pool is only
+// accessed with preemption disabled (get_cpu_ptr), so it needs no lock.
+
+static DEFINE_PER_CPU(struct dice_pool, dice_pools) = { .next = DICE_POOL_LEN };
+
+// Rolls 'count' dice having the given number of sides (results in 
+// [1, sides]). Preemption is disabled for the whole batch: callers should
+// keep batches small (DICE_ROLL_BATCH).
+static void dice_roll(u32 *results, unsigned int count, u32 sides)
+{
+    struct dice_pool *pool = get_cpu_ptr(&dice_pools);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        results[i] = 1u + dice_pool_below(pool, sides);
+    }
+    put_cpu_ptr(&dice_pools);
+}
+
+// Rolls 'count' dice having the given number of sides (at most 
+// DICE_MAX_SIDES), one byte each (see dice_pool_roll_bytes). Preemption is
+// disabled for the whole batch: callers should keep batches small 
+// (DICE_BIN_CHUNK).
+static void dice_roll_bytes(u8 *results, size_t count, u32 sides)
+{
+    struct dice_pool *pool = get_cpu_ptr(&dice_pools);
+    dice_pool_roll_bytes(pool, results, count, sides);
+    put_cpu_ptr(&dice_pools);
+}
+
+// Rolls the dice of an expression whose dice have at most DICE_MAX_SIDES
+// sides, counting the occurrences of each face into 'histogram' (indexed by
+// face): rolls are produced a chunk of bytes at a time, and counted into
+// four interleaved sets of counters, so that consecutive equal rolls do not
+// serialize on the same counter. The counters are flushed into the 
+// histogram before they can overflow.
+static int dice_count_rolls(const struct dice_expr *expr, u64 *histogram)
+{
+    u32 (*counts)[DICE_MAX_SIDES + 1] = kcalloc(4, sizeof(*counts), GFP_KERNEL);
+    u8 chunk[DICE_BIN_CHUNK];
+    u64 pending = 0;
+
+    if (!counts)
+    {
+        return -ENOMEM;
+    }
+    for (u64 done = 0; done < expr->count; )
+    {
+        size_t n = min_t(u64, expr->count - done, DICE_BIN_CHUNK);
+        size_t i = 0;
+        dice_roll_bytes(chunk, n, expr->sides);
+        for (; i + 4 <= n; i += 4)
+        {
+            counts[0][chunk[i]]++;
+            counts[1][chunk[i + 1]]++;
+            counts[2][chunk[i + 2]]++;
+            counts[3][chunk[i + 3]]++;
+        }
+        for (; i < n; i++)
+        {
+            counts[0][chunk[i]]++;
+        }
+        done += n;
+        pending += n;
+        if (pending >= DICE_COUNT_FLUSH || done == expr->count)
+        {
+            for (u32 face = 1; face <= expr->sides; face++)
+            {
+                histogram[face] += counts[0][face] + counts[1][face] + counts[2][face] + counts[3][face];
+            }
+            memset(counts, 0, 4 * sizeof(*counts));
+            pending = 0;
+            if (fatal_signal_pending(current))
+            {
+                kfree(counts);
+                return -EINTR;
+            }
+            cond_resched();
+        }
+    }
+    kfree(counts);
+    return 0;
+}
+
+// Computes the aggregates of an expression. Dice having at most 
+// DICE_MAX_SIDES sides are counted (the aggregates then being derived from
+// the histogram, which must be provided), others are rolled in batches.
+static int dice_aggregate(const struct dice_expr *expr, u64 *histogram, struct dice_result *result)
+{
+    if (expr->sides <= DICE_MAX_SIDES)
+    {
+        memset(histogram, 0, (expr->sides + 1) * sizeof(u64));
+        int status = dice_count_rolls(expr, histogram);
+        if (status)
+        {
+            return status;
+        }
+        dice_result_from_histogram(expr, histogram, result);
+        return 0;
+    }
+
+    result->sum = 0;
+    result->min = expr->count ? U32_MAX : 0;
+    result->max = 0;
+    u32 dice_rolls[DICE_ROLL_BATCH];
+    for (u64 done = 0; done < expr->count; )
+    {
+        unsigned int n = min_t(u64, expr->count - done, DICE_ROLL_BATCH);
+        dice_roll(dice_rolls, n, expr->sides);
+        for (unsigned int i = 0; i < n; i++)
+        {
+            result->sum += dice_rolls[i];
+            result->min = min(result->min, dice_rolls[i]);
+            result->max = max(result->max, dice_rolls[i]);
+        }
+        done += n;
+        if (done % DICE_COUNT_FLUSH == 0)
+        {
+            if (fatal_signal_pending(current))
+            {
+                return -EINTR;
+            }
+            cond_resched();
+        }
+    }
+    return 0;
+}
 
 // ----------------------------------------------------------------------------
 // IO operations
 
-static int tmp_copy(const char* src, int len, char* dst, int dstIndex)
+// Each open file is a session, with its own expression and results: the
+// default expression is captured when the file is opened, and writes to a
+// file opened for reading and writing only change that file's expression.
+// Writes to a write-only file (e.g. 'echo 6 > /proc/dice') change the 
+// default, for the files opened afterwards. Sessions thus never affect each
+// other, and only the default is shared (rolls come from per-CPU pools).
+//
+// Reading is served through seq_file: the output is generated one record at
+// a time, into a buffer of bounded size that is copied to the reader as it
+// fills up, honoring the reader's buffer size and file position. Any number
+// of dice can thus be rolled. Records are:
+// - in list mode, a batch of DICE_ROLL_BATCH rolls;
+// - in hist mode, the count of a face;
+// - otherwise, the aggregate (a single record).
+
+// State of a session, protected by the seq_file's lock. Aggregates are 
+// computed once, on the first read; 'histogram' (indexed by face) is only
+// allocated when aggregating dice having at most DICE_MAX_SIDES sides.
+struct dice_session {
+    struct dice_expr expr;
+    bool computed;
+    struct dice_result result;
+    u64 *histogram;
+};
+
+static loff_t dice_seq_records(const struct dice_session *session)
+{
+    switch (session->expr.mode)
+    {
+        case DICE_MODE_LIST:
+            return DIV_ROUND_UP_ULL(session->expr.count, DICE_ROLL_BATCH);
+        case DICE_MODE_HIST:
+            return session->expr.sides;
+        default:
+            return 1;
+    }
+}
+
+static void *dice_seq_start(struct seq_file *s, loff_t *pos)
 {
-    int count = 0;
-    for (int srcIndex = 0; srcIndex < len; srcIndex++, count++)
+    struct dice_session *session = s->private;
+    if (session->expr.mode != DICE_MODE_LIST && !session->computed)
     {
-        // (DICE_BUF_LEN - 1) -> ensuring we have one slot left for the 
-        // string termination character at the end.
-        if (dstIndex >= (DICE_BUF_LEN - 1))
+        if (session->expr.sides <= DICE_MAX_SIDES && !session->histogram)
         {
-            printk(KERN_DEBUG "Cannot copy: end of destination buffer reached\n");
-            goto Error;
+            session->histogram = kcalloc(session->expr.sides + 1, sizeof(u64), GFP_KERNEL);
+            if (!session->histogram)
+            {
+                return ERR_PTR(-ENOMEM);
+            }
         }
-        printk(KERN_DEBUG "Copying character %c in source buffer at index %d to destination buffer at index %d\n", src[srcIndex], srcIndex, (dstIndex + count));
-        dst[dstIndex + count] = src[srcIndex];
+        int status = dice_aggregate(&session->expr, session->histogram, &session->result);
+        if (status)
+        {
+            return ERR_PTR(status);
+        }
+        session->computed = true;
     }
+    return *pos < dice_seq_records(session) ? pos : NULL;
+}
 
-    return count;
+static void *dice_seq_next(struct seq_file *s, void *v, loff_t *pos)
+{
+    ++*pos;
+    return dice_seq_start(s, pos);
+}
 
-    Error:
-        return -1;
+static void dice_seq_stop(struct seq_file *s, void *v)
+{
 }
 
+// In list mode, rolls a batch of dice: if the record does not fit in what
+// remains of the seq_file buffer, it is discarded and shown again later, the
+// dice then being simply rolled anew (see dice_show_rolls).
+static int dice_seq_show(struct seq_file *s, void *v)
+{
+    struct dice_session *session = s->private;
+    loff_t record = *(loff_t *)v;
+
+    if (session->expr.mode == DICE_MODE_LIST)
+    {
+        u64 first = record * DICE_ROLL_BATCH;
+        unsigned int count = min_t(u64, DICE_ROLL_BATCH, session->expr.count - first);
+        u32 dice_rolls[DICE_ROLL_BATCH];
+
+        dice_roll(dice_rolls, count, session->expr.sides);
+        dice_show_rolls(s, &session->expr, first, dice_rolls, count);
+    }
+    else
+    {
+        dice_show_aggregate(s, &session->expr, &session->result, session->histogram, record);
+    }
+    return 0;
+}
+
+static const struct seq_operations dice_seq_ops = {
+    .start = dice_seq_start,
+    .next = dice_seq_next,
+    .stop = dice_seq_stop,
+    .show = dice_seq_show
+};
+
+static int dice_open(struct inode *inode, struct file *file)
+{
+    struct dice_session *session = __seq_open_private(file, &dice_seq_ops, sizeof(*session));
+    if (!session)
+    {
+        return -ENOMEM;
+    }
+    dice_lock(DRV_STATS_READ);
+    session->expr = mod_data.expr;
+    mutex_unlock(&mod_data.crit_sec_mutex);
+    return 0;
+}
+
+static int dice_release(struct inode *inode, struct file *file)
+{
+    struct seq_file *m = file->private_data;
+    struct dice_session *session = m->private;
+    kfree(session->histogram);
+    return seq_release_private(inode, file);
+}
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
 static ssize_t dice_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
-#else
-static int dice_write(struct file *file,const char * buf, unsigned long count, void *data)
-#endif
 {
-    printk(KERN_INFO "dice::write");
-    mutex_lock(&mod_data.crit_sec_mutex);
+    struct seq_file *m = file->private_data;
+    struct dice_session *session = m->private;
+    char input[DICE_BUF_LEN];
+    struct dice_expr expr;
 
     size_t len = min(DICE_BUF_LEN - 1, count);
-    printk(KERN_INFO "actual size: %lu, to size: %lu, from size: %lu\n", len, DICE_BUF_LEN, count);
-    int status = copy_from_user(mod_data.buffer, buf, len);
-    // Insuring that buffer is a valid string
-    mod_data.buffer[len] = '\0';
+    int status = copy_from_user(input, buf, len);
     if (status)
     {
-        printk(KERN_ERR "Error copying data from user space (status code: %d)", status);
+        status = -EFAULT;
         goto Error;
     }
-    printk(KERN_DEBUG "Got dice count from user: '%s' (copied %lu chars. %lu)\n", mod_data.buffer, len, strlen(mod_data.buffer));
-
-    int new_dice_count;
-    status = kstrtoint(mod_data.buffer, 10, &new_dice_count);
+    // Insuring that buffer is a valid string
+    input[len] = '\0';
+    status = dice_parse(input, &expr);
     if (status)
     {
-        printk(KERN_ERR "Could no convert dice count '%s' (status code: %d)\n", mod_data.buffer, status);
+        pr_debug("dice::write: could not parse dice expression (status code: %d)\n", status);
         goto Error;        
     }
-    printk(KERN_INFO "Parsed dice count: %d\n", new_dice_count);
-    mod_data.dice_count = new_dice_count;
+    pr_debug("dice::write: parsed dice expression: %llud%u (%s)\n", expr.count, expr.sides, dice_mode_names[expr.mode]);
 
-    mutex_unlock(&mod_data.crit_sec_mutex);
+    if (!(file->f_mode & FMODE_READ))
+    {
+        dice_lock(DRV_STATS_WRITE);
+        mod_data.expr = expr;
+        mutex_unlock(&mod_data.crit_sec_mutex);
+    }
+    else
+    {
+        // The new expression is read from the start.
+        mutex_lock(&m->lock);
+        session->expr = expr;
+        session->computed = false;
+        kfree(session->histogram);
+        session->histogram = NULL;
+        mutex_unlock(&m->lock);
+        seq_lseek(file, 0, SEEK_SET);
+        *ppos = 0;
+    }
+    drv_stats_account(&dice_stats, DRV_STATS_WRITE, len);
     return len;
 
     Error:
-        mutex_unlock(&mod_data.crit_sec_mutex);
-        return -EFAULT;
+        drv_stats_account(&dice_stats, DRV_STATS_WRITE, status);
+        return status;
+}
 
+static ssize_t dice_read(struct file *file, char __user *buf, size_t len, loff_t *ppos)
+{
+    ssize_t status = seq_read(file, buf, len, ppos);
+    drv_stats_account(&dice_stats, DRV_STATS_READ, status);
+    return status;
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
-static int eof[1];
-static ssize_t dice_read(struct file *file, char *buf, size_t len, loff_t *ppos)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+static const struct proc_ops proc_fops = {
+    .proc_open = dice_open,
+    .proc_read = dice_read,
+    .proc_write = dice_write,
+    .proc_lseek = seq_lseek,
+    .proc_release = dice_release
+};
 #else
-static int dice_read(char *buf, char **start, off_t offset, int len, int *eof, void *unused)
+static const struct file_operations  proc_fops = {
+    .owner = THIS_MODULE,
+    .open = dice_open,
+    .read = dice_read,
+    .write = dice_write,
+    .llseek = seq_lseek,
+    .release = dice_release
+};
 #endif
-{
-    printk(KERN_INFO "dice::read");
-    mutex_lock(&mod_data.crit_sec_mutex);
 
-    // Convert to pointer for more intuitive use
-    int fmt_total_len = 0;
+// ----------------------------------------------------------------------------
+// Binary device
+//
+// /dev/dice returns packed rolls (see dice_ioctl.h): no formatting, and 
+// bulk transfers, either through read or through a mapped ring that the
+// kernel refills on request. The ring's counters are 64-bit words, accessed
+// atomically (smp_load_acquire/smp_store_release): the driver is only built
+// for 64-bit kernels.
+
+#if BITS_PER_LONG != 64
+#error "dice needs a 64-bit kernel (the mapped ring's counters are atomic 64-bit words)"
+#endif
 
-    if (*eof) { 
-        *eof = 0; 
-    }
-    else
+// State of an open file. 'lock' protects the ring's allocation and refills.
+// 'capacity' and 'head' are the kernel's own copies of the ring's: the 
+// control page is writable by user space, which must not be able to make
+// the kernel write outside of the ring.
+struct dice_bin {
+    struct mutex lock;
+    u32 sides;
+    struct dice_ring_ctrl* ctrl;
+    u8* ring;
+    unsigned long capacity;
+    u64 head;
+};
+
+static dev_t dice_dev_no;
+static struct cdev dice_cdev;
+static struct class* dice_class;
+static struct device* dice_device;
+
+static int dice_bin_open(struct inode *inode, struct file *file)
+{
+    struct dice_bin *bin = kzalloc(sizeof(*bin), GFP_KERNEL);
+    if (!bin)
     {
-        *eof = 1;
+        return -ENOMEM;
+    }
+    mutex_init(&bin->lock);
+    bin->sides = sides;
+    file->private_data = bin;
+    // Rolls are a stream: lseek fails with -ESPIPE.
+    return stream_open(inode, file);
+}
+
+static int dice_bin_release(struct inode *inode, struct file *file)
+{
+    struct dice_bin *bin = file->private_data;
+    vfree(bin->ctrl);
+    kfree(bin);
+    return 0;
+}
 
-        unsigned dice_roll_result;
-        char fmt_buf[DICE_BUF_LEN];
-        int fmt_len;
-        int status = 0;
-        for (int dice_num = 0; dice_num < mod_data.dice_count; dice_num++)
+// Rolls dice a chunk at a time, into a small buffer on the stack that is 
+// then copied out: any read size is served with bounded memory.
+static ssize_t dice_bin_read(struct file *file, char __user *buf, size_t len, loff_t *ppos)
+{
+    struct dice_bin *bin = file->private_data;
+    u32 bin_sides = READ_ONCE(bin->sides);
+    u8 chunk[DICE_BIN_CHUNK];
+    size_t done = 0;
+
+    while (done < len)
+    {
+        size_t count = min_t(size_t, len - done, DICE_BIN_CHUNK);
+        dice_roll_bytes(chunk, count, bin_sides);
+        if (copy_to_user(buf + done, chunk, count))
+        {
+            break;
+        }
+        done += count;
+        if (fatal_signal_pending(current))
         {
-            
-            // () not needed with sizeof object
-            get_random_bytes(&dice_roll_result, sizeof dice_roll_result); 
+            break;
+        }
+        cond_resched();
+    }
 
-            // Best to use unsigned constants with unsigned objects.
-            dice_roll_result = 1u + (dice_roll_result % 6u);
+    ssize_t status = done > 0 ? done : (len > 0 ? -EFAULT : 0);
+    drv_stats_account(&dice_stats, DRV_STATS_READ, status);
+    return status;
+}
 
-            if (dice_num == 0)
-            {
-                // scnprintf returns the number of characters written, excluding
-                // the string termination char ('\0')
-                fmt_len = scnprintf(fmt_buf, DICE_BUF_LEN, "%u", dice_roll_result);
-            }
-            // Adding EOL character since we're processing the result for the last dice
-            else if (dice_num == mod_data.dice_count - 1)
-            {
-                fmt_len = scnprintf(fmt_buf, DICE_BUF_LEN, ",%u\n", dice_roll_result);
-            }
-            else
-            {
-                fmt_len = scnprintf(fmt_buf, DICE_BUF_LEN, ",%u", dice_roll_result);
-            }
-            if (fmt_len < 0)
-            {
-                printk(KERN_ERR "Error converting dice roll result: %u\n", dice_roll_result);
-                goto Error;
-            }
-            printk(KERN_DEBUG "Got temp result for dice %d: %lu (string: %s)\n", dice_num, dice_roll_result, fmt_buf);
-            status =  tmp_copy(fmt_buf, fmt_len, mod_data.buffer, fmt_total_len);
-            if (status < 0)
+// Rolls dice into all the free space of the ring, publishing them every
+// DICE_REFILL_CHUNK bytes, and rescheduling in between: however large the
+// ring, the consumer can start on the first rolls, and the CPU is not held
+// for longer than a chunk takes. Stops early on a fatal signal (what was
+// published so far being kept). Returns the number of rolls produced.
+// Must be called with the file's lock held.
+static long dice_bin_refill(struct dice_bin *bin)
+{
+    unsigned long capacity = bin->capacity;
+    u64 tail = smp_load_acquire(&bin->ctrl->tail);
+    // The tail is controlled by user space: it is clamped so that rolls
+    // not yet consumed are never overwritten, and at most the whole ring
+    // is refilled.
+    unsigned long free = capacity - min_t(u64, bin->head - tail, capacity);
+    unsigned long done = 0;
+
+    while (done < free)
+    {
+        unsigned long end = done + min(free - done, (unsigned long)DICE_REFILL_CHUNK);
+        while (done < end)
+        {
+            unsigned long pos = (bin->head + done) & (capacity - 1);
+            unsigned long count = min3(end - done, capacity - pos, (unsigned long)DICE_BIN_CHUNK);
+            dice_roll_bytes(bin->ring + pos, count, bin->sides);
+            done += count;
+        }
+        smp_store_release(&bin->ctrl->head, bin->head + done);
+        if (done < free)
+        {
+            if (fatal_signal_pending(current))
             {
-                goto Error;
+                break;
             }
-            printk(KERN_DEBUG "Copied %d character(s) to target buffer\n", status);
-            fmt_total_len += status;
+            cond_resched();
         }
+    }
+    bin->head += done;
+    return done;
+}
 
-        // Accounting for EOL and string termination character
-        fmt_total_len += 1;
-        // Now adding string termination character to result
-        mod_data.buffer[fmt_total_len - 1] = '\0';
-        printk(KERN_INFO "Got dice roll result: %s\n", mod_data.buffer);
-        ssize_t  actual_len = min(fmt_total_len, len);
+// The ring is allocated on first mapping, full of rolls.
+static int dice_bin_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct dice_bin *bin = file->private_data;
+    int status = 0;
 
-        status = copy_to_user(buf, mod_data.buffer, actual_len);
-        if (status)
+    if (!(vma->vm_flags & VM_SHARED))
+    {
+        return -EINVAL;
+    }
+    mutex_lock(&bin->lock);
+    if (!bin->ctrl)
+    {
+        // vmalloc_user() zeroes the memory and marks it as mappable.
+        bin->ctrl = vmalloc_user(DICE_MMAP_CTRL_LEN + ring_size);
+        if (!bin->ctrl)
         {
-          printk(KERN_ERR "Error copying data to user space (status code: %d)", status);
-          goto Error;
+            status = -ENOMEM;
+            goto Out;
         }
+        // For user space only.
+        bin->ctrl->capacity = ring_size;
+        bin->capacity = ring_size;
+        bin->ring = (u8*)bin->ctrl + DICE_MMAP_CTRL_LEN;
+        dice_bin_refill(bin);
     }
+    status = remap_vmalloc_range(vma, bin->ctrl, vma->vm_pgoff);
 
-    mutex_unlock(&mod_data.crit_sec_mutex);
-    return fmt_total_len;
+    Out:
+        mutex_unlock(&bin->lock);
+        return status;
+}
 
-    Error:
-        mutex_unlock(&mod_data.crit_sec_mutex);
-        return -EFAULT;
-    
+static long dice_bin_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct dice_bin *bin = file->private_data;
+    long status;
+
+    switch (cmd)
+    {
+        case DICE_IOCTL_SIDES:
+        {
+            __u32 new_sides;
+            if (get_user(new_sides, (__u32 __user *)arg))
+            {
+                status = -EFAULT;
+                break;
+            }
+            if (new_sides == 0 || new_sides > DICE_MAX_SIDES)
+            {
+                status = -EINVAL;
+                break;
+            }
+            mutex_lock(&bin->lock);
+            WRITE_ONCE(bin->sides, new_sides);
+            mutex_unlock(&bin->lock);
+            status = 0;
+            break;
+        }
+        case DICE_IOCTL_REFILL:
+            mutex_lock(&bin->lock);
+            status = bin->ctrl ? dice_bin_refill(bin) : -ENXIO;
+            mutex_unlock(&bin->lock);
+            break;
+        default:
+            status = -EINVAL;
+            break;
+    }
+    drv_stats_account(&dice_stats, DRV_STATS_IOCTL, status);
+    return status;
 }
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
-static const struct proc_ops proc_fops = {
-    .proc_read = dice_read,
-    .proc_write = dice_write
-};
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
-static const struct file_operations  proc_fops = {
+
+static const struct file_operations dice_bin_ops = {
     .owner = THIS_MODULE,
-    .read = dice_read,
-    .write = dice_write
+    .open = dice_bin_open,
+    .release = dice_bin_release,
+    .read = dice_bin_read,
+    .mmap = dice_bin_mmap,
+    .unlocked_ioctl = dice_bin_ioctl
 };
+
+static int dice_bin_init(void)
+{
+    sides = clamp(sides, 1u, (unsigned int)DICE_MAX_SIDES);
+    if (ring_size < PAGE_SIZE)
+    {
+        ring_size = PAGE_SIZE;
+    }
+    ring_size = roundup_pow_of_two(ring_size);
+
+    int status = alloc_chrdev_region(&dice_dev_no, 0, 1, DICE_DEVICE_NAME);
+    if (status)
+    {
+        goto Error;
+    }
+    cdev_init(&dice_cdev, &dice_bin_ops);
+    status = cdev_add(&dice_cdev, dice_dev_no, 1);
+    if (status)
+    {
+        goto ErrorRegion;
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,4,0)
+    dice_class = class_create(DICE_CLASS_NAME);
+#else
+    dice_class = class_create(THIS_MODULE, DICE_CLASS_NAME);
 #endif
+    if (IS_ERR(dice_class))
+    {
+        status = PTR_ERR(dice_class);
+        goto ErrorCdev;
+    }
+    dice_device = device_create(dice_class, NULL, dice_dev_no, NULL, DICE_DEVICE_NAME);
+    if (IS_ERR(dice_device))
+    {
+        status = PTR_ERR(dice_device);
+        goto ErrorClass;
+    }
+    return 0;
+
+    ErrorClass:
+        class_destroy(dice_class);
+    ErrorCdev:
+        cdev_del(&dice_cdev);
+    ErrorRegion:
+        unregister_chrdev_region(dice_dev_no, 1);
+    Error:
+        return status;
+}
+
+static void dice_bin_exit(void)
+{
+    device_destroy(dice_class, dice_dev_no);
+    class_destroy(dice_class);
+    cdev_del(&dice_cdev);
+    unregister_chrdev_region(dice_dev_no, 1);
+}
 
 // ----------------------------------------------------------------------------
 // Lifecycle
@@ -211,36 +679,42 @@ static int __init dice_init(void)
 {
     printk(KERN_INFO "-> dice::init\n");
 
-    #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
-    proc_dice = proc_create(DICE_PROC_NAME, 0777, NULL, &proc_fops);
-    if(proc_dice == NULL)
+    if (drv_stats_init(&dice_stats, DICE_PROC_NAME))
     {
-        goto Error;
+        return -ENOMEM;
     }
-    #else
-    proc_dice = create_proc_entry(DICE_PROC_NAME, 0, 0);
+
+    // The state must be ready before the entry becomes visible.
+    mod_data.expr.count = DICE_DEFAULT_DICE_COUNT;
+    mod_data.expr.sides = DICE_SIDES;
+    mod_data.expr.mode = DICE_MODE_LIST;
+    mutex_init(&mod_data.crit_sec_mutex);
+
+    proc_dice = proc_create(DICE_PROC_NAME, 0777, NULL, &proc_fops);
     if(proc_dice == NULL)
     {
         goto Error;
     }
-    proc_dice->read_proc = dice_read;
-    proc_dice->write_proc = dice_write;
-    #endif
-
 
     #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,29)
     proc_dice->owner = THIS_MODULE;
     #endif
 
-    mod_data.buffer = vmalloc(DICE_BUF_LEN);
-    mod_data.dice_count = DICE_DEFAULT_DICE_COUNT;
+    int status = dice_bin_init();
+    if (status)
+    {
+        printk(KERN_ERR "Could not create the %s device (status code: %d)\n", DICE_DEVICE_NAME, status);
+        remove_proc_entry(DICE_PROC_NAME, 0);
+        drv_stats_destroy(&dice_stats);
+        return status;
+    }
 
-    mutex_init(&mod_data.crit_sec_mutex);
     printk(KERN_INFO "<- dice::init\n");
     return 0;
 
     Error:
         printk(KERN_ERR, "Error occurred. Aborting module initialization (could not create proc entry %s)\n", DICE_PROC_NAME);
+        drv_stats_destroy(&dice_stats);
         return -ENOMEM;
   
 }
@@ -248,14 +722,12 @@ static int __init dice_init(void)
 static void __exit dice_exit(void)
 {
     printk(KERN_INFO, "-> dice::exit\n");
-    if (mod_data.buffer)
-    {
-        vfree(mod_data.buffer);
-    }
+    dice_bin_exit();
     if (proc_dice)
     {
         remove_proc_entry(DICE_PROC_NAME, 0);
     }
+    drv_stats_destroy(&dice_stats);
     printk(KERN_INFO, "<- dice::exit\n");
 }
 
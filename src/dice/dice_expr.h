@@ -0,0 +1,160 @@
+#ifndef DICE_EXPR_H
+#define DICE_EXPR_H
+
+#include <linux/types.h>
+#include <linux/kernel.h>       // Needed for kstrtou64/kstrtou32
+#include <linux/limits.h>       // Needed for U32_MAX
+#include <linux/minmax.h>       // Needed for min
+#include <linux/string.h>       // Needed for strsep/strim/match_string
+#include <linux/seq_file.h>     // Needed for seq_put_decimal_ull/seq_putc
+
+// Includers include dice_ioctl.h first (for DICE_MAX_SIDES).
+
+#define DICE_SIDES 6
+#define DICE_ROLL_BATCH 32
+#define DICE_MAX_EXPR_SIDES 1000000
+#define DICE_MAX_EXPR_COUNT (1ULL << 40)
+
+// ----------------------------------------------------------------------------
+// Expressions
+//
+// Writing to /proc/dice sets what is rolled, and what is returned:
+// - "<count>": rolls <count> six-sided dice, returning the list of rolls;
+// - "<count>d<sides> [<mode>]": rolls <count> dice having <sides> sides,
+//   returning, depending on the mode:
+//   - list (the default): the list of rolls;
+//   - sum, min or max: the sum, minimum or maximum of the rolls;
+//   - hist: the number of times each face came up (one "<face> <count>"
+//     line per face); only for dice having at most DICE_MAX_SIDES sides.
+// Aggregates are computed in the kernel: only the result is read.
+//
+// The following functions parse expressions and format what is read (the
+// driver, dice.c, rolls the dice); the tests (dice_kunit.c) call them with
+// known rolls.
+
+// What reading /proc/dice returns: the rolls themselves (as a list), or only
+// an aggregate of them.
+enum dice_mode {
+    DICE_MODE_LIST,
+    DICE_MODE_SUM,
+    DICE_MODE_MIN,
+    DICE_MODE_MAX,
+    DICE_MODE_HIST
+};
+
+static const char* const dice_mode_names[] = { "list", "sum", "min", "max", "hist" };
+
+// A roll of 'count' dice having 'sides' sides ("<count>d<sides>").
+struct dice_expr {
+    u64 count;
+    u32 sides;
+    enum dice_mode mode;
+};
+
+// Aggregates of the rolls of an expression.
+struct dice_result {
+    u64 sum;
+    u32 min;
+    u32 max;
+};
+
+// Parses an expression (null-terminated, modified).
+static inline int dice_parse(char *input, struct dice_expr *expr)
+{
+    char *mode = strim(input);
+    char *sides = strsep(&mode, " \t");
+    char *count = strsep(&sides, "d");
+
+    int status = kstrtou64(count, 10, &expr->count);
+    if (status)
+    {
+        return status;
+    }
+    expr->sides = DICE_SIDES;
+    if (sides)
+    {
+        status = kstrtou32(sides, 10, &expr->sides);
+        if (status)
+        {
+            return status;
+        }
+    }
+    expr->mode = DICE_MODE_LIST;
+    if (mode)
+    {
+        status = match_string(dice_mode_names, ARRAY_SIZE(dice_mode_names), skip_spaces(mode));
+        if (status < 0)
+        {
+            return status;
+        }
+        expr->mode = status;
+    }
+    if (expr->count > DICE_MAX_EXPR_COUNT || expr->sides == 0 || expr->sides > DICE_MAX_EXPR_SIDES ||
+        (expr->mode == DICE_MODE_HIST && expr->sides > DICE_MAX_SIDES))
+    {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+// Derives the aggregates of an expression from the histogram of its rolls
+// (indexed by face).
+static inline void dice_result_from_histogram(const struct dice_expr *expr, const u64 *histogram, struct dice_result *result)
+{
+    result->sum = 0;
+    result->min = expr->count ? U32_MAX : 0;
+    result->max = 0;
+    for (u32 face = 1; face <= expr->sides; face++)
+    {
+        if (histogram[face])
+        {
+            result->sum += histogram[face] * face;
+            result->min = min(result->min, face);
+            result->max = face;
+        }
+    }
+}
+
+// Formats a batch of rolls (list mode), 'first' being the index of the
+// batch's first roll among the expression's: as comma-separated values, the
+// last batch being terminated by an EOL character. If the record does not
+// fit in what remains of the seq_file buffer, seq_file discards it and shows
+// it again later.
+static inline void dice_show_rolls(struct seq_file *s, const struct dice_expr *expr, u64 first, const u32 *rolls, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i++)
+    {
+        seq_put_decimal_ull(s, first + i == 0 ? "" : ",", rolls[i]);
+    }
+    if (first + count == expr->count)
+    {
+        seq_putc(s, '\n');
+    }
+}
+
+// Formats an aggregate, as a line: the count of face 'record + 1' in hist
+// mode, the single result otherwise.
+static inline void dice_show_aggregate(struct seq_file *s, const struct dice_expr *expr, const struct dice_result *result, const u64 *histogram, loff_t record)
+{
+    switch (expr->mode)
+    {
+        case DICE_MODE_HIST:
+            seq_put_decimal_ull(s, "", record + 1);
+            seq_put_decimal_ull(s, " ", histogram[record + 1]);
+            break;
+        case DICE_MODE_SUM:
+            seq_put_decimal_ull(s, "", result->sum);
+            break;
+        case DICE_MODE_MIN:
+            seq_put_decimal_ull(s, "", result->min);
+            break;
+        case DICE_MODE_MAX:
+            seq_put_decimal_ull(s, "", result->max);
+            break;
+        case DICE_MODE_LIST:
+            return;
+    }
+    seq_putc(s, '\n');
+}
+
+#endif
@@ -0,0 +1,35 @@
+#include <linux/types.h>
+
+// Binary interface (/dev/dice): reading returns packed rolls, one byte per
+// die, each in [1, sides]. The number of sides defaults to the 'sides'
+// module parameter, and can be changed for an open file with
+// DICE_IOCTL_SIDES (taking a pointer to a __u32 in [1, DICE_MAX_SIDES]).
+#define DICE_IOCTL_MAGIC 0xFD
+#define DICE_IOCTL_SIDES_CMD 0x00
+#define DICE_IOCTL_REFILL_CMD 0x01
+
+#define DICE_MAX_SIDES 255
+
+// Layout of the memory that can be mapped from the device (each open file
+// has its own): a control page (at offset 0) holding the ring's counters,
+// immediately followed by the rolls (at offset DICE_MMAP_CTRL_LEN,
+// 'capacity' bytes long, capacity being a power of two). The mapping must
+// be shared, and cover the control page and the rolls.
+//
+// 'head' and 'tail' are free-running byte counters: the rolls available
+// span [tail, head), indexes into the rolls being obtained by masking with
+// (capacity - 1). The kernel is the producer: the ring is full when first
+// mapped, and DICE_IOCTL_REFILL rolls dice into all the space consumed
+// since (returning the number of rolls produced), advancing 'head' as it
+// goes: rolls can be consumed before a large refill is over.
+// The consumer reads rolls, then advances 'tail' (with release semantics).
+// A change of sides applies to the rolls produced after it. The counters
+// are 64-bit whatever the word size, so that 32-bit processes see the same
+// layout as the 64-bit kernel.
+#define DICE_MMAP_CTRL_LEN 4096
+
+struct dice_ring_ctrl {
+    __u64 head;
+    __u64 tail;
+    __u64 capacity;
+};
@@ -0,0 +1,429 @@
+#include <kunit/test.h>         // Needed for the KUnit API
+#include <linux/module.h>       // Needed by all modules
+#include <linux/random.h>       // Needed for get_random_bytes
+#include <linux/seq_file.h>     // Needed for seq_file
+
+#include "dice_ioctl.h"
+#include "dice_expr.h"
+#include "dice_random.h"
+#include "../common/drv_bench.h"
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("yduchesne");
+MODULE_DESCRIPTION("Tests and benchmarks of the dice random numbers and expressions");
+
+// ----------------------------------------------------------------------------
+// Parameters
+
+static bool bench;
+module_param(bench, bool, 0444);
+MODULE_PARM_DESC(bench, "Run the timed benchmarks (dice_random_bench suite)");
+
+// ----------------------------------------------------------------------------
+// Tests
+//
+// The pools are filled by the tests themselves (next = 0), so that the words
+// consumed, and thus the results, are known in advance.
+
+// Fills the pool with the given words (the rest being random).
+static void dice_kunit_fill(struct dice_pool *pool, const u32 *words, unsigned int count)
+{
+    get_random_bytes(pool->values, sizeof(pool->values));
+    memcpy(pool->values, words, count * sizeof(*words));
+    pool->next = 0;
+}
+
+// Returns true if 'word' yields a value in [0, ceil) (stored into 'value'),
+// false if it is rejected: computed with divisions, unlike dice_pool_below.
+static bool dice_kunit_below(u32 word, u32 ceil, u32 *value)
+{
+    u64 product = (u64)word * ceil;
+    if ((u32)product < (u32)(BIT_ULL(32) % ceil))
+    {
+        return false;
+    }
+    *value = product >> 32;
+    return true;
+}
+
+static void dice_kunit_below_rejects(struct kunit *test)
+{
+    static const u32 ceils[] = { 1, 2, 3, 6, 7, 10, 20, 100, 255, 1000, 0x7fffffff, 0x80000001, 0xfffffffe, 0xffffffff };
+    struct dice_pool *pool = kunit_kmalloc(test, sizeof(*pool), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, pool);
+
+    for (unsigned int c = 0; c < ARRAY_SIZE(ceils); c++)
+    {
+        u32 ceil = ceils[c];
+        // The smallest words are the ones rejected (their product's low
+        // bits being below the threshold), so are the words just past
+        // each multiple of 2^32 / ceil.
+        u32 words[8] = { 0, 1, 2, 3, U32_MAX, U32_MAX / ceil + 1, U32_MAX / 2, 0 };
+        get_random_bytes(&words[7], sizeof(words[7]));
+
+        for (unsigned int first = 0; first < ARRAY_SIZE(words); first++)
+        {
+            unsigned int consumed = first;
+            u32 expected = 0;
+            while (consumed < ARRAY_SIZE(words) && !dice_kunit_below(words[consumed], ceil, &expected))
+            {
+                consumed++;
+            }
+            if (consumed == ARRAY_SIZE(words))
+            {
+                // Every remaining word is rejected: not deterministic.
+                continue;
+            }
+            dice_kunit_fill(pool, words + first, ARRAY_SIZE(words) - first);
+            u32 value = dice_pool_below(pool, ceil);
+            KUNIT_EXPECT_EQ_MSG(test, value, expected, "ceil: %u, first word: 0x%08x", ceil, words[first]);
+            KUNIT_EXPECT_EQ_MSG(test, pool->next, consumed - first + 1, "ceil: %u, first word: 0x%08x", ceil, words[first]);
+        }
+    }
+}
+
+static void dice_kunit_below_range(struct kunit *test)
+{
+    struct dice_pool *pool = kunit_kmalloc(test, sizeof(*pool), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, pool);
+    pool->next = DICE_POOL_LEN;
+
+    for (u32 ceil = 1; ceil <= 1000; ceil++)
+    {
+        for (unsigned int i = 0; i < 100; i++)
+        {
+            u32 value = dice_pool_below(pool, ceil);
+            KUNIT_ASSERT_LT_MSG(test, value, ceil, "ceil: %u", ceil);
+        }
+    }
+}
+
+// Each die needs one byte: feeding every byte value once (64 words), every 
+// face must come up exactly 256 / sides times, the 256 % sides remaining 
+// bytes being rejected.
+static void dice_kunit_roll_bytes_uniform(struct kunit *test)
+{
+    struct dice_pool *pool = kunit_kmalloc(test, sizeof(*pool), GFP_KERNEL);
+    u8 *results = kunit_kmalloc(test, 256, GFP_KERNEL);
+    u32 *counts = kunit_kmalloc(test, (DICE_MAX_SIDES + 1) * sizeof(*counts), GFP_KERNEL);
+    u32 words[64];
+
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, pool);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, results);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, counts);
+
+    for (u32 sides = 1; sides <= DICE_MAX_SIDES; sides++)
+    {
+        // Byte values in an order unrelated to the faces (167 is odd, so 
+        // that 'b * 167' goes through all of them).
+        for (unsigned int b = 0; b < 256; b++)
+        {
+            ((u8 *)words)[b] = b * 167;
+        }
+        dice_kunit_fill(pool, words, ARRAY_SIZE(words));
+        memset(counts, 0, (DICE_MAX_SIDES + 1) * sizeof(*counts));
+
+        size_t count = 256 - 256 % sides;
+        dice_pool_roll_bytes(pool, results, count, sides);
+        for (size_t i = 0; i < count; i++)
+        {
+            KUNIT_ASSERT_GE_MSG(test, results[i], 1, "sides: %u", sides);
+            KUNIT_ASSERT_LE_MSG(test, results[i], sides, "sides: %u", sides);
+            counts[results[i]]++;
+        }
+        for (u32 face = 1; face <= sides; face++)
+        {
+            KUNIT_EXPECT_EQ_MSG(test, counts[face], 256 / sides, "sides: %u, face: %u", sides, face);
+        }
+        // The last word is not read when its bytes are all rejected.
+        KUNIT_EXPECT_LE_MSG(test, pool->next, ARRAY_SIZE(words), "sides: %u", sides);
+    }
+}
+
+// Counts that are not a multiple of four: the last word is partially used.
+static void dice_kunit_roll_bytes_count(struct kunit *test)
+{
+    struct dice_pool *pool = kunit_kmalloc(test, sizeof(*pool), GFP_KERNEL);
+    u8 results[9];
+    // With 2 sides, no byte is rejected.
+    static const u32 words[] = { 0x80008000, 0x00800080, 0xffffffff };
+
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, pool);
+    for (size_t count = 0; count <= ARRAY_SIZE(results); count++)
+    {
+        dice_kunit_fill(pool, words, ARRAY_SIZE(words));
+        memset(results, 0, sizeof(results));
+        dice_pool_roll_bytes(pool, results, count, 2);
+        for (size_t i = 0; i < ARRAY_SIZE(results); i++)
+        {
+            u8 expected = i >= count ? 0 : 1 + ((((const u8 *)words)[i] & 0x80) != 0);
+            KUNIT_EXPECT_EQ_MSG(test, results[i], expected, "count: %zu, i: %zu", count, i);
+        }
+        KUNIT_EXPECT_EQ_MSG(test, pool->next, DIV_ROUND_UP(count, 4), "count: %zu", count);
+    }
+}
+
+static struct kunit_case dice_kunit_cases[] = {
+    KUNIT_CASE(dice_kunit_below_rejects),
+    KUNIT_CASE(dice_kunit_below_range),
+    KUNIT_CASE(dice_kunit_roll_bytes_uniform),
+    KUNIT_CASE(dice_kunit_roll_bytes_count),
+    {}
+};
+
+static struct kunit_suite dice_kunit_suite = {
+    .name = "dice_random",
+    .test_cases = dice_kunit_cases,
+};
+
+// ----------------------------------------------------------------------------
+// Expression tests
+//
+// What reading /proc/dice returns is formatted into a seq_file whose buffer
+// is provided by the tests: a small one makes records overflow, as when
+// they do not fit in what remains of the driver's buffer.
+
+#define DICE_KUNIT_SEQ_LEN 512
+
+static void dice_kunit_seq_init(struct seq_file *s, char *buf, size_t size)
+{
+    memset(s, 0, sizeof(*s));
+    s->buf = buf;
+    s->size = size;
+}
+
+static void dice_kunit_parse_valid(struct kunit *test)
+{
+    static const struct {
+        const char *input;
+        struct dice_expr expr;
+    } cases[] = {
+        { "3", { 3, DICE_SIDES, DICE_MODE_LIST } },
+        { "3\n", { 3, DICE_SIDES, DICE_MODE_LIST } },
+        { "0", { 0, DICE_SIDES, DICE_MODE_LIST } },
+        { "10d20", { 10, 20, DICE_MODE_LIST } },
+        { "  10d20 sum\n", { 10, 20, DICE_MODE_SUM } },
+        { "4d8\tmin", { 4, 8, DICE_MODE_MIN } },
+        { "4d8  max", { 4, 8, DICE_MODE_MAX } },
+        { "1000d255 hist", { 1000, DICE_MAX_SIDES, DICE_MODE_HIST } },
+        { "1099511627776d1000000 list", { DICE_MAX_EXPR_COUNT, DICE_MAX_EXPR_SIDES, DICE_MODE_LIST } },
+    };
+
+    for (unsigned int c = 0; c < ARRAY_SIZE(cases); c++)
+    {
+        char input[64];
+        struct dice_expr expr;
+
+        strscpy(input, cases[c].input, sizeof(input));
+        KUNIT_ASSERT_EQ_MSG(test, dice_parse(input, &expr), 0, "input: '%s'", cases[c].input);
+        KUNIT_EXPECT_EQ_MSG(test, expr.count, cases[c].expr.count, "input: '%s'", cases[c].input);
+        KUNIT_EXPECT_EQ_MSG(test, expr.sides, cases[c].expr.sides, "input: '%s'", cases[c].input);
+        KUNIT_EXPECT_EQ_MSG(test, expr.mode, cases[c].expr.mode, "input: '%s'", cases[c].input);
+    }
+}
+
+static void dice_kunit_parse_invalid(struct kunit *test)
+{
+    static const char *const inputs[] = {
+        "", "d6", "-1", "x", "3d", "3d0", "3d1000001", "3d6 avg", "3d6 sum x",
+        "1099511627777", "3d256 hist", "3d6d6"
+    };
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(inputs); i++)
+    {
+        char input[64];
+        struct dice_expr expr;
+
+        strscpy(input, inputs[i], sizeof(input));
+        KUNIT_EXPECT_LT_MSG(test, dice_parse(input, &expr), 0, "input: '%s'", inputs[i]);
+    }
+}
+
+// Batches of rolls concatenate into a single comma-separated line.
+static void dice_kunit_show_rolls(struct kunit *test)
+{
+    struct dice_expr expr = { .count = 5, .sides = 20, .mode = DICE_MODE_LIST };
+    static const u32 rolls[] = { 1, 20, 7, 13, 2 };
+    char buf[DICE_KUNIT_SEQ_LEN];
+    struct seq_file s;
+
+    dice_kunit_seq_init(&s, buf, sizeof(buf));
+    dice_show_rolls(&s, &expr, 0, rolls, 2);
+    dice_show_rolls(&s, &expr, 2, rolls + 2, 3);
+    KUNIT_EXPECT_FALSE(test, seq_has_overflowed(&s));
+    KUNIT_EXPECT_EQ(test, s.count, strlen("1,20,7,13,2\n"));
+    KUNIT_EXPECT_EQ(test, memcmp(buf, "1,20,7,13,2\n", s.count), 0);
+}
+
+// A record that does not fit marks the seq_file as overflowed (seq_file then
+// discards it, and shows it again into a larger buffer).
+static void dice_kunit_show_overflow(struct kunit *test)
+{
+    struct dice_expr expr = { .count = DICE_ROLL_BATCH, .sides = 100, .mode = DICE_MODE_LIST };
+    u32 rolls[DICE_ROLL_BATCH];
+    char buf[DICE_KUNIT_SEQ_LEN];
+    struct seq_file s;
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(rolls); i++)
+    {
+        rolls[i] = 100;
+    }
+    // "100" then 31 ",100", then the EOL character: 128 bytes, a record
+    // filling the whole buffer counting as an overflow.
+    dice_kunit_seq_init(&s, buf, 128);
+    dice_show_rolls(&s, &expr, 0, rolls, ARRAY_SIZE(rolls));
+    KUNIT_EXPECT_TRUE(test, seq_has_overflowed(&s));
+
+    dice_kunit_seq_init(&s, buf, 129);
+    dice_show_rolls(&s, &expr, 0, rolls, ARRAY_SIZE(rolls));
+    KUNIT_EXPECT_FALSE(test, seq_has_overflowed(&s));
+    KUNIT_EXPECT_EQ(test, s.count, 128);
+    KUNIT_EXPECT_EQ(test, buf[127], '\n');
+}
+
+static void dice_kunit_show_aggregate(struct kunit *test)
+{
+    struct dice_expr expr = { .count = 6, .sides = 4 };
+    // Faces 2, 2, 3, 4, 4, 4.
+    static const u64 histogram[] = { 0, 0, 2, 1, 3 };
+    static const char *const hist_lines[] = { "1 0\n", "2 2\n", "3 1\n", "4 3\n" };
+    struct dice_result result;
+    char buf[DICE_KUNIT_SEQ_LEN];
+    struct seq_file s;
+
+    dice_result_from_histogram(&expr, histogram, &result);
+    KUNIT_EXPECT_EQ(test, result.sum, 19);
+    KUNIT_EXPECT_EQ(test, result.min, 2);
+    KUNIT_EXPECT_EQ(test, result.max, 4);
+
+    expr.mode = DICE_MODE_SUM;
+    dice_kunit_seq_init(&s, buf, sizeof(buf));
+    dice_show_aggregate(&s, &expr, &result, histogram, 0);
+    expr.mode = DICE_MODE_MIN;
+    dice_show_aggregate(&s, &expr, &result, histogram, 0);
+    expr.mode = DICE_MODE_MAX;
+    dice_show_aggregate(&s, &expr, &result, histogram, 0);
+    KUNIT_EXPECT_EQ(test, s.count, strlen("19\n2\n4\n"));
+    KUNIT_EXPECT_EQ(test, memcmp(buf, "19\n2\n4\n", s.count), 0);
+
+    expr.mode = DICE_MODE_HIST;
+    for (unsigned int record = 0; record < expr.sides; record++)
+    {
+        dice_kunit_seq_init(&s, buf, sizeof(buf));
+        dice_show_aggregate(&s, &expr, &result, histogram, record);
+        KUNIT_EXPECT_EQ_MSG(test, s.count, strlen(hist_lines[record]), "record: %u", record);
+        KUNIT_EXPECT_EQ_MSG(test, memcmp(buf, hist_lines[record], s.count), 0, "record: %u", record);
+    }
+
+    // No dice: all aggregates are zero.
+    static const u64 empty[] = { 0, 0, 0, 0, 0 };
+    expr.count = 0;
+    dice_result_from_histogram(&expr, empty, &result);
+    KUNIT_EXPECT_EQ(test, result.sum, 0);
+    KUNIT_EXPECT_EQ(test, result.min, 0);
+    KUNIT_EXPECT_EQ(test, result.max, 0);
+}
+
+static struct kunit_case dice_expr_kunit_cases[] = {
+    KUNIT_CASE(dice_kunit_parse_valid),
+    KUNIT_CASE(dice_kunit_parse_invalid),
+    KUNIT_CASE(dice_kunit_show_rolls),
+    KUNIT_CASE(dice_kunit_show_overflow),
+    KUNIT_CASE(dice_kunit_show_aggregate),
+    {}
+};
+
+static struct kunit_suite dice_expr_kunit_suite = {
+    .name = "dice_expr",
+    .test_cases = dice_expr_kunit_cases,
+};
+
+// ----------------------------------------------------------------------------
+// Benchmarks
+//
+// Rolls many dice (with the pool refilled from get_random_bytes, as in the 
+// driver), for a few numbers of sides; the cost per die is reported (see
+// drv_bench.h). They only run when the module is loaded with bench=1.
+
+#define DICE_BENCH_ROLLS (4 * 1024 * 1024)
+#define DICE_BENCH_CHUNK 4096
+
+static const u32 dice_bench_sides[] = { 6, 20, 100, 255 };
+
+static void dice_bench_report(struct kunit *test, const struct drv_bench *timing, const char *name, u32 sides)
+{
+    char full_name[32];
+    snprintf(full_name, sizeof(full_name), "%s_d%u", name, sides);
+    drv_bench_report(test, timing, full_name, "die", DICE_BENCH_ROLLS);
+}
+
+static void dice_bench_below(struct kunit *test)
+{
+    if (!bench)
+    {
+        kunit_skip(test, "not loaded with bench=1");
+    }
+    struct dice_pool *pool = kunit_kmalloc(test, sizeof(*pool), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, pool);
+    pool->next = DICE_POOL_LEN;
+
+    for (unsigned int s = 0; s < ARRAY_SIZE(dice_bench_sides); s++)
+    {
+        u32 sides = dice_bench_sides[s];
+        u32 sum = 0;
+        struct drv_bench timing;
+
+        drv_bench_start(&timing);
+        for (unsigned int i = 0; i < DICE_BENCH_ROLLS; i++)
+        {
+            sum += dice_pool_below(pool, sides);
+            if (i % DICE_BENCH_CHUNK == 0)
+            {
+                cond_resched();
+            }
+        }
+        dice_bench_report(test, &timing, "below", sides);
+        // The sum only prevents the rolls from being optimized away.
+        KUNIT_EXPECT_LT(test, sum, (u64)DICE_BENCH_ROLLS * sides);
+    }
+}
+
+static void dice_bench_roll_bytes(struct kunit *test)
+{
+    if (!bench)
+    {
+        kunit_skip(test, "not loaded with bench=1");
+    }
+    struct dice_pool *pool = kunit_kmalloc(test, sizeof(*pool), GFP_KERNEL);
+    u8 *results = kunit_kmalloc(test, DICE_BENCH_CHUNK, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, pool);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, results);
+    pool->next = DICE_POOL_LEN;
+
+    for (unsigned int s = 0; s < ARRAY_SIZE(dice_bench_sides); s++)
+    {
+        u32 sides = dice_bench_sides[s];
+        struct drv_bench timing;
+
+        drv_bench_start(&timing);
+        for (unsigned int i = 0; i < DICE_BENCH_ROLLS; i += DICE_BENCH_CHUNK)
+        {
+            dice_pool_roll_bytes(pool, results, DICE_BENCH_CHUNK, sides);
+            cond_resched();
+        }
+        dice_bench_report(test, &timing, "roll_bytes", sides);
+    }
+}
+
+static struct kunit_case dice_bench_cases[] = {
+    KUNIT_CASE(dice_bench_below),
+    KUNIT_CASE(dice_bench_roll_bytes),
+    {}
+};
+
+static struct kunit_suite dice_bench_suite = {
+    .name = "dice_random_bench",
+    .test_cases = dice_bench_cases,
+};
+
+kunit_test_suites(&dice_kunit_suite, &dice_expr_kunit_suite, &dice_bench_suite);
@@ -0,0 +1,77 @@
+#ifndef DICE_RANDOM_H
+#define DICE_RANDOM_H
+
+#include <linux/types.h>
+#include <linux/compiler.h>     // Needed for unlikely
+#include <linux/random.h>       // Needed for get_random_bytes
+
+#define DICE_POOL_LEN 256
+
+// ----------------------------------------------------------------------------
+// Random numbers
+//
+// A pool of random words, refilled in bulk (a single call to 
+// get_random_bytes() per DICE_POOL_LEN words), so that rolling a die mostly
+// costs reading the next word of the pool. The driver keeps one per CPU 
+// (see dice.c); the tests (dice_kunit.c) fill their own.
+
+struct dice_pool {
+    u32 values[DICE_POOL_LEN];
+    unsigned int next;
+};
+
+static inline u32 dice_pool_next(struct dice_pool *pool)
+{
+    if (pool->next == DICE_POOL_LEN)
+    {
+        get_random_bytes(pool->values, sizeof(pool->values));
+        pool->next = 0;
+    }
+    return pool->values[pool->next++];
+}
+
+// Returns a uniformly distributed value in [0, ceil), using Lemire's
+// multiply-shift reduction: the high 32 bits of 'x * ceil' are in range,
+// and the few values of 'x' that would make some results more likely than
+// others (those whose low 32 bits fall below 2^32 % ceil) are rejected. 
+// This costs a multiplication instead of a division, and is not biased
+// (unlike 'x % ceil').
+static inline u32 dice_pool_below(struct dice_pool *pool, u32 ceil)
+{
+    u64 product = (u64)dice_pool_next(pool) * ceil;
+    u32 low = (u32)product;
+    if (unlikely(low < ceil))
+    {
+        u32 threshold = -ceil % ceil;
+        while (low < threshold)
+        {
+            product = (u64)dice_pool_next(pool) * ceil;
+            low = (u32)product;
+        }
+    }
+    return product >> 32;
+}
+
+// Rolls 'count' dice having the given number of sides (at most 
+// DICE_MAX_SIDES), one byte each. Each random word yields four candidate
+// bytes, reduced the same way as in dice_pool_below, on 8 bits (a roll
+// thus costs a quarter of a word, rejections aside).
+static inline void dice_pool_roll_bytes(struct dice_pool *pool, u8 *results, size_t count, u32 sides)
+{
+    u32 threshold = 256 % sides;
+    size_t i = 0;
+    while (i < count)
+    {
+        u32 word = dice_pool_next(pool);
+        for (int b = 0; b < 4 && i < count; b++, word >>= 8)
+        {
+            u32 product = (word & 0xff) * sides;
+            if ((product & 0xff) >= threshold)
+            {
+                results[i++] = 1 + (product >> 8);
+            }
+        }
+    }
+}
+
+#endif
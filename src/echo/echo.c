@@ -5,6 +5,17 @@
 #include <linux/fs.h>           // Needed for register/unregister_chrdev_region
 #include <linux/cdev.h>         // Needed for cdev_xxxx functions
 #include <linux/mutex.h>        // Needed for mutex
+#include <linux/wait.h>         // Needed for wait queues
+#include <linux/poll.h>         // Needed for poll_wait and the EPOLL* masks
+#include <linux/vmalloc.h>      // Needed for vmalloc/vfree
+#include <linux/slab.h>         // Needed for kzalloc/kcalloc/kfree
+#include <linux/log2.h>         // Needed for roundup_pow_of_two
+#include <linux/uio.h>          // Needed for iov_iter
+#include <linux/splice.h>       // Needed for the splice helpers
+#include <linux/version.h>      // Needed for LINUX_VERSION_CODE and KERNEL_VERSION macros
+
+#include "echo_ring.h"
+#include "../common/drv_stats.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("yduchesne");
@@ -14,121 +25,333 @@ MODULE_DESCRIPTION("Takes input from user-space and echoes it back");
 // Constants
 
 #define ECHO_MAJOR       42
-#define ECHO_MAX_DEVICES  1
+#define ECHO_MAX_DEVICES 16
 #define ECHO_DEVICE_NAME "echo"
 #define ECHO_CLASS_NAME "echo_class"
-#define ECHO_BUF_LEN 256
+#define ECHO_DEFAULT_BUF_LEN (64 * 1024)
+#define ECHO_MIN_BUF_LEN PAGE_SIZE
+
+// ----------------------------------------------------------------------------
+// Parameters
+
+static unsigned long buffer_size = ECHO_DEFAULT_BUF_LEN;
+module_param(buffer_size, ulong, 0444);
+MODULE_PARM_DESC(buffer_size, "Capacity of the echo ring buffer in bytes (rounded up to a power of two)");
+
+static unsigned int num_devices = 1;
+module_param(num_devices, uint, 0444);
+MODULE_PARM_DESC(num_devices, "Number of echo devices (minors) to create, each with its own ring (max: 16)");
+
+static bool private_buffers;
+module_param(private_buffers, bool, 0444);
+MODULE_PARM_DESC(private_buffers, "Give each open file its own ring, instead of sharing the device's ring");
 
 // ----------------------------------------------------------------------------
 // Device-related & concurrency
 
+// Each device (minor) has its own ring (see echo_ring.h), or each open file
+// in private buffer mode.
 struct echo_device_data {
     struct cdev cdev;
     dev_t dev_no;
-    char buffer[ECHO_BUF_LEN];
-    size_t size;
-    struct class*  cdrv_class;
+    struct echo_ring ring;
     struct device* cdrv_dev;
 };
 
-struct echo_device_data echo_devices[ECHO_MAX_DEVICES];
-struct mutex crit_sec_mutex;
+static struct echo_device_data *echo_devices;
+static struct class* echo_class;
+static struct drv_stats echo_stats;
 
 
+// ----------------------------------------------------------------------------
+// Ring management
+
+static inline int echo_ring_lock(struct echo_ring *ring)
+{
+    u64 start = drv_stats_clock();
+    int status = mutex_lock_interruptible(&ring->lock);
+    drv_stats_lock_time(&echo_stats, DRV_STATS_WRITE, start);
+    return status;
+}
+
 // ----------------------------------------------------------------------------
 // IO operations
 
+// The ring an open file works with is kept in file->private_data: either the
+// ring of the device (minor) that was opened, or one allocated for the file.
 static int echo_open(struct inode *inode, struct file *file){
-   printk(KERN_INFO "echo::open\n");
-   return 0;
+   pr_debug("echo::open\n");
+   struct echo_device_data *data = container_of(inode->i_cdev, struct echo_device_data, cdev);
+
+   if (private_buffers)
+   {
+       struct echo_ring *ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+       if (!ring)
+       {
+           return -ENOMEM;
+       }
+       int status = echo_ring_init(ring, buffer_size);
+       if (status)
+       {
+           kfree(ring);
+           return status;
+       }
+       file->private_data = ring;
+   }
+   else
+   {
+       file->private_data = &data->ring;
+   }
+   // The ring is a stream: there is no meaningful position to seek to, and
+   // stream_open makes lseek fail (with -ESPIPE) by itself.
+   return stream_open(inode, file);
+}
+
+static int echo_fasync(int fd, struct file *file, int on)
+{
+    struct echo_ring *ring = file->private_data;
+    return fasync_helper(fd, file, on, &ring->async_queue);
 }
 
 static int echo_release(struct inode *inode, struct file *file){
-   printk(KERN_INFO "echo::release\n");
+   pr_debug("echo::release\n");
+   struct echo_ring *ring = file->private_data;
+
+   echo_fasync(-1, file, 0);
+   if (private_buffers)
+   {
+       echo_ring_destroy(ring);
+       kfree(ring);
+   }
    return 0;
 }
 
-static ssize_t echo_write(struct file *file, const char __user *user_buffer,
-                    size_t size, loff_t * offset)
+static ssize_t __echo_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    printk(KERN_INFO "echo::write");
-    mutex_lock(&crit_sec_mutex);
-
-    struct echo_device_data *data = &echo_devices[0];
-    ssize_t len = min(ECHO_BUF_LEN - *offset, size);
-    printk(KERN_INFO "actual size: %d, to size: %d, from size: %d\n", len, sizeof(data->buffer), size);
-    int status = copy_from_user(data->buffer, user_buffer, len);
-    if (status)
+    struct file *file = iocb->ki_filp;
+    struct echo_ring *ring = file->private_data;
+    size_t size = iov_iter_count(from);
+
+    if (size == 0)
+    {
+        return 0;
+    }
+    if (echo_ring_lock(ring))
+    {
+        return -ERESTARTSYS;
+    }
+    // Blocking until readers have freed some room in the ring (or failing
+    // right away in non-blocking mode).
+    while (echo_ring_free(ring) == 0)
+    {
+        mutex_unlock(&ring->lock);
+        if ((file->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT))
+        {
+            return -EAGAIN;
+        }
+        if (wait_event_interruptible(ring->write_queue, echo_ring_free(ring) > 0))
+        {
+            return -ERESTARTSYS;
+        }
+        if (echo_ring_lock(ring))
+        {
+            return -ERESTARTSYS;
+        }
+    }
+
+    ssize_t len = echo_ring_put(ring, from);
+    mutex_unlock(&ring->lock);
+
+    if (len > 0)
     {
-        printk(KERN_INFO, "Error copying data from user space (status code: %d)", status);
-        mutex_unlock(&crit_sec_mutex);
-        return -EFAULT;
+        wake_up_interruptible(&ring->read_queue);
+        kill_fasync(&ring->async_queue, SIGIO, POLL_IN);
     }
-    *offset += len;
-    data->size += len;
-    mutex_unlock(&crit_sec_mutex);
     return len;
 }
 
-static ssize_t echo_read(struct file *file, char __user *user_buffer,
-                   size_t size, loff_t *offset)
+// Serves write, writev and (through iter_file_splice_write) splice to the
+// device.
+static ssize_t echo_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    printk(KERN_INFO "echo::read");
-    mutex_lock(&crit_sec_mutex);
-
-    struct echo_device_data *data = &echo_devices[0];
-    ssize_t len = min(data->size - *offset, size);
-    printk(KERN_INFO "actual size: %d, to size: %d, from size: %d\n", len, size, sizeof(data->buffer));
-    int status = copy_to_user(user_buffer, data->buffer, len);
-    if (status)
+    ssize_t status = __echo_write_iter(iocb, from);
+    drv_stats_account(&echo_stats, DRV_STATS_WRITE, status);
+    return status;
+}
+
+static ssize_t __echo_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *file = iocb->ki_filp;
+    struct echo_ring *ring = file->private_data;
+    size_t size = iov_iter_count(to);
+
+    if (size == 0)
     {
-        printk(KERN_INFO "Error copying data to user space (status code: %d)", status);
-        mutex_unlock(&crit_sec_mutex);
-        return -EFAULT;
+        return 0;
+    }
+    ssize_t len;
+    for (;;)
+    {
+        len = echo_ring_get(ring, to);
+        if (len != 0)
+        {
+            break;
+        }
+        // Blocking until writers have produced some data (or failing right
+        // away in non-blocking mode).
+        if ((file->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT))
+        {
+            return -EAGAIN;
+        }
+        if (wait_event_interruptible(ring->read_queue, echo_ring_used(ring) > 0))
+        {
+            return -ERESTARTSYS;
+        }
+    }
+
+    if (len > 0)
+    {
+        wake_up_interruptible(&ring->write_queue);
     }
-    *offset += len;
-    mutex_unlock(&crit_sec_mutex);
     return len;
 }
 
+// Serves read, readv and (through the generic splice helper) splice from
+// the device.
+static ssize_t echo_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    ssize_t status = __echo_read_iter(iocb, to);
+    drv_stats_account(&echo_stats, DRV_STATS_READ, status);
+    return status;
+}
+
+static __poll_t echo_poll(struct file *file, poll_table *wait)
+{
+    struct echo_ring *ring = file->private_data;
+    __poll_t mask = 0;
+
+    poll_wait(file, &ring->read_queue, wait);
+    poll_wait(file, &ring->write_queue, wait);
+
+    if (echo_ring_used(ring) > 0)
+    {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if (echo_ring_free(ring) > 0)
+    {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    return mask;
+}
+
 const struct  file_operations echo_ops = 
 {
     .owner = THIS_MODULE,
     .open = echo_open,
     .release = echo_release,
-    .read = echo_read,
-    .write = echo_write
+    .read_iter = echo_read_iter,
+    .write_iter = echo_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write,
+    .poll = echo_poll,
+    .fasync = echo_fasync
 };
 
 // ----------------------------------------------------------------------------
 // Lifecycle
 
+static void echo_destroy_devices(unsigned int count)
+{
+    for(unsigned int minor = 0; minor < count; minor++) {
+        device_destroy(echo_class, echo_devices[minor].dev_no);
+        cdev_del(&echo_devices[minor].cdev);
+        echo_ring_destroy(&echo_devices[minor].ring);
+    }
+}
+
 static int __init echo_init(void)
 {
     printk(KERN_INFO "-> echo::init\n");
-    int status = register_chrdev_region(MKDEV(ECHO_MAJOR, 0), ECHO_MAX_DEVICES, "echo_device_driver");
+    unsigned int minor = 0;
+
+    if (buffer_size < ECHO_MIN_BUF_LEN)
+    {
+        buffer_size = ECHO_MIN_BUF_LEN;
+    }
+    buffer_size = roundup_pow_of_two(buffer_size);
+    num_devices = clamp(num_devices, 1u, (unsigned int)ECHO_MAX_DEVICES);
+
+    int status = drv_stats_init(&echo_stats, ECHO_DEVICE_NAME);
     if (status != 0)
     {
         goto Error;
     }
-    for(int minor = 0; minor < ECHO_MAX_DEVICES; minor++) {
-        cdev_init(&echo_devices[minor].cdev, &echo_ops);
-        echo_devices[minor].dev_no = MKDEV(ECHO_MAJOR, minor);
-        cdev_add(&echo_devices[minor].cdev, echo_devices[minor].dev_no, 1);
-        echo_devices[minor].cdrv_class = class_create(THIS_MODULE, ECHO_CLASS_NAME);
-        if (IS_ERR(echo_devices[minor].cdrv_class)){
-             printk(KERN_ALERT "Could not create %s device class\n", ECHO_CLASS_NAME);
-             status = PTR_ERR(echo_devices[minor].cdrv_class);
-             goto Error;
+    status = register_chrdev_region(MKDEV(ECHO_MAJOR, 0), num_devices, "echo_device_driver");
+    if (status != 0)
+    {
+        goto ErrorStats;
+    }
+    echo_devices = kcalloc(num_devices, sizeof(*echo_devices), GFP_KERNEL);
+    if (!echo_devices)
+    {
+        status = -ENOMEM;
+        goto ErrorRegion;
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,4,0)
+    echo_class = class_create(ECHO_CLASS_NAME);
+#else
+    echo_class = class_create(THIS_MODULE, ECHO_CLASS_NAME);
+#endif
+    if (IS_ERR(echo_class)){
+         printk(KERN_ALERT "Could not create %s device class\n", ECHO_CLASS_NAME);
+         status = PTR_ERR(echo_class);
+         goto ErrorDevices;
+    }
+    printk(KERN_INFO "Created %s device class\n", ECHO_CLASS_NAME);
+
+    for(; minor < num_devices; minor++) {
+        struct echo_device_data *data = &echo_devices[minor];
+
+        status = echo_ring_init(&data->ring, buffer_size);
+        if (status)
+        {
+             printk(KERN_ALERT "Could not allocate %lu-byte ring buffer\n", buffer_size);
+             goto ErrorMinors;
+        }
+        cdev_init(&data->cdev, &echo_ops);
+        data->dev_no = MKDEV(ECHO_MAJOR, minor);
+        status = cdev_add(&data->cdev, data->dev_no, 1);
+        if (status)
+        {
+             echo_ring_destroy(&data->ring);
+             goto ErrorMinors;
+        }
+        // The first device keeps the historical /dev/echo name.
+        if (minor == 0)
+        {
+            data->cdrv_dev = device_create(echo_class, NULL, data->dev_no, NULL, ECHO_DEVICE_NAME);
+        }
+        else
+        {
+            data->cdrv_dev = device_create(echo_class, NULL, data->dev_no, NULL, ECHO_DEVICE_NAME "%u", minor);
         }
-        echo_devices[minor].size = 0;
-        printk(KERN_INFO "Created %s device class\n", ECHO_CLASS_NAME);
-        echo_devices[minor].cdrv_dev = device_create(echo_devices[minor].cdrv_class, NULL, MKDEV(ECHO_MAJOR, minor), NULL, ECHO_DEVICE_NAME);
     }
-    mutex_init(&crit_sec_mutex);
     printk(KERN_INFO "<- echo::init\n");
     return 0;
 
+    ErrorMinors:
+        echo_destroy_devices(minor);
+        class_destroy(echo_class);
+    ErrorDevices:
+        kfree(echo_devices);
+    ErrorRegion:
+        unregister_chrdev_region(MKDEV(ECHO_MAJOR, 0), num_devices);
+    ErrorStats:
+        drv_stats_destroy(&echo_stats);
     Error:
         printk(KERN_INFO, "Error occurred. Aborting module initialization (status code: %i)\n", status);
         return status;
@@ -137,12 +360,11 @@ static int __init echo_init(void)
 static void __exit echo_exit(void)
 {
     printk(KERN_INFO, "-> echo::exit\n");
-    for(int minor = 0; minor < ECHO_MAX_DEVICES; minor++) {
-        device_destroy(echo_devices[minor].cdrv_class, echo_devices[minor].dev_no);
-        class_destroy(echo_devices[minor].cdrv_class);
-        cdev_del(&echo_devices[minor].cdev);
-    }
-    unregister_chrdev_region(MKDEV(ECHO_MAJOR, 0), ECHO_MAX_DEVICES);
+    echo_destroy_devices(num_devices);
+    class_destroy(echo_class);
+    kfree(echo_devices);
+    unregister_chrdev_region(MKDEV(ECHO_MAJOR, 0), num_devices);
+    drv_stats_destroy(&echo_stats);
     printk(KERN_INFO, "<- echo::exit\n");
 }
 
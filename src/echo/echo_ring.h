@@ -0,0 +1,153 @@
+#ifndef ECHO_RING_H
+#define ECHO_RING_H
+
+#include <linux/types.h>
+#include <linux/mutex.h>        // Needed for mutex
+#include <linux/wait.h>         // Needed for wait queues
+#include <linux/fs.h>           // Needed for fasync_struct
+#include <linux/vmalloc.h>      // Needed for vmalloc/vfree
+#include <linux/minmax.h>       // Needed for min
+#include <linux/uio.h>          // Needed for iov_iter
+
+// Kernels older than 6.1 name iterator directions after the operation: a
+// source is iterated by a WRITE, a destination by a READ.
+#ifndef ITER_SOURCE
+#define ITER_SOURCE WRITE
+#define ITER_DEST READ
+#endif
+
+// ----------------------------------------------------------------------------
+// Ring
+//
+// The buffer is a ring: 'head' and 'tail' are free-running byte counters
+// (writers advance 'head', readers advance 'tail'), so that the number of
+// bytes held is always 'head - tail', and the actual index into the buffer
+// is obtained by masking with 'capacity - 1' (capacity is a power of two).
+//
+// Each ring has its own lock: rings of different devices (or of different
+// open files, in private buffer mode) are fully independent. Within a ring,
+// only producers serialize on the lock; consumers copy data optimistically,
+// then claim it by advancing the tail with a cmpxchg (see echo_ring_get),
+// so that they never wait for producers, nor for one another.
+//
+// The driver (echo.c) blocks and wakes up readers and writers around the
+// following functions; the tests (echo_ring_kunit.c) call them directly.
+
+struct echo_ring {
+    struct mutex lock;
+    char* buffer;
+    size_t capacity;
+    unsigned long head;
+    unsigned long tail;
+    wait_queue_head_t read_queue;
+    wait_queue_head_t write_queue;
+    // Files to send SIGIO to when data is written (see echo_fasync).
+    struct fasync_struct* async_queue;
+};
+
+static inline int echo_ring_init(struct echo_ring *ring, size_t capacity)
+{
+    ring->buffer = vmalloc(capacity);
+    if (!ring->buffer)
+    {
+        return -ENOMEM;
+    }
+    ring->capacity = capacity;
+    ring->head = 0;
+    ring->tail = 0;
+    mutex_init(&ring->lock);
+    init_waitqueue_head(&ring->read_queue);
+    init_waitqueue_head(&ring->write_queue);
+    return 0;
+}
+
+static inline void echo_ring_destroy(struct echo_ring *ring)
+{
+    vfree(ring->buffer);
+    ring->buffer = NULL;
+}
+
+// The counters are read with acquire semantics (so that data published by a
+// producer is visible), the tail first, so that the head (which only ever
+// grows) cannot be seen lagging behind it.
+static inline size_t echo_ring_used(const struct echo_ring *ring)
+{
+    unsigned long tail = smp_load_acquire(&ring->tail);
+    unsigned long head = smp_load_acquire(&ring->head);
+    return head - tail;
+}
+
+static inline size_t echo_ring_free(const struct echo_ring *ring)
+{
+    return ring->capacity - echo_ring_used(ring);
+}
+
+// Copies as much of the source iterator's data as fits into the ring, with
+// the ring's lock held: in at most two chunks, up to the end of the buffer,
+// then wrapping around to its start. The iterator may span several user
+// segments (writev), kernel pages or a pipe (splice): all of them are
+// consumed under a single lock hold. Returns the number of bytes copied, or
+// -EFAULT if none could be.
+static inline ssize_t echo_ring_put(struct echo_ring *ring, struct iov_iter *from)
+{
+    size_t size = iov_iter_count(from);
+    size_t len = min(size, echo_ring_free(ring));
+    size_t pos = ring->head & (ring->capacity - 1);
+    size_t first = min(len, ring->capacity - pos);
+    pr_debug("echo::write: actual size: %zu, to size: %zu, from size: %zu\n", len, ring->capacity, size);
+    size_t copied = copy_from_iter(ring->buffer + pos, first, from);
+    if (copied == first)
+    {
+        copied += copy_from_iter(ring->buffer, len - first, from);
+    }
+    if (copied == 0 && len > 0)
+    {
+        return -EFAULT;
+    }
+    // Publishing the data only once it has been fully copied.
+    smp_store_release(&ring->head, ring->head + copied);
+    return copied;
+}
+
+// Copies (and consumes) as much of the ring's data as the destination
+// iterator can hold, without taking the ring's lock. The data is copied
+// first, then claimed by advancing the tail with a cmpxchg: if another
+// consumer claimed it first, producers may have refilled the space while it
+// was being copied, and the copy is then discarded and redone.
+// Returns the number of bytes copied (0 if there was no data), or -EFAULT if
+// none could be.
+static inline ssize_t echo_ring_get(struct echo_ring *ring, struct iov_iter *to)
+{
+    size_t size = iov_iter_count(to);
+
+    for (;;)
+    {
+        unsigned long tail = smp_load_acquire(&ring->tail);
+        unsigned long head = smp_load_acquire(&ring->head);
+        size_t len = min(size, (size_t)(head - tail));
+        if (len == 0)
+        {
+            return 0;
+        }
+
+        size_t pos = tail & (ring->capacity - 1);
+        size_t first = min(len, ring->capacity - pos);
+        pr_debug("echo::read: actual size: %zu, to size: %zu, from size: %zu\n", len, size, (size_t)(head - tail));
+        size_t copied = copy_to_iter(ring->buffer + pos, first, to);
+        if (copied == first)
+        {
+            copied += copy_to_iter(ring->buffer, len - first, to);
+        }
+        if (copied == 0)
+        {
+            return -EFAULT;
+        }
+        if (cmpxchg(&ring->tail, tail, tail + copied) == tail)
+        {
+            return copied;
+        }
+        iov_iter_revert(to, copied);
+    }
+}
+
+#endif
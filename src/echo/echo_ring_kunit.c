@@ -0,0 +1,239 @@
+#include <kunit/test.h>         // Needed for the KUnit API
+#include <linux/module.h>       // Needed by all modules
+#include <linux/random.h>       // Needed for get_random_bytes
+#include <linux/uio.h>          // Needed for iov_iter_kvec
+
+#include "echo_ring.h"
+#include "../common/drv_bench.h"
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("yduchesne");
+MODULE_DESCRIPTION("Tests and benchmarks of the echo ring");
+
+// ----------------------------------------------------------------------------
+// Parameters
+
+static bool bench;
+module_param(bench, bool, 0444);
+MODULE_PARM_DESC(bench, "Run the timed benchmarks (echo_ring_bench suite)");
+
+// ----------------------------------------------------------------------------
+// Tests
+//
+// Data goes through a small ring, from and to kernel buffers (iterators over
+// kvecs, as writev/readv would use iovecs), starting at every offset of the
+// buffer, so that it wraps around the buffer's end at every position. Each
+// test gets a fresh ring (test->priv).
+
+#define ECHO_RING_KUNIT_CAPACITY 64
+
+static int echo_ring_kunit_init(struct kunit *test)
+{
+    struct echo_ring *ring = kunit_kzalloc(test, sizeof(*ring), GFP_KERNEL);
+    if (!ring)
+    {
+        return -ENOMEM;
+    }
+    int status = echo_ring_init(ring, ECHO_RING_KUNIT_CAPACITY);
+    if (status)
+    {
+        return status;
+    }
+    test->priv = ring;
+    return 0;
+}
+
+static void echo_ring_kunit_exit(struct kunit *test)
+{
+    echo_ring_destroy(test->priv);
+}
+
+// Moves the (empty) ring's counters, as if 'pos' bytes had gone through it.
+static void echo_ring_kunit_rewind(struct echo_ring *ring, unsigned long pos)
+{
+    ring->head = pos;
+    ring->tail = pos;
+}
+
+static ssize_t echo_ring_kunit_put(struct echo_ring *ring, const u8 *src, size_t len)
+{
+    struct kvec kvec = { .iov_base = (void *)src, .iov_len = len };
+    struct iov_iter iter;
+
+    iov_iter_kvec(&iter, ITER_SOURCE, &kvec, 1, len);
+    return echo_ring_put(ring, &iter);
+}
+
+static ssize_t echo_ring_kunit_get(struct echo_ring *ring, u8 *dst, size_t len)
+{
+    struct kvec kvec = { .iov_base = dst, .iov_len = len };
+    struct iov_iter iter;
+
+    iov_iter_kvec(&iter, ITER_DEST, &kvec, 1, len);
+    return echo_ring_get(ring, &iter);
+}
+
+// Writes 'len' bytes, then reads them back 'piece' bytes at a time.
+static void echo_ring_kunit_round_trip(struct kunit *test)
+{
+    struct echo_ring *ring = test->priv;
+    u8 input[ECHO_RING_KUNIT_CAPACITY];
+    u8 output[ECHO_RING_KUNIT_CAPACITY];
+    static const size_t pieces[] = { 1, 5, 8, ECHO_RING_KUNIT_CAPACITY };
+
+    for (unsigned int p = 0; p < ARRAY_SIZE(pieces); p++)
+    {
+        for (unsigned long start = 0; start < ECHO_RING_KUNIT_CAPACITY; start++)
+        {
+            for (size_t len = 0; len <= ECHO_RING_KUNIT_CAPACITY; len++)
+            {
+                // Counters are free-running: they are usually past the
+                // capacity.
+                echo_ring_kunit_rewind(ring, start + 3 * ECHO_RING_KUNIT_CAPACITY);
+                get_random_bytes(input, len);
+                KUNIT_ASSERT_EQ_MSG(test, echo_ring_kunit_put(ring, input, len), len, "start: %lu, len: %zu", start, len);
+                KUNIT_ASSERT_EQ(test, echo_ring_used(ring), len);
+
+                size_t done = 0;
+                while (done < len)
+                {
+                    size_t n = min(pieces[p], len - done);
+                    KUNIT_ASSERT_EQ_MSG(test, echo_ring_kunit_get(ring, output + done, n), n, "start: %lu, len: %zu, done: %zu", start, len, done);
+                    done += n;
+                }
+                KUNIT_ASSERT_EQ_MSG(test, memcmp(output, input, len), 0, "start: %lu, len: %zu, piece: %zu", start, len, pieces[p]);
+                KUNIT_ASSERT_EQ(test, echo_ring_kunit_get(ring, output, sizeof(output)), 0);
+            }
+        }
+    }
+}
+
+// Writes only go as far as there is room, and reads as far as there is data.
+static void echo_ring_kunit_bounds(struct kunit *test)
+{
+    struct echo_ring *ring = test->priv;
+    u8 input[ECHO_RING_KUNIT_CAPACITY + 16];
+    u8 output[ECHO_RING_KUNIT_CAPACITY + 16];
+
+    get_random_bytes(input, sizeof(input));
+    echo_ring_kunit_rewind(ring, ECHO_RING_KUNIT_CAPACITY - 3);
+    KUNIT_EXPECT_EQ(test, echo_ring_kunit_get(ring, output, sizeof(output)), 0);
+    KUNIT_EXPECT_EQ(test, echo_ring_kunit_put(ring, input, 10), 10);
+    KUNIT_EXPECT_EQ(test, echo_ring_kunit_put(ring, input + 10, sizeof(input) - 10), ECHO_RING_KUNIT_CAPACITY - 10);
+    KUNIT_EXPECT_EQ(test, echo_ring_free(ring), 0);
+    KUNIT_EXPECT_EQ(test, echo_ring_kunit_put(ring, input, sizeof(input)), 0);
+
+    KUNIT_EXPECT_EQ(test, echo_ring_kunit_get(ring, output, 7), 7);
+    KUNIT_EXPECT_EQ(test, echo_ring_free(ring), 7);
+    KUNIT_EXPECT_EQ(test, echo_ring_kunit_get(ring, output + 7, sizeof(output) - 7), ECHO_RING_KUNIT_CAPACITY - 7);
+    KUNIT_EXPECT_EQ(test, memcmp(output, input, ECHO_RING_KUNIT_CAPACITY), 0);
+    KUNIT_EXPECT_EQ(test, echo_ring_used(ring), 0);
+}
+
+// Iterators spanning several segments (writev/readv) are copied in order,
+// across the end of the buffer.
+static void echo_ring_kunit_segments(struct kunit *test)
+{
+    struct echo_ring *ring = test->priv;
+    u8 input[48];
+    u8 output[48];
+    struct kvec in[3] = {
+        { .iov_base = input, .iov_len = 5 },
+        { .iov_base = input + 5, .iov_len = 0 },
+        { .iov_base = input + 5, .iov_len = 43 }
+    };
+    struct kvec out[2] = {
+        { .iov_base = output, .iov_len = 30 },
+        { .iov_base = output + 30, .iov_len = 18 }
+    };
+    struct iov_iter iter;
+
+    get_random_bytes(input, sizeof(input));
+    memset(output, 0, sizeof(output));
+    echo_ring_kunit_rewind(ring, ECHO_RING_KUNIT_CAPACITY - 20);
+    iov_iter_kvec(&iter, ITER_SOURCE, in, ARRAY_SIZE(in), sizeof(input));
+    KUNIT_ASSERT_EQ(test, echo_ring_put(ring, &iter), sizeof(input));
+    KUNIT_EXPECT_EQ(test, iov_iter_count(&iter), 0);
+    iov_iter_kvec(&iter, ITER_DEST, out, ARRAY_SIZE(out), sizeof(output));
+    KUNIT_ASSERT_EQ(test, echo_ring_get(ring, &iter), sizeof(output));
+    KUNIT_EXPECT_EQ(test, memcmp(output, input, sizeof(input)), 0);
+}
+
+static struct kunit_case echo_ring_kunit_cases[] = {
+    KUNIT_CASE(echo_ring_kunit_round_trip),
+    KUNIT_CASE(echo_ring_kunit_bounds),
+    KUNIT_CASE(echo_ring_kunit_segments),
+    {}
+};
+
+static struct kunit_suite echo_ring_kunit_suite = {
+    .name = "echo_ring",
+    .init = echo_ring_kunit_init,
+    .exit = echo_ring_kunit_exit,
+    .test_cases = echo_ring_kunit_cases,
+};
+
+// ----------------------------------------------------------------------------
+// Benchmarks
+//
+// Data goes through a ring of the driver's default size, written then read
+// back a chunk at a time (as by a writer and a reader taking turns); the
+// cost per byte is reported (see drv_bench.h). They only run when the
+// module is loaded with bench=1.
+
+#define ECHO_RING_BENCH_CAPACITY (64 * 1024)
+#define ECHO_RING_BENCH_BYTES (256 * 1024 * 1024)
+
+static void echo_ring_bench_put_get(struct kunit *test)
+{
+    if (!bench)
+    {
+        kunit_skip(test, "not loaded with bench=1");
+    }
+    static const size_t chunks[] = { 64, 4096, 60 * 1024 };
+    struct echo_ring *ring = kunit_kzalloc(test, sizeof(*ring), GFP_KERNEL);
+    u8 *buf = kunit_kmalloc(test, ECHO_RING_BENCH_CAPACITY, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, ring);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, buf);
+    KUNIT_ASSERT_EQ(test, echo_ring_init(ring, ECHO_RING_BENCH_CAPACITY), 0);
+    get_random_bytes(buf, ECHO_RING_BENCH_CAPACITY);
+
+    for (unsigned int c = 0; c < ARRAY_SIZE(chunks); c++)
+    {
+        char name[32];
+        struct drv_bench timing;
+        size_t chunk = chunks[c];
+        u64 moved = 0;
+
+        drv_bench_start(&timing);
+        while (moved < ECHO_RING_BENCH_BYTES)
+        {
+            if (echo_ring_kunit_put(ring, buf, chunk) != chunk ||
+                echo_ring_kunit_get(ring, buf, chunk) != chunk)
+            {
+                break;
+            }
+            moved += chunk;
+            if (moved % (16 * 1024 * 1024) < chunk)
+            {
+                cond_resched();
+            }
+        }
+        snprintf(name, sizeof(name), "put_get_%zu", chunk);
+        drv_bench_report(test, &timing, name, "byte", moved);
+        KUNIT_EXPECT_GE(test, moved, (u64)ECHO_RING_BENCH_BYTES);
+    }
+    echo_ring_destroy(ring);
+}
+
+static struct kunit_case echo_ring_bench_cases[] = {
+    KUNIT_CASE(echo_ring_bench_put_get),
+    {}
+};
+
+static struct kunit_suite echo_ring_bench_suite = {
+    .name = "echo_ring_bench",
+    .test_cases = echo_ring_bench_cases,
+};
+
+kunit_test_suites(&echo_ring_kunit_suite, &echo_ring_bench_suite);
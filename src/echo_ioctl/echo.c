@@ -5,168 +5,1078 @@
 #include <linux/fs.h>           // Needed for register/unregister_chrdev_region
 #include <linux/cdev.h>         // Needed for cdev_xxxx functions
 #include <linux/mutex.h>        // Needed for mutex
+#include <linux/rcupdate.h>     // Needed for synchronize_rcu
+#include <linux/wait.h>         // Needed for wait queues
+#include <linux/poll.h>         // Needed for poll_wait and the EPOLL* masks
+#include <linux/vmalloc.h>      // Needed for vmalloc/vfree
+#include <linux/slab.h>         // Needed for kzalloc/kcalloc/kfree
+#include <linux/log2.h>         // Needed for roundup_pow_of_two
+#include <linux/uio.h>          // Needed for iov_iter
+#include <linux/splice.h>       // Needed for the splice helpers
+#include <linux/version.h>      // Needed for LINUX_VERSION_CODE and KERNEL_VERSION macros
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+#include <linux/io_uring/cmd.h> // Needed for io_uring_cmd
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0)
+#include <linux/io_uring.h>     // Needed for io_uring_cmd
+#endif
+#include <linux/mm.h>           // Needed for vm_area_struct and remap_vmalloc_range
 #include <linux/ioctl.h>        // Needed for the IOCTL-related macros
+#include <linux/eventfd.h>      // Needed for eventfd_ctx_fdget/eventfd_signal
 
 #include "echo_ioctl.h"
+#include "echo_transform.h"
+#include "../common/drv_stats.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("yduchesne");
 MODULE_DESCRIPTION("Takes input from user-space and echoes it back");
 
+// Iterator directions are named after the data's direction from 6.1 on
+// (the source being written from, the destination read into).
+#ifndef ITER_SOURCE
+#define ITER_SOURCE WRITE
+#define ITER_DEST READ
+#endif
+
 // ----------------------------------------------------------------------------
 // Constants
 
 #define ECHO_MAJOR       42
-#define ECHO_MAX_DEVICES  1
+#define ECHO_MAX_DEVICES 16
 #define ECHO_DEVICE_NAME "echo"
 #define ECHO_CLASS_NAME "echo_class"
-#define ECHO_BUF_LEN 256
+#define ECHO_DEFAULT_BUF_LEN (64 * 1024)
+#define ECHO_MIN_BUF_LEN PAGE_SIZE
+// In-place modifications are made a chunk at a time (a multiple of 8, so 
+// that the transforms' units and keys line up with the chunks).
+#define ECHO_MODIFY_CHUNK (64 * 1024)
 
 #define ECHO_IOCTL_CLEAR _IO(ECHO_IOCTL_MAGIC, ECHO_IOCTL_CLEAR_CMD)
 #define ECHO_IOCTL_REVERSE _IO(ECHO_IOCTL_MAGIC, ECHO_IOCTL_REVERSE_CMD)
+#define ECHO_IOCTL_WAKEUP _IO(ECHO_IOCTL_MAGIC, ECHO_IOCTL_WAKEUP_CMD)
+#define ECHO_IOCTL_BATCH _IOWR(ECHO_IOCTL_MAGIC, ECHO_IOCTL_BATCH_CMD, struct echo_batch)
+#define ECHO_IOCTL_TRANSFORM _IOWR(ECHO_IOCTL_MAGIC, ECHO_IOCTL_TRANSFORM_CMD, struct echo_transform)
+#define ECHO_IOCTL_EVENTFD _IOW(ECHO_IOCTL_MAGIC, ECHO_IOCTL_EVENTFD_CMD, __s32)
+
+// ----------------------------------------------------------------------------
+// Parameters
+
+static unsigned long buffer_size = ECHO_DEFAULT_BUF_LEN;
+module_param(buffer_size, ulong, 0444);
+MODULE_PARM_DESC(buffer_size, "Capacity of the echo ring buffer in bytes (rounded up to a power of two)");
+
+static unsigned int num_devices = 1;
+module_param(num_devices, uint, 0444);
+MODULE_PARM_DESC(num_devices, "Number of echo devices (minors) to create, each with its own ring (max: 16)");
+
+static bool private_buffers;
+module_param(private_buffers, bool, 0444);
+MODULE_PARM_DESC(private_buffers, "Give each open file its own ring, instead of sharing the device's ring");
 
 // ----------------------------------------------------------------------------
 // Device-related & concurrency
 
+#if BITS_PER_LONG != 64
+#error "echo_ioctl needs a 64-bit kernel (the ring's counters are atomic 64-bit words)"
+#endif
+
+// The buffer is a ring: 'head' and 'tail' are free-running byte counters
+// (writers advance 'head', readers advance 'tail'), so that the number of
+// bytes held is always 'head - tail', and the actual index into the buffer
+// is obtained by masking with 'capacity - 1' (capacity is a power of two).
+//
+// The counters live in a control page ('ctrl') that is allocated together
+// with the data, right in front of it, so that both can be mapped into user
+// space with a single mmap (see echo_ioctl.h for the layout). They are 64-bit
+// words, updated atomically (smp_store_release, cmpxchg): the driver is
+// only built for 64-bit kernels.
+//
+// Each ring has its own locks: rings of different devices (or of different
+// open files, in private buffer mode) are fully independent. Within a ring:
+// - producers serialize on 'lock';
+// - consumers take no lock: they copy data optimistically, then claim it by
+//   advancing the tail with a cmpxchg (see echo_ring_get), so that they 
+//   never wait for producers, nor for one another;
+// - operations that modify the content in place (transforms) take 'lock',
+//   and make 'modify_seq' odd while they run: consumers then only claim the
+//   part of the content the modification is done with ('modify_done'), and
+//   check that the sequence did not change before claiming what they copied
+//   (copying again otherwise), so that they still take no lock (see 
+//   echo_ring_modify_begin).
+//
+// Changes to the content are notified to the eventfd registered for the
+// ring (if any: 'eventfd' and 'eventfd_owner' are protected by 'lock'), and
+// to the files in 'async_queue' (SIGIO).
+struct echo_ring {
+    struct mutex lock;
+    unsigned int modify_seq;
+    u64 modify_done;
+    struct echo_ring_ctrl* ctrl;
+    char* buffer;
+    size_t capacity;
+    wait_queue_head_t read_queue;
+    wait_queue_head_t write_queue;
+    struct eventfd_ctx* eventfd;
+    struct file* eventfd_owner;
+    struct fasync_struct* async_queue;
+};
+
 struct echo_device_data {
     struct cdev cdev;
     dev_t dev_no;
-    char buffer[ECHO_BUF_LEN];
-    size_t size;
-    struct class*  cdrv_class;
+    struct echo_ring ring;
     struct device* cdrv_dev;
 };
 
-struct echo_device_data echo_devices[ECHO_MAX_DEVICES];
-struct mutex crit_sec_mutex;
+static struct echo_device_data *echo_devices;
+static struct class* echo_class;
+static struct drv_stats echo_stats;
+
+
+// ----------------------------------------------------------------------------
+// Ring management
+
+static int echo_ring_init(struct echo_ring *ring, size_t capacity)
+{
+    // vmalloc_user() zeroes the memory and marks it as mappable.
+    ring->ctrl = vmalloc_user(ECHO_MMAP_CTRL_LEN + capacity);
+    if (!ring->ctrl)
+    {
+        return -ENOMEM;
+    }
+    ring->ctrl->capacity = capacity;
+    ring->buffer = (char*)ring->ctrl + ECHO_MMAP_CTRL_LEN;
+    ring->capacity = capacity;
+    mutex_init(&ring->lock);
+    init_waitqueue_head(&ring->read_queue);
+    init_waitqueue_head(&ring->write_queue);
+    return 0;
+}
+
+static void echo_ring_destroy(struct echo_ring *ring)
+{
+    if (ring->eventfd)
+    {
+        eventfd_ctx_put(ring->eventfd);
+        ring->eventfd = NULL;
+    }
+    vfree(ring->ctrl);
+    ring->ctrl = NULL;
+    ring->buffer = NULL;
+}
+
+// The counters may be updated concurrently (by consumers, or through the user
+// mapping): they are read with acquire semantics (so that data published by
+// a producer is visible), the tail first, so that the head (which only ever
+// grows) cannot be seen lagging behind it. The result is clamped in case user
+// space corrupted them.
+static inline size_t echo_ring_used(const struct echo_ring *ring)
+{
+    u64 tail = smp_load_acquire(&ring->ctrl->tail);
+    u64 head = smp_load_acquire(&ring->ctrl->head);
+    return min_t(size_t, head - tail, ring->capacity);
+}
+
+static inline size_t echo_ring_free(const struct echo_ring *ring)
+{
+    return ring->capacity - echo_ring_used(ring);
+}
+
+// Takes the ring's lock, the time spent waiting for it being charged to the
+// given operation.
+static inline int echo_ring_lock(struct echo_ring *ring, enum drv_stats_op op)
+{
+    u64 start = drv_stats_clock();
+    int status = mutex_lock_interruptible(&ring->lock);
+    drv_stats_lock_time(&echo_stats, op, start);
+    return status;
+}
+
+// Returns the number of bytes consumers may claim from 'tail': all of the
+// content, unless it is being modified in place ('seq' being odd), in which 
+// case only the part the modification is done with (and no longer changes).
+static inline size_t echo_ring_claimable(const struct echo_ring *ring, unsigned int seq, u64 tail)
+{
+    u64 head = smp_load_acquire(&ring->ctrl->head);
+    size_t len = min_t(size_t, head - tail, ring->capacity);
+
+    if (seq & 1)
+    {
+        u64 done = smp_load_acquire(&ring->modify_done);
+        len = (long)(done - tail) > 0 ? min_t(size_t, len, done - tail) : 0;
+    }
+    return len;
+}
+
+static inline size_t echo_ring_readable(const struct echo_ring *ring)
+{
+    unsigned int seq = smp_load_acquire(&ring->modify_seq);
+    return echo_ring_claimable(ring, seq, smp_load_acquire(&ring->ctrl->tail));
+}
+
+// Starts an in-place modification of the content, with the ring's lock held,
+// and returns the tail it starts from. The sequence is made odd first, 
+// consumers then claiming nothing past 'modify_done'; consumers check the 
+// sequence and claim what they copied within an RCU read-side critical 
+// section (see echo_ring_get), so that once a grace period has elapsed, none
+// can still be claiming data it copied before the modification started, and 
+// the tail stays put. Unlike an IPI to every CPU, the grace period only 
+// costs the modifier (which may sleep) some latency.
+static u64 echo_ring_modify_begin(struct echo_ring *ring)
+{
+    WRITE_ONCE(ring->modify_done, READ_ONCE(ring->ctrl->tail));
+    smp_store_release(&ring->modify_seq, ring->modify_seq + 1);
+    synchronize_rcu();
+    return READ_ONCE(ring->ctrl->tail);
+}
+
+// Lets consumers claim the content up to 'done', which the modification will
+// not change any further, and wakes up those waiting for it.
+static inline void echo_ring_modify_progress(struct echo_ring *ring, u64 done)
+{
+    smp_store_release(&ring->modify_done, done);
+    wake_up_interruptible(&ring->read_queue);
+}
+
+static inline void echo_ring_modify_end(struct echo_ring *ring)
+{
+    smp_store_release(&ring->modify_seq, ring->modify_seq + 1);
+    wake_up_interruptible(&ring->read_queue);
+}
+
+// Takes the ring's lock for a command (excluding producers, and other 
+// commands), or only tries to when the caller cannot sleep. Returns -EAGAIN
+// if the lock is contended and the caller cannot sleep, -ERESTARTSYS if a
+// signal interrupted the wait.
+static inline int echo_ring_lock_command(struct echo_ring *ring, bool nowait)
+{
+    if (nowait)
+    {
+        return mutex_trylock(&ring->lock) ? 0 : -EAGAIN;
+    }
+    return echo_ring_lock(ring, DRV_STATS_IOCTL) ? -ERESTARTSYS : 0;
+}
+
+// The following function must be called with the ring's lock held.
+
+// Copies as much of the source iterator's data as fits into the ring (in at
+// most two chunks: up to the end of the buffer, then wrapping around to its
+// start); the iterator may span several user segments, kernel pages or a 
+// pipe. Returns the number of bytes copied, or -EFAULT if none could be.
+static ssize_t echo_ring_put(struct echo_ring *ring, struct iov_iter *from)
+{
+    u64 head = READ_ONCE(ring->ctrl->head);
+    size_t size = iov_iter_count(from);
+    size_t len = min(size, echo_ring_free(ring));
+    size_t pos = head & (ring->capacity - 1);
+    size_t first = min(len, ring->capacity - pos);
+    pr_debug("echo::put: actual size: %zu, to size: %zu, from size: %zu\n", len, ring->capacity, size);
+    size_t copied = copy_from_iter(ring->buffer + pos, first, from);
+    if (copied == first)
+    {
+        copied += copy_from_iter(ring->buffer, len - first, from);
+    }
+    if (copied == 0 && len > 0)
+    {
+        return -EFAULT;
+    }
+    // Publishing the data only once it has been fully copied.
+    smp_store_release(&ring->ctrl->head, head + copied);
+    return copied;
+}
+
+// Copies (and consumes) as much of the ring's data as the destination 
+// iterator can hold, without taking the ring's lock. The data is copied 
+// first, then claimed by advancing the tail with a cmpxchg: if another
+// consumer claimed it in the meantime, the space may have been refilled by a
+// producer while being copied, and if a modification started or ended 
+// meanwhile, the copy may be torn; in both cases, the copy is discarded and
+// redone. While the content is being modified, only the part the 
+// modification is done with is copied.
+// Returns the number of bytes copied (0 if there was no data, or none that 
+// could be claimed yet), or -EFAULT if none could be.
+static ssize_t echo_ring_get(struct echo_ring *ring, struct iov_iter *to)
+{
+    size_t size = iov_iter_count(to);
+
+    for (;;)
+    {
+        unsigned int seq = smp_load_acquire(&ring->modify_seq);
+        u64 tail = smp_load_acquire(&ring->ctrl->tail);
+        size_t len = min(size, echo_ring_claimable(ring, seq, tail));
+        size_t pos = tail & (ring->capacity - 1);
+        size_t first = min(len, ring->capacity - pos);
+        if (len == 0)
+        {
+            return 0;
+        }
+        size_t copied = copy_to_iter(ring->buffer + pos, first, to);
+        if (copied == first)
+        {
+            copied += copy_to_iter(ring->buffer, len - first, to);
+        }
+        if (copied == 0)
+        {
+            return -EFAULT;
+        }
+        // The check and the claim must not be separated by a modification
+        // (see echo_ring_modify_begin).
+        rcu_read_lock();
+        bool claimed = READ_ONCE(ring->modify_seq) == seq &&
+                       cmpxchg(&ring->ctrl->tail, tail, tail + copied) == tail;
+        rcu_read_unlock();
+        if (claimed)
+        {
+            return copied;
+        }
+        iov_iter_revert(to, copied);
+    }
+}
+
+// Notifies the eventfd and the SIGIO listeners of a change to the content
+// (with the ring's lock held, as it protects the eventfd).
+static void echo_ring_notify(struct echo_ring *ring)
+{
+    if (ring->eventfd)
+    {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,8,0)
+        eventfd_signal(ring->eventfd);
+#else
+        eventfd_signal(ring->eventfd, 1);
+#endif
+    }
+    kill_fasync(&ring->async_queue, SIGIO, POLL_IN);
+}
 
+// Replaces the ring's eventfd with the given one (none if 'fd' is -1), 
+// registered through 'file'.
+static long echo_ring_set_eventfd(struct echo_ring *ring, struct file *file, int fd)
+{
+    struct eventfd_ctx *eventfd = NULL;
+
+    if (fd != -1)
+    {
+        eventfd = eventfd_ctx_fdget(fd);
+        if (IS_ERR(eventfd))
+        {
+            return PTR_ERR(eventfd);
+        }
+    }
+    mutex_lock(&ring->lock);
+    swap(ring->eventfd, eventfd);
+    ring->eventfd_owner = ring->eventfd ? file : NULL;
+    mutex_unlock(&ring->lock);
+    if (eventfd)
+    {
+        eventfd_ctx_put(eventfd);
+    }
+    return 0;
+}
+
+// Discards the content. The counters are never moved backwards (the tail 
+// catches up with the head instead), so that a consumer's cmpxchg cannot 
+// mistake a cleared ring for the one it copied from: the content not being
+// modified, consumers need not be held off.
+static void echo_ring_clear(struct echo_ring *ring)
+{
+    smp_store_release(&ring->ctrl->tail, READ_ONCE(ring->ctrl->head));
+}
+
+// ----------------------------------------------------------------------------
+// Transforms (see echo_transform.h)
+
+static int echo_transform_check(const struct echo_transform *transform)
+{
+    switch (transform->type)
+    {
+        case ECHO_TRANSFORM_REVERSE:
+        case ECHO_TRANSFORM_CASEFOLD:
+        case ECHO_TRANSFORM_CRC32C:
+            return 0;
+        case ECHO_TRANSFORM_BSWAP:
+            if (transform->width != 2 && transform->width != 4 && transform->width != 8)
+            {
+                return -EINVAL;
+            }
+            return 0;
+        case ECHO_TRANSFORM_XOR:
+            if (transform->width == 0 || transform->width > sizeof(transform->key) ||
+                sizeof(transform->key) % transform->width != 0)
+            {
+                return -EINVAL;
+            }
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
+
+// Validates and applies a transform, with the ring's lock held; the checksum
+// (if any) is returned in the descriptor. 
+// The checksum leaves the content unchanged: consumers are not held off. 
+// Other transforms are applied a chunk at a time (in logical order, and from
+// both ends at once for reverse), consumers being let claim each chunk as 
+// soon as it is final, and the modifier rescheduling in between: neither is 
+// held up for longer than it takes to transform a chunk, however large the
+// ring.
+static int echo_ring_transform(struct echo_ring *ring, struct echo_transform *transform)
+{
+    int status = echo_transform_check(transform);
+    if (status)
+    {
+        return status;
+    }
+    if (transform->type == ECHO_TRANSFORM_CRC32C)
+    {
+        struct echo_content content = {
+            .buffer = ring->buffer,
+            .capacity = ring->capacity,
+            .tail = smp_load_acquire(&ring->ctrl->tail),
+            .used = echo_ring_used(ring)
+        };
+        transform->crc = echo_transform_crc32c(&content, transform->crc);
+        return 0;
+    }
+
+    u64 tail = echo_ring_modify_begin(ring);
+    struct echo_content content = {
+        .buffer = ring->buffer,
+        .capacity = ring->capacity,
+        .tail = tail,
+        .used = min_t(size_t, READ_ONCE(ring->ctrl->head) - tail, ring->capacity)
+    };
+    size_t end = transform->type == ECHO_TRANSFORM_REVERSE ? content.used / 2 : content.used;
+    for (size_t off = 0; off < end; off += ECHO_MODIFY_CHUNK)
+    {
+        size_t len = min_t(size_t, end - off, ECHO_MODIFY_CHUNK);
+        struct echo_content part = echo_content_part(&content, off, len);
+        switch (transform->type)
+        {
+            case ECHO_TRANSFORM_REVERSE:
+                echo_transform_reverse_range(&content, off, off + len);
+                break;
+            case ECHO_TRANSFORM_BSWAP:
+                echo_transform_bswap(&part, transform->width);
+                break;
+            case ECHO_TRANSFORM_CASEFOLD:
+                echo_transform_casefold(&part);
+                break;
+            case ECHO_TRANSFORM_XOR:
+                echo_transform_xor(&part, transform->key, transform->width);
+                break;
+        }
+        echo_ring_modify_progress(ring, tail + off + len);
+        cond_resched();
+    }
+    echo_ring_modify_end(ring);
+    return 0;
+}
+
+static void echo_ring_reverse(struct echo_ring *ring)
+{
+    struct echo_transform transform = { .type = ECHO_TRANSFORM_REVERSE };
+    echo_ring_transform(ring, &transform);
+}
 
 // ----------------------------------------------------------------------------
 // IO operations
 
+// The ring an open file works with is kept in file->private_data: either the
+// ring of the device (minor) that was opened, or one allocated for the file.
 static int echo_open(struct inode *inode, struct file *file){
-   printk(KERN_INFO "echo::open\n");
-   return 0;
+   pr_debug("echo::open\n");
+   struct echo_device_data *data = container_of(inode->i_cdev, struct echo_device_data, cdev);
+
+   if (private_buffers)
+   {
+       struct echo_ring *ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+       if (!ring)
+       {
+           return -ENOMEM;
+       }
+       int status = echo_ring_init(ring, buffer_size);
+       if (status)
+       {
+           kfree(ring);
+           return status;
+       }
+       file->private_data = ring;
+   }
+   else
+   {
+       file->private_data = &data->ring;
+   }
+   // The ring is a stream: there is no meaningful position to seek to (lseek
+   // fails with -ESPIPE, with no need for an llseek operation).
+   return stream_open(inode, file);
+}
+
+static int echo_fasync(int fd, struct file *file, int on)
+{
+    struct echo_ring *ring = file->private_data;
+    return fasync_helper(fd, file, on, &ring->async_queue);
 }
 
 static int echo_release(struct inode *inode, struct file *file){
-   printk(KERN_INFO "echo::release\n");
+   pr_debug("echo::release\n");
+   struct echo_ring *ring = file->private_data;
+
+   echo_fasync(-1, file, 0);
+   if (READ_ONCE(ring->eventfd_owner) == file)
+   {
+       mutex_lock(&ring->lock);
+       if (ring->eventfd_owner == file)
+       {
+           eventfd_ctx_put(ring->eventfd);
+           ring->eventfd = NULL;
+           ring->eventfd_owner = NULL;
+       }
+       mutex_unlock(&ring->lock);
+   }
+   if (private_buffers)
+   {
+       echo_ring_destroy(ring);
+       kfree(ring);
+   }
    return 0;
 }
 
-static ssize_t echo_write(struct file *file, const char __user *user_buffer,
-                    size_t size, loff_t * offset)
+static ssize_t __echo_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    printk(KERN_INFO "echo::write");
-    mutex_lock(&crit_sec_mutex);
+    struct file *file = iocb->ki_filp;
+    struct echo_ring *ring = file->private_data;
+    size_t size = iov_iter_count(from);
 
-    struct echo_device_data *data = &echo_devices[0];
-    ssize_t len = min(ECHO_BUF_LEN - *offset, size);
-    printk(KERN_INFO "actual size: %d, to size: %d, from size: %d\n", len, sizeof(data->buffer), size);
-    int status = copy_from_user(data->buffer, user_buffer, len);
-    if (status)
+    if (size == 0)
     {
-        printk(KERN_INFO, "Error copying data from user space (status code: %d)", status);
-        mutex_unlock(&crit_sec_mutex);
-        return -EFAULT;
+        return 0;
+    }
+    if (echo_ring_lock(ring, DRV_STATS_WRITE))
+    {
+        return -ERESTARTSYS;
+    }
+    // Blocking until readers have freed some room in the ring (or failing
+    // right away in non-blocking mode).
+    while (echo_ring_free(ring) == 0)
+    {
+        mutex_unlock(&ring->lock);
+        if ((file->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT))
+        {
+            return -EAGAIN;
+        }
+        if (wait_event_interruptible(ring->write_queue, echo_ring_free(ring) > 0))
+        {
+            return -ERESTARTSYS;
+        }
+        if (echo_ring_lock(ring, DRV_STATS_WRITE))
+        {
+            return -ERESTARTSYS;
+        }
+    }
+
+    ssize_t len = echo_ring_put(ring, from);
+    if (len > 0)
+    {
+        echo_ring_notify(ring);
+    }
+    mutex_unlock(&ring->lock);
+
+    if (len > 0)
+    {
+        wake_up_interruptible(&ring->read_queue);
     }
-    *offset += len;
-    data->size += len;
-    mutex_unlock(&crit_sec_mutex);
     return len;
 }
 
-static ssize_t echo_read(struct file *file, char __user *user_buffer,
-                   size_t size, loff_t *offset)
+// Serves write, writev and (through iter_file_splice_write) splice to the
+// device.
+static ssize_t echo_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    printk(KERN_INFO "echo::read");
-    mutex_lock(&crit_sec_mutex);
+    ssize_t status = __echo_write_iter(iocb, from);
+    drv_stats_account(&echo_stats, DRV_STATS_WRITE, status);
+    return status;
+}
 
-    struct echo_device_data *data = &echo_devices[0];
-    ssize_t len = min(data->size - *offset, size);
-    printk(KERN_INFO "actual size: %d, to size: %d, from size: %d\n", len, size, sizeof(data->buffer));
-    int status = copy_to_user(user_buffer, data->buffer, len);
-    if (status)
+static ssize_t __echo_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *file = iocb->ki_filp;
+    struct echo_ring *ring = file->private_data;
+    size_t size = iov_iter_count(to);
+
+    if (size == 0)
     {
-        printk(KERN_INFO "Error copying data to user space (status code: %d)", status);
-        mutex_unlock(&crit_sec_mutex);
-        return -EFAULT;
+        return 0;
+    }
+    bool nowait = (file->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+    ssize_t len;
+    for (;;)
+    {
+        len = echo_ring_get(ring, to);
+        if (len != 0)
+        {
+            break;
+        }
+        // Blocking until writers have produced some data (or failing right
+        // away in non-blocking mode).
+        if (nowait)
+        {
+            return -EAGAIN;
+        }
+        if (wait_event_interruptible(ring->read_queue, echo_ring_readable(ring) > 0))
+        {
+            return -ERESTARTSYS;
+        }
+    }
+
+    if (len > 0)
+    {
+        wake_up_interruptible(&ring->write_queue);
     }
-    *offset += len;
-    mutex_unlock(&crit_sec_mutex);
     return len;
 }
 
-static long echo_ioctl(struct file *, unsigned int cmd, unsigned long arg)
+// Serves read, readv and (through the generic splice helper) splice from
+// the device.
+static ssize_t echo_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    ssize_t status = __echo_read_iter(iocb, to);
+    drv_stats_account(&echo_stats, DRV_STATS_READ, status);
+    return status;
+}
+
+static __poll_t echo_poll(struct file *file, poll_table *wait)
+{
+    struct echo_ring *ring = file->private_data;
+    __poll_t mask = 0;
+
+    poll_wait(file, &ring->read_queue, wait);
+    poll_wait(file, &ring->write_queue, wait);
+
+    if (echo_ring_readable(ring) > 0)
+    {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if (echo_ring_free(ring) > 0)
+    {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    return mask;
+}
+
+// Maps the control page, followed by the ring's data, into user space. The
+// mapping may start at the control page (offset 0) or anywhere in the data,
+// but may not extend past its end; remap_vmalloc_range() enforces this.
+static int echo_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct echo_ring *ring = file->private_data;
+
+    pr_debug("echo::mmap\n");
+    if (!(vma->vm_flags & VM_SHARED))
+    {
+        return -EINVAL;
+    }
+    return remap_vmalloc_range(vma, ring->ctrl, vma->vm_pgoff);
+}
+
+// Executes a batch of operations under a single hold of the ring's lock; 
+// consumers are only held off from the parts of the content a transform is 
+// not done with yet (see echo_ring_transform). Operations never block: writes copy what
+// fits, reads what is available.
+// Execution stops at the first failing operation; the result of each 
+// executed operation, and the number of successful ones, are copied back
+// to user space.
+static long echo_ioctl_batch(struct echo_ring *ring, struct echo_batch __user *user_batch, bool nowait)
+{
+    struct echo_batch batch;
+    struct echo_batch_op *ops;
+    long status = 0;
+    bool produced = false;
+    bool consumed = false;
+    bool modified = false;
+
+    if (copy_from_user(&batch, user_batch, sizeof(batch)))
+    {
+        return -EFAULT;
+    }
+    if (batch.count == 0 || batch.count > ECHO_BATCH_MAX_OPS)
+    {
+        return -EINVAL;
+    }
+    ops = kmalloc_array(batch.count, sizeof(*ops), GFP_KERNEL);
+    if (!ops)
+    {
+        return -ENOMEM;
+    }
+    if (copy_from_user(ops, u64_to_user_ptr(batch.ops), batch.count * sizeof(*ops)))
+    {
+        kfree(ops);
+        return -EFAULT;
+    }
+
+    // As for single commands, batches that may modify the content are left
+    // to io_uring's worker threads.
+    for (__u32 i = 0; i < batch.count && nowait; i++)
+    {
+        if (ops[i].op == ECHO_BATCH_OP_REVERSE || ops[i].op == ECHO_BATCH_OP_TRANSFORM)
+        {
+            kfree(ops);
+            return -EAGAIN;
+        }
+    }
+
+    batch.completed = 0;
+    status = echo_ring_lock_command(ring, nowait);
+    if (status)
+    {
+        kfree(ops);
+        return status;
+    }
+    for (__u32 i = 0; i < batch.count && status == 0; i++)
+    {
+        struct echo_batch_op *op = &ops[i];
+        ssize_t result = 0;
+        struct iovec iov = {
+            .iov_base = u64_to_user_ptr(op->buf),
+            .iov_len = op->len
+        };
+        struct iov_iter iter;
+
+        switch (op->op)
+        {
+            case ECHO_BATCH_OP_WRITE:
+                iov_iter_init(&iter, ITER_SOURCE, &iov, 1, op->len);
+                result = echo_ring_put(ring, &iter);
+                produced |= result > 0;
+                break;
+            case ECHO_BATCH_OP_READ:
+                iov_iter_init(&iter, ITER_DEST, &iov, 1, op->len);
+                result = echo_ring_get(ring, &iter);
+                consumed |= result > 0;
+                break;
+            case ECHO_BATCH_OP_CLEAR:
+                echo_ring_clear(ring);
+                consumed = true;
+                modified = true;
+                break;
+            case ECHO_BATCH_OP_REVERSE:
+                echo_ring_reverse(ring);
+                modified = true;
+                break;
+            case ECHO_BATCH_OP_TRANSFORM:
+            {
+                struct echo_transform transform;
+                struct echo_transform __user *user_transform = u64_to_user_ptr(op->buf);
+                if (copy_from_user(&transform, user_transform, sizeof(transform)))
+                {
+                    result = -EFAULT;
+                    break;
+                }
+                result = echo_ring_transform(ring, &transform);
+                // The checksum leaves the content unchanged: there is
+                // nothing to notify.
+                modified |= result == 0 && transform.type != ECHO_TRANSFORM_CRC32C;
+                if (result == 0 && copy_to_user(user_transform, &transform, sizeof(transform)))
+                {
+                    result = -EFAULT;
+                }
+                break;
+            }
+            default:
+                result = -EINVAL;
+                break;
+        }
+        op->result = result;
+        if (result < 0)
+        {
+            status = result;
+        }
+        else
+        {
+            batch.completed++;
+        }
+    }
+    if (produced || modified)
+    {
+        echo_ring_notify(ring);
+    }
+    mutex_unlock(&ring->lock);
+
+    if (produced)
+    {
+        wake_up_interruptible(&ring->read_queue);
+    }
+    if (consumed)
+    {
+        wake_up_interruptible(&ring->write_queue);
+    }
+    if (copy_to_user(u64_to_user_ptr(batch.ops), ops, batch.count * sizeof(*ops)) ||
+        put_user(batch.completed, &user_batch->completed))
+    {
+        status = -EFAULT;
+    }
+    kfree(ops);
+    return status;
+}
+
+// Executes a command, coming either from ioctl or from io_uring, 'arg' being
+// interpreted the same way in both cases. When 'nowait' is set (io_uring's
+// inline issue path), the command fails with -EAGAIN rather than sleeping
+// on a contended lock, and io_uring retries it from a worker thread.
+static long echo_command(struct file *file, unsigned int cmd, unsigned long arg, bool nowait)
 {
-    struct echo_device_data *data = &echo_devices[0];
-    
+    struct echo_ring *ring = file->private_data;
+
     switch (cmd)
     {
         case ECHO_IOCTL_CLEAR:
-            printk(KERN_INFO "echo::ioctl::clear");
-            data->size = 0;
-            data->buffer[0] = '\0';
+        {
+            pr_debug("echo::ioctl::clear\n");
+            long status = echo_ring_lock_command(ring, nowait);
+            if (status)
+            {
+                return status;
+            }
+            echo_ring_clear(ring);
+            echo_ring_notify(ring);
+            mutex_unlock(&ring->lock);
+            wake_up_interruptible(&ring->write_queue);
             return 0;
+        }
         case ECHO_IOCTL_REVERSE:
-            printk(KERN_INFO "echo::ioctl::reverse");   
-            int i = 0;
-            int j = data->size - 1;
-            while (i < j)
+        {
+            pr_debug("echo::ioctl::reverse\n");
+            // Modifications wait for a grace period (see 
+            // echo_ring_modify_begin): they are left to io_uring's worker
+            // threads.
+            if (nowait)
+            {
+                return -EAGAIN;
+            }
+            long status = echo_ring_lock_command(ring, nowait);
+            if (status)
             {
-                char tmp = data->buffer[i];
-                data->buffer[i] = data->buffer[j];
-                data->buffer[j] = tmp;
-                i++;
-                j--;
+                return status;
             }
+            echo_ring_reverse(ring);
+            echo_ring_notify(ring);
+            mutex_unlock(&ring->lock);
             return 0;
+        }
+        case ECHO_IOCTL_WAKEUP:
+        {
+            // Issued by processes that produce or consume through the
+            // mapping, to wake up those blocked in read/write/poll.
+            pr_debug("echo::ioctl::wakeup\n");
+            long status = echo_ring_lock_command(ring, nowait);
+            if (status)
+            {
+                return status;
+            }
+            echo_ring_notify(ring);
+            mutex_unlock(&ring->lock);
+            wake_up_interruptible(&ring->read_queue);
+            wake_up_interruptible(&ring->write_queue);
+            return 0;
+        }
+        case ECHO_IOCTL_TRANSFORM:
+        {
+            pr_debug("echo::ioctl::transform\n");
+            struct echo_transform transform;
+            struct echo_transform __user *user_transform = (struct echo_transform __user *)arg;
+            if (copy_from_user(&transform, user_transform, sizeof(transform)))
+            {
+                return -EFAULT;
+            }
+            if (nowait && transform.type != ECHO_TRANSFORM_CRC32C)
+            {
+                return -EAGAIN;
+            }
+            long status = echo_ring_lock_command(ring, nowait);
+            if (status)
+            {
+                return status;
+            }
+            status = echo_ring_transform(ring, &transform);
+            // The checksum leaves the content unchanged: there is nothing to
+            // notify.
+            if (status == 0 && transform.type != ECHO_TRANSFORM_CRC32C)
+            {
+                echo_ring_notify(ring);
+            }
+            mutex_unlock(&ring->lock);
+            if (status == 0 && copy_to_user(user_transform, &transform, sizeof(transform)))
+            {
+                status = -EFAULT;
+            }
+            return status;
+        }
+        case ECHO_IOCTL_BATCH:
+            pr_debug("echo::ioctl::batch\n");
+            return echo_ioctl_batch(ring, (struct echo_batch __user *)arg, nowait);
+        case ECHO_IOCTL_EVENTFD:
+        {
+            pr_debug("echo::ioctl::eventfd\n");
+            // Registration is rare: it is left to io_uring's worker threads.
+            if (nowait)
+            {
+                return -EAGAIN;
+            }
+            __s32 fd;
+            if (get_user(fd, (__s32 __user *)arg))
+            {
+                return -EFAULT;
+            }
+            return echo_ring_set_eventfd(ring, file, fd);
+        }
         default:
-            printk(KERN_ERR "echo::ioctl::invalid_cmd");
+            pr_debug("echo::ioctl::invalid_cmd\n");
             return -EINVAL;
     }
 
 }
 
+static long echo_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    long status = echo_command(file, cmd, arg, false);
+    drv_stats_account(&echo_stats, DRV_STATS_IOCTL, status);
+    return status;
+}
+
+// io_uring passthrough (from 5.19 on): the SQE's cmd_op holds one of the 
+// ioctl commands, and its command area a struct echo_uring_cmd holding the
+// ioctl argument. Commands complete inline, their result being posted in
+// the CQE.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0)
+static int echo_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,4,0)
+    const struct echo_uring_cmd *ucmd = io_uring_sqe_cmd(ioucmd->sqe);
+#else
+    const struct echo_uring_cmd *ucmd = ioucmd->cmd;
+#endif
+    // The command area lives in the SQE, which user space may still modify.
+    unsigned long arg = (unsigned long)READ_ONCE(ucmd->arg);
+
+    pr_debug("echo::uring_cmd\n");
+    int status = echo_command(ioucmd->file, ioucmd->cmd_op, arg, issue_flags & IO_URING_F_NONBLOCK);
+    drv_stats_account(&echo_stats, DRV_STATS_IOCTL, status);
+    return status;
+}
+#endif
+
 const struct  file_operations echo_ops = 
 {
     .owner = THIS_MODULE,
     .open = echo_open,
     .release = echo_release,
-    .read = echo_read,
-    .write = echo_write,
-    .unlocked_ioctl = echo_ioctl
+    .read_iter = echo_read_iter,
+    .write_iter = echo_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write,
+    .poll = echo_poll,
+    .mmap = echo_mmap,
+    .fasync = echo_fasync,
+    .unlocked_ioctl = echo_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0)
+    .uring_cmd = echo_uring_cmd
+#endif
 };
 
 // ----------------------------------------------------------------------------
 // Lifecycle
 
+static void echo_destroy_devices(unsigned int count)
+{
+    for(unsigned int minor = 0; minor < count; minor++) {
+        device_destroy(echo_class, echo_devices[minor].dev_no);
+        cdev_del(&echo_devices[minor].cdev);
+        echo_ring_destroy(&echo_devices[minor].ring);
+    }
+}
+
 static int __init echo_init(void)
 {
     printk(KERN_INFO "-> echo::init\n");
-    int status = register_chrdev_region(MKDEV(ECHO_MAJOR, 0), ECHO_MAX_DEVICES, "echo_device_driver");
+    unsigned int minor = 0;
+
+    if (buffer_size < ECHO_MIN_BUF_LEN)
+    {
+        buffer_size = ECHO_MIN_BUF_LEN;
+    }
+    buffer_size = roundup_pow_of_two(buffer_size);
+    num_devices = clamp(num_devices, 1u, (unsigned int)ECHO_MAX_DEVICES);
+
+    int status = drv_stats_init(&echo_stats, ECHO_DEVICE_NAME);
     if (status != 0)
     {
         goto Error;
     }
-    for(int minor = 0; minor < ECHO_MAX_DEVICES; minor++) {
-        cdev_init(&echo_devices[minor].cdev, &echo_ops);
-        echo_devices[minor].dev_no = MKDEV(ECHO_MAJOR, minor);
-        cdev_add(&echo_devices[minor].cdev, echo_devices[minor].dev_no, 1);
-        echo_devices[minor].cdrv_class = class_create(THIS_MODULE, ECHO_CLASS_NAME);
-        if (IS_ERR(echo_devices[minor].cdrv_class)){
-             printk(KERN_ALERT "Could not create %s device class\n", ECHO_CLASS_NAME);
-             status = PTR_ERR(echo_devices[minor].cdrv_class);
-             goto Error;
-        }
-        echo_devices[minor].size = 0;
-        printk(KERN_INFO "Created %s device class\n", ECHO_CLASS_NAME);
-        echo_devices[minor].cdrv_dev = device_create(echo_devices[minor].cdrv_class, NULL, MKDEV(ECHO_MAJOR, minor), NULL, ECHO_DEVICE_NAME);
-    }
-    mutex_init(&crit_sec_mutex);
+    status = register_chrdev_region(MKDEV(ECHO_MAJOR, 0), num_devices, "echo_device_driver");
+    if (status != 0)
+    {
+        goto ErrorStats;
+    }
+    echo_devices = kcalloc(num_devices, sizeof(*echo_devices), GFP_KERNEL);
+    if (!echo_devices)
+    {
+        status = -ENOMEM;
+        goto ErrorRegion;
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,4,0)
+    echo_class = class_create(ECHO_CLASS_NAME);
+#else
+    echo_class = class_create(THIS_MODULE, ECHO_CLASS_NAME);
+#endif
+    if (IS_ERR(echo_class)){
+         printk(KERN_ALERT "Could not create %s device class\n", ECHO_CLASS_NAME);
+         status = PTR_ERR(echo_class);
+         goto ErrorDevices;
+    }
+    printk(KERN_INFO "Created %s device class\n", ECHO_CLASS_NAME);
+
+    for(; minor < num_devices; minor++) {
+        struct echo_device_data *data = &echo_devices[minor];
+
+        status = echo_ring_init(&data->ring, buffer_size);
+        if (status)
+        {
+             printk(KERN_ALERT "Could not allocate %lu-byte ring buffer\n", buffer_size);
+             goto ErrorMinors;
+        }
+        cdev_init(&data->cdev, &echo_ops);
+        data->dev_no = MKDEV(ECHO_MAJOR, minor);
+        status = cdev_add(&data->cdev, data->dev_no, 1);
+        if (status)
+        {
+             echo_ring_destroy(&data->ring);
+             goto ErrorMinors;
+        }
+        // The first device keeps the historical /dev/echo name.
+        if (minor == 0)
+        {
+            data->cdrv_dev = device_create(echo_class, NULL, data->dev_no, NULL, ECHO_DEVICE_NAME);
+        }
+        else
+        {
+            data->cdrv_dev = device_create(echo_class, NULL, data->dev_no, NULL, ECHO_DEVICE_NAME "%u", minor);
+        }
+    }
     printk(KERN_INFO "<- echo::init\n");
     return 0;
 
+    ErrorMinors:
+        echo_destroy_devices(minor);
+        class_destroy(echo_class);
+    ErrorDevices:
+        kfree(echo_devices);
+    ErrorRegion:
+        unregister_chrdev_region(MKDEV(ECHO_MAJOR, 0), num_devices);
+    ErrorStats:
+        drv_stats_destroy(&echo_stats);
     Error:
         printk(KERN_INFO, "Error occurred. Aborting module initialization (status code: %i)\n", status);
         return status;
@@ -175,12 +1085,11 @@ static int __init echo_init(void)
 static void __exit echo_exit(void)
 {
     printk(KERN_INFO, "-> echo::exit\n");
-    for(int minor = 0; minor < ECHO_MAX_DEVICES; minor++) {
-        device_destroy(echo_devices[minor].cdrv_class, echo_devices[minor].dev_no);
-        class_destroy(echo_devices[minor].cdrv_class);
-        cdev_del(&echo_devices[minor].cdev);
-    }
-    unregister_chrdev_region(MKDEV(ECHO_MAJOR, 0), ECHO_MAX_DEVICES);
+    echo_destroy_devices(num_devices);
+    class_destroy(echo_class);
+    kfree(echo_devices);
+    unregister_chrdev_region(MKDEV(ECHO_MAJOR, 0), num_devices);
+    drv_stats_destroy(&echo_stats);
     printk(KERN_INFO, "<- echo::exit\n");
 }
 
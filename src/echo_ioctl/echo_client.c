@@ -1,54 +1,803 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
 
 #include "echo_ioctl.h"
 
 #define ECHO_IOCTL_CLEAR _IO(ECHO_IOCTL_MAGIC, ECHO_IOCTL_CLEAR_CMD)
 #define ECHO_IOCTL_REVERSE _IO(ECHO_IOCTL_MAGIC, ECHO_IOCTL_REVERSE_CMD)
+#define ECHO_IOCTL_BATCH _IOWR(ECHO_IOCTL_MAGIC, ECHO_IOCTL_BATCH_CMD, struct echo_batch)
+#define ECHO_IOCTL_TRANSFORM _IOWR(ECHO_IOCTL_MAGIC, ECHO_IOCTL_TRANSFORM_CMD, struct echo_transform)
+#define ECHO_IOCTL_EVENTFD _IOW(ECHO_IOCTL_MAGIC, ECHO_IOCTL_EVENTFD_CMD, __s32)
 
 #define REVERSE "reverse"
 #define CLEAR "clear"
+#define READ "read"
+#define WRITE "write:"
+#define CASEFOLD "casefold"
+#define BSWAP "bswap:"
+#define XOR "xor:"
+#define CRC32C "crc32c"
+#define URING "--uring"
+#define BENCH "bench"
+#define WATCH "watch"
 #define DEVICE_NAME "/dev/echo"
+#define READ_BUF_LEN 4096
 
-int main(int argc, char *argv[]) 
+static void usage(const char *name)
+{
+    printf("Missing argument. Synopsis:\n");
+    printf("%s [%s] <command> [<command>...]\n\n", name, URING);
+    printf("Where <command> can be:\n");
+    printf("- reverse\n");
+    printf("- clear\n");
+    printf("- read\n");
+    printf("- write:<text>\n");
+    printf("- casefold\n");
+    printf("- bswap:<2|4|8>\n");
+    printf("- xor:<key> (key of 1, 2, 4 or 8 characters)\n");
+    printf("- crc32c\n\n");
+    printf("All commands are sent to the driver at once, in a single batch.\n");
+    printf("With %s, they are instead submitted through io_uring, as linked\n", URING);
+    printf("SQEs (reads/writes as such, other commands as passthrough commands).\n\n");
+    printf("%s %s [options] runs a load generator instead (see %s %s -h).\n", name, BENCH, name, BENCH);
+    printf("%s %s waits for changes to the content (through an eventfd) and\n", name, WATCH);
+    printf("reports them, until interrupted.\n");
+}
+
+// ----------------------------------------------------------------------------
+// io_uring (without liburing: the rings are set up and driven through the 
+// raw system calls)
+
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+static int uring_setup(unsigned entries, struct uring *u)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0)
+    {
+        return -1;
+    }
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        sq_len = cq_len = (sq_len > cq_len) ? sq_len : cq_len;
+    }
+    char *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+    {
+        return -1;
+    }
+    char *cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+        {
+            return -1;
+        }
+    }
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *u, unsigned n)
+{
+    unsigned index = (*u->sq_tail + n) & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[index] = index;
+    return sqe;
+}
+
+// Translates the batch operations into linked SQEs (so that they execute in
+// order), submits them with a single system call and waits for all of their
+// completions, storing each completion's result in the matching operation.
+static int uring_run(int fd, struct echo_batch_op *ops, int count)
+{
+    struct uring u;
+    if (uring_setup(count, &u) < 0)
+    {
+        printf("Cannot set up io_uring\n");
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        struct io_uring_sqe *sqe = uring_get_sqe(&u, i);
+        struct echo_uring_cmd ucmd = { .arg = 0 };
+
+        sqe->fd = fd;
+        sqe->user_data = i;
+        sqe->off = (__u64)-1;
+        if (i < count - 1)
+        {
+            sqe->flags = IOSQE_IO_LINK;
+        }
+        switch (ops[i].op)
+        {
+            case ECHO_BATCH_OP_WRITE:
+                sqe->opcode = IORING_OP_WRITE;
+                sqe->addr = ops[i].buf;
+                sqe->len = ops[i].len;
+                break;
+            case ECHO_BATCH_OP_READ:
+                sqe->opcode = IORING_OP_READ;
+                sqe->addr = ops[i].buf;
+                sqe->len = ops[i].len;
+                break;
+            case ECHO_BATCH_OP_CLEAR:
+                sqe->opcode = IORING_OP_URING_CMD;
+                sqe->cmd_op = ECHO_IOCTL_CLEAR;
+                break;
+            case ECHO_BATCH_OP_REVERSE:
+                sqe->opcode = IORING_OP_URING_CMD;
+                sqe->cmd_op = ECHO_IOCTL_REVERSE;
+                break;
+            case ECHO_BATCH_OP_TRANSFORM:
+                sqe->opcode = IORING_OP_URING_CMD;
+                sqe->cmd_op = ECHO_IOCTL_TRANSFORM;
+                ucmd.arg = ops[i].buf;
+                break;
+        }
+        if (sqe->opcode == IORING_OP_URING_CMD)
+        {
+            sqe->off = 0;
+            memcpy(sqe->cmd, &ucmd, sizeof(ucmd));
+        }
+    }
+    __atomic_store_n(u.sq_tail, *u.sq_tail + count, __ATOMIC_RELEASE);
+
+    int status = syscall(__NR_io_uring_enter, u.fd, count, count, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (status < 0)
+    {
+        printf("Cannot submit to io_uring\n");
+        close(u.fd);
+        return -1;
+    }
+
+    unsigned head = *u.cq_head;
+    for (int done = 0; done < count; done++)
+    {
+        while (head == __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE))
+        {
+            syscall(__NR_io_uring_enter, u.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        }
+        struct io_uring_cqe *cqe = &u.cqes[head & *u.cq_mask];
+        ops[cqe->user_data].result = cqe->res;
+        head++;
+        __atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+    }
+    close(u.fd);
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+
+// ----------------------------------------------------------------------------
+// Benchmark (load generator)
+//
+// Each thread opens one of the given devices (round-robin), in non-blocking
+// mode, and issues a random mix of writes, reads and ioctls (reverse) of the
+// given size until the duration has elapsed, optionally at a fixed rate.
+// Latencies are recorded in log-linear (HDR-style) histograms: values below
+// 2^BENCH_SUB_BITS ns are recorded exactly, larger ones with a relative
+// precision of 2^-BENCH_SUB_BITS. When a rate is set, latencies are measured
+// from the time each operation was scheduled to start (rather than from when
+// it actually started), so that stalls are not hidden by the following
+// operations being delayed (coordinated omission).
+
+#define BENCH_SUB_BITS 5
+#define BENCH_SUB (1u << BENCH_SUB_BITS)
+#define BENCH_NUM_BUCKETS ((64 - BENCH_SUB_BITS) * BENCH_SUB)
+#define BENCH_MAX_DEVICES 16
+#define BENCH_NUM_OPS 3
+
+enum bench_op { BENCH_WRITE, BENCH_READ, BENCH_IOCTL };
+static const char *bench_op_names[BENCH_NUM_OPS] = { "write", "read", "ioctl" };
+
+struct bench_config {
+    const char *devices[BENCH_MAX_DEVICES];
+    int num_devices;
+    int threads;
+    size_t size;
+    unsigned weights[BENCH_NUM_OPS];
+    unsigned rate;
+    unsigned duration;
+    int json;
+};
+
+struct bench_stats {
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t eagain;
+    uint64_t errors;
+    uint64_t max;
+    uint64_t buckets[BENCH_NUM_BUCKETS];
+};
+
+struct bench_thread {
+    pthread_t thread;
+    int id;
+    const struct bench_config *config;
+    struct bench_stats stats[BENCH_NUM_OPS];
+    int status;
+};
+
+static volatile int bench_stop;
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Values of 2^63 and above (which no latency reaches) go to the last bucket.
+static unsigned bench_bucket(uint64_t value)
+{
+    if (value < BENCH_SUB)
+    {
+        return value;
+    }
+    unsigned shift = 63 - __builtin_clzll(value) - BENCH_SUB_BITS;
+    unsigned bucket = (shift + 1) * BENCH_SUB + (unsigned)((value >> shift) - BENCH_SUB);
+    return bucket < BENCH_NUM_BUCKETS ? bucket : BENCH_NUM_BUCKETS - 1;
+}
+
+// Returns the highest value recorded in the given bucket.
+static uint64_t bench_bucket_value(unsigned bucket)
+{
+    if (bucket < BENCH_SUB)
+    {
+        return bucket;
+    }
+    unsigned shift = bucket / BENCH_SUB - 1;
+    uint64_t mantissa = bucket % BENCH_SUB + BENCH_SUB;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+static uint64_t bench_percentile(const struct bench_stats *stats, double percentile)
+{
+    if (stats->count == 0)
+    {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(percentile / 100.0 * stats->count + 0.5);
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < BENCH_NUM_BUCKETS; b++)
+    {
+        seen += stats->buckets[b];
+        if (seen >= rank && seen > 0)
+        {
+            uint64_t value = bench_bucket_value(b);
+            return value < stats->max ? value : stats->max;
+        }
+    }
+    return stats->max;
+}
+
+static void bench_record(struct bench_stats *stats, uint64_t latency, ssize_t result)
+{
+    stats->count++;
+    stats->buckets[bench_bucket(latency)]++;
+    if (latency > stats->max)
+    {
+        stats->max = latency;
+    }
+    if (result > 0)
+    {
+        stats->bytes += result;
+    }
+    else if (result < 0 && errno == EAGAIN)
+    {
+        stats->eagain++;
+    }
+    else if (result < 0)
+    {
+        stats->errors++;
+    }
+}
+
+static void *bench_run(void *arg)
+{
+    struct bench_thread *t = arg;
+    const struct bench_config *config = t->config;
+    const char *device = config->devices[t->id % config->num_devices];
+    unsigned total_weight = config->weights[BENCH_WRITE] + config->weights[BENCH_READ] + config->weights[BENCH_IOCTL];
+    unsigned seed = 0x9e3779b9u * (t->id + 1);
+
+    char *buf = malloc(config->size);
+    if (!buf)
+    {
+        printf("Cannot allocate %zu-byte buffer\n", config->size);
+        t->status = -1;
+        return NULL;
+    }
+    int fd = open(device, O_RDWR | O_NONBLOCK);
+    if (fd < 0)
+    {
+        printf("Cannot open device file: %s\n", device);
+        free(buf);
+        t->status = -1;
+        return NULL;
+    }
+    memset(buf, 'x', config->size);
+
+    uint64_t interval = config->rate ? 1000000000ull / config->rate : 0;
+    uint64_t next = bench_now();
+    while (!bench_stop)
+    {
+        if (interval)
+        {
+            uint64_t now = bench_now();
+            if (next > now)
+            {
+                struct timespec ts = { .tv_sec = (next - now) / 1000000000ull, .tv_nsec = (next - now) % 1000000000ull };
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        unsigned pick = rand_r(&seed) % total_weight;
+        enum bench_op op = pick < config->weights[BENCH_WRITE] ? BENCH_WRITE :
+            pick < config->weights[BENCH_WRITE] + config->weights[BENCH_READ] ? BENCH_READ : BENCH_IOCTL;
+        uint64_t start = interval ? next : bench_now();
+        ssize_t result;
+        switch (op)
+        {
+            case BENCH_WRITE:
+                result = write(fd, buf, config->size);
+                break;
+            case BENCH_READ:
+                result = read(fd, buf, config->size);
+                break;
+            default:
+                result = ioctl(fd, ECHO_IOCTL_REVERSE);
+                break;
+        }
+        uint64_t end = bench_now();
+        // With a rate, 'start' is the scheduled time, which the operation
+        // may precede when nanosleep returned early.
+        bench_record(&t->stats[op], end > start ? end - start : 0, result);
+        next += interval;
+    }
+
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+static void bench_merge(struct bench_stats *dst, const struct bench_stats *src)
+{
+    dst->count += src->count;
+    dst->bytes += src->bytes;
+    dst->eagain += src->eagain;
+    dst->errors += src->errors;
+    if (src->max > dst->max)
+    {
+        dst->max = src->max;
+    }
+    for (unsigned b = 0; b < BENCH_NUM_BUCKETS; b++)
+    {
+        dst->buckets[b] += src->buckets[b];
+    }
+}
+
+static const double bench_percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+#define BENCH_NUM_PERCENTILES (sizeof(bench_percentiles) / sizeof(bench_percentiles[0]))
+
+static void bench_report(const struct bench_config *config, struct bench_stats *totals, double elapsed)
+{
+    if (config->json)
+    {
+        printf("{\"threads\": %d, \"size\": %zu, \"rate\": %u, \"duration_s\": %.3f, \"devices\": [",
+               config->threads, config->size, config->rate, elapsed);
+        for (int d = 0; d < config->num_devices; d++)
+        {
+            printf("%s\"%s\"", d ? ", " : "", config->devices[d]);
+        }
+        printf("], \"ops\": {");
+        for (int op = 0; op <= BENCH_NUM_OPS; op++)
+        {
+            const struct bench_stats *stats = &totals[op];
+            printf("%s\"%s\": {\"count\": %llu, \"ops_per_s\": %.1f, \"mb_per_s\": %.3f, \"eagain\": %llu, \"errors\": %llu, \"latency_ns\": {",
+                   op ? ", " : "", op < BENCH_NUM_OPS ? bench_op_names[op] : "total",
+                   (unsigned long long)stats->count, stats->count / elapsed, stats->bytes / elapsed / 1e6,
+                   (unsigned long long)stats->eagain, (unsigned long long)stats->errors);
+            for (unsigned p = 0; p < BENCH_NUM_PERCENTILES; p++)
+            {
+                printf("\"p%g\": %llu, ", bench_percentiles[p], (unsigned long long)bench_percentile(stats, bench_percentiles[p]));
+            }
+            printf("\"max\": %llu}}", (unsigned long long)stats->max);
+        }
+        printf("}}\n");
+        return;
+    }
+
+    printf("threads: %d, size: %zu, rate: %u/s per thread, duration: %.3f s\n",
+           config->threads, config->size, config->rate, elapsed);
+    printf("%-6s %12s %12s %10s %10s %8s %10s %10s %10s %10s %10s\n",
+           "op", "count", "ops/s", "MB/s", "eagain", "errors", "p50(us)", "p90(us)", "p99(us)", "p99.9(us)", "max(us)");
+    for (int op = 0; op <= BENCH_NUM_OPS; op++)
+    {
+        const struct bench_stats *stats = &totals[op];
+        printf("%-6s %12llu %12.1f %10.3f %10llu %8llu",
+               op < BENCH_NUM_OPS ? bench_op_names[op] : "total",
+               (unsigned long long)stats->count, stats->count / elapsed, stats->bytes / elapsed / 1e6,
+               (unsigned long long)stats->eagain, (unsigned long long)stats->errors);
+        for (unsigned p = 0; p < BENCH_NUM_PERCENTILES; p++)
+        {
+            printf(" %10.2f", bench_percentile(stats, bench_percentiles[p]) / 1e3);
+        }
+        printf(" %10.2f\n", stats->max / 1e3);
+    }
+}
+
+static void bench_usage(const char *name)
+{
+    printf("%s %s [options]\n\n", name, BENCH);
+    printf("Options:\n");
+    printf("-d <device>  device to use (may be repeated, max: %d; default: %s)\n", BENCH_MAX_DEVICES, DEVICE_NAME);
+    printf("-t <count>   number of threads (default: 1)\n");
+    printf("-s <bytes>   size of writes/reads (default: 4096)\n");
+    printf("-w <weight>  relative weight of writes (default: 1)\n");
+    printf("-r <weight>  relative weight of reads (default: 1)\n");
+    printf("-i <weight>  relative weight of ioctls (reverse; default: 0)\n");
+    printf("-R <ops/s>   rate per thread (default: 0, unlimited)\n");
+    printf("-T <seconds> duration (default: 5)\n");
+    printf("-j           JSON output\n");
+}
+
+static int bench_main(const char *name, int argc, char *argv[])
+{
+    struct bench_config config = {
+        .num_devices = 0,
+        .threads = 1,
+        .size = 4096,
+        .weights = { 1, 1, 0 },
+        .rate = 0,
+        .duration = 5,
+        .json = 0
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:t:s:w:r:i:R:T:jh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'd':
+                if (config.num_devices == BENCH_MAX_DEVICES)
+                {
+                    printf("Too many devices (max: %d)\n", BENCH_MAX_DEVICES);
+                    return -1;
+                }
+                config.devices[config.num_devices++] = optarg;
+                break;
+            case 't': config.threads = atoi(optarg); break;
+            case 's': config.size = strtoul(optarg, NULL, 10); break;
+            case 'w': config.weights[BENCH_WRITE] = atoi(optarg); break;
+            case 'r': config.weights[BENCH_READ] = atoi(optarg); break;
+            case 'i': config.weights[BENCH_IOCTL] = atoi(optarg); break;
+            case 'R': config.rate = atoi(optarg); break;
+            case 'T': config.duration = atoi(optarg); break;
+            case 'j': config.json = 1; break;
+            default:
+                bench_usage(name);
+                return opt == 'h' ? 0 : -1;
+        }
+    }
+    if (config.num_devices == 0)
+    {
+        config.devices[config.num_devices++] = DEVICE_NAME;
+    }
+    if (config.threads <= 0 || config.size == 0 || config.duration == 0 ||
+        config.weights[BENCH_WRITE] + config.weights[BENCH_READ] + config.weights[BENCH_IOCTL] == 0)
+    {
+        bench_usage(name);
+        return -1;
+    }
+
+    struct bench_thread *threads = calloc(config.threads, sizeof(*threads));
+    if (!threads)
+    {
+        printf("Cannot allocate thread state\n");
+        return -1;
+    }
+
+    int status = 0;
+    int started = 0;
+    uint64_t start = bench_now();
+    for (; started < config.threads; started++)
+    {
+        threads[started].id = started;
+        threads[started].config = &config;
+        if (pthread_create(&threads[started].thread, NULL, bench_run, &threads[started]) != 0)
+        {
+            printf("Cannot start thread %d\n", started);
+            status = -1;
+            break;
+        }
+    }
+    if (status == 0)
+    {
+        sleep(config.duration);
+    }
+    bench_stop = 1;
+
+    // The last slot holds the totals over all operation types.
+    struct bench_stats *totals = calloc(BENCH_NUM_OPS + 1, sizeof(*totals));
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        if (threads[i].status)
+        {
+            status = threads[i].status;
+        }
+        for (int op = 0; totals && op < BENCH_NUM_OPS; op++)
+        {
+            bench_merge(&totals[op], &threads[i].stats[op]);
+            bench_merge(&totals[BENCH_NUM_OPS], &threads[i].stats[op]);
+        }
+    }
+    double elapsed = (bench_now() - start) / 1e9;
+
+    if (status == 0 && totals)
+    {
+        bench_report(&config, totals, elapsed);
+    }
+    free(totals);
+    free(threads);
+    return status;
+}
+
+// ----------------------------------------------------------------------------
+// Watch
+
+static int watch_main(void)
+{
+    int fd = open(DEVICE_NAME, O_RDWR);
+    if (fd < 0)
+    {
+        printf("Cannot open device file: %s\n", DEVICE_NAME);
+        return -1;
+    }
+    int efd = eventfd(0, EFD_CLOEXEC);
+    if (efd < 0)
+    {
+        printf("Cannot create eventfd\n");
+        close(fd);
+        return -1;
+    }
+    __s32 arg = efd;
+    if (ioctl(fd, ECHO_IOCTL_EVENTFD, &arg) < 0)
+    {
+        printf("Cannot register eventfd (status: %d)\n", -errno);
+        close(efd);
+        close(fd);
+        return -1;
+    }
+
+    // The eventfd's counter accumulates the notifications that occurred 
+    // since the previous read.
+    printf("Watching %s (interrupt to stop)\n", DEVICE_NAME);
+    uint64_t events;
+    while (read(efd, &events, sizeof(events)) == sizeof(events))
+    {
+        printf("Content changed (%llu event(s))\n", (unsigned long long)events);
+    }
+    close(efd);
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char *argv[])
 {
     if (argc == 1)
     {
-        printf("Missing argument. Synopsis:\n");
-        printf("%s <command>\n\n", argv[0]);
-        printf("Where <command> can be:\n");
-        printf("- reverse\n");
-        printf("- clear\n");
+        usage(argv[0]);
         return 0;
     }
-    
-    int command = 0;
+    if (strcmp(argv[1], BENCH) == 0)
+    {
+        return bench_main(argv[0], argc - 1, argv + 1);
+    }
+    if (strcmp(argv[1], WATCH) == 0)
+    {
+        return watch_main();
+    }
 
-    if (strcmp(argv[1], REVERSE) == 0)
+    int first_arg = 1;
+    int use_uring = 0;
+    if (strcmp(argv[1], URING) == 0)
     {
-        printf("Sending 'reverse' command\n");
-        command = ECHO_IOCTL_REVERSE;
+        use_uring = 1;
+        first_arg = 2;
     }
-    else if (strcmp(argv[1], CLEAR) == 0)
+
+    int count = argc - first_arg;
+    if (count == 0)
     {
-        printf("Sending 'clear' command\n");
-        command = ECHO_IOCTL_CLEAR;
+        usage(argv[0]);
+        return 0;
     }
-    else
+    if (count > ECHO_BATCH_MAX_OPS)
     {
-        printf("Unknown command %s\n. Expected either one of: %s, %s", argv[1], REVERSE, CLEAR);
+        printf("Too many commands: %d (max: %d)\n", count, ECHO_BATCH_MAX_OPS);
         return -1;
     }
 
+    struct echo_batch_op ops[ECHO_BATCH_MAX_OPS];
+    char *read_bufs[ECHO_BATCH_MAX_OPS] = { 0 };
+    struct echo_transform transforms[ECHO_BATCH_MAX_OPS];
+    memset(ops, 0, sizeof(ops));
+    memset(transforms, 0, sizeof(transforms));
+
+    int status = 0;
+    for (int i = 0; i < count; i++)
+    {
+        const char *arg = argv[i + first_arg];
+        if (strcmp(arg, REVERSE) == 0)
+        {
+            ops[i].op = ECHO_BATCH_OP_REVERSE;
+        }
+        else if (strcmp(arg, CLEAR) == 0)
+        {
+            ops[i].op = ECHO_BATCH_OP_CLEAR;
+        }
+        else if (strcmp(arg, READ) == 0)
+        {
+            read_bufs[i] = malloc(READ_BUF_LEN);
+            if (!read_bufs[i])
+            {
+                printf("Cannot allocate read buffer\n");
+                status = -1;
+                goto End;
+            }
+            ops[i].op = ECHO_BATCH_OP_READ;
+            ops[i].buf = (__u64)(unsigned long)read_bufs[i];
+            ops[i].len = READ_BUF_LEN;
+        }
+        else if (strncmp(arg, WRITE, strlen(WRITE)) == 0)
+        {
+            const char *text = arg + strlen(WRITE);
+            ops[i].op = ECHO_BATCH_OP_WRITE;
+            ops[i].buf = (__u64)(unsigned long)text;
+            ops[i].len = strlen(text);
+        }
+        else if (strcmp(arg, CASEFOLD) == 0)
+        {
+            transforms[i].type = ECHO_TRANSFORM_CASEFOLD;
+            ops[i].op = ECHO_BATCH_OP_TRANSFORM;
+            ops[i].buf = (__u64)(unsigned long)&transforms[i];
+        }
+        else if (strncmp(arg, BSWAP, strlen(BSWAP)) == 0)
+        {
+            transforms[i].type = ECHO_TRANSFORM_BSWAP;
+            ops[i].op = ECHO_BATCH_OP_TRANSFORM;
+            ops[i].buf = (__u64)(unsigned long)&transforms[i];
+            transforms[i].width = atoi(arg + strlen(BSWAP));
+        }
+        else if (strncmp(arg, XOR, strlen(XOR)) == 0)
+        {
+            const char *key = arg + strlen(XOR);
+            size_t key_len = strlen(key);
+            if (key_len > sizeof(transforms[i].key))
+            {
+                printf("Key too long: %s (max: %zu characters)\n", key, sizeof(transforms[i].key));
+                status = -1;
+                goto End;
+            }
+            transforms[i].type = ECHO_TRANSFORM_XOR;
+            ops[i].op = ECHO_BATCH_OP_TRANSFORM;
+            ops[i].buf = (__u64)(unsigned long)&transforms[i];
+            transforms[i].width = key_len;
+            memcpy(transforms[i].key, key, key_len);
+        }
+        else if (strcmp(arg, CRC32C) == 0)
+        {
+            transforms[i].type = ECHO_TRANSFORM_CRC32C;
+            ops[i].op = ECHO_BATCH_OP_TRANSFORM;
+            ops[i].buf = (__u64)(unsigned long)&transforms[i];
+        }
+        else
+        {
+            printf("Unknown command %s\n. Expected either one of: %s, %s, %s, %s<text>, %s, %s<width>, %s<key>, %s\n", arg, REVERSE, CLEAR, READ, WRITE, CASEFOLD, BSWAP, XOR, CRC32C);
+            status = -1;
+            goto End;
+        }
+    }
+
     int fd = open(DEVICE_NAME, O_RDWR);
     if(fd < 0) {
         printf("Cannot open device file: %s\n", DEVICE_NAME);
-        return -1;
+        status = -1;
+        goto End;
+    }
+
+    struct echo_batch batch = {
+        .ops = (__u64)(unsigned long)ops,
+        .count = count,
+        .completed = 0
+    };
+    if (use_uring)
+    {
+        printf("Submitting %d command(s) through io_uring\n", count);
+        status = uring_run(fd, ops, count);
+        while (batch.completed < (__u32)count && ops[batch.completed].result >= 0)
+        {
+            batch.completed++;
+        }
+        if (status == 0 && batch.completed < (__u32)count)
+        {
+            status = -1;
+        }
+    }
+    else
+    {
+        printf("Sending batch of %d command(s)\n", count);
+        status = ioctl(fd, ECHO_IOCTL_BATCH, &batch);
     }
-    int status = ioctl(fd, command);
     close(fd);
-    return status;
-}
\ No newline at end of file
+
+    for (__u32 i = 0; i < batch.completed; i++)
+    {
+        if (ops[i].op == ECHO_BATCH_OP_READ)
+        {
+            fwrite(read_bufs[i], 1, ops[i].result, stdout);
+        }
+        else if (ops[i].op == ECHO_BATCH_OP_TRANSFORM && transforms[i].type == ECHO_TRANSFORM_CRC32C)
+        {
+            printf("crc32c: 0x%08x\n", transforms[i].crc);
+        }
+    }
+    if (batch.completed < (__u32)count)
+    {
+        printf("Command '%s' failed (result: %lld)\n", argv[batch.completed + first_arg], (long long)ops[batch.completed].result);
+    }
+
+    End:
+        for (int i = 0; i < count; i++)
+        {
+            free(read_bufs[i]);
+        }
+        return status;
+}
@@ -1,3 +1,109 @@
+#include <linux/types.h>
+
 #define ECHO_IOCTL_MAGIC 0xFE
 #define ECHO_IOCTL_CLEAR_CMD  0x00
-#define ECHO_IOCTL_REVERSE_CMD 0x01
\ No newline at end of file
+#define ECHO_IOCTL_REVERSE_CMD 0x01
+#define ECHO_IOCTL_WAKEUP_CMD 0x02
+#define ECHO_IOCTL_BATCH_CMD 0x03
+#define ECHO_IOCTL_TRANSFORM_CMD 0x04
+#define ECHO_IOCTL_EVENTFD_CMD 0x05
+
+// Layout of the memory that can be mapped from the device: a control page
+// (at offset 0) holding the ring's counters, immediately followed by the
+// ring's data (at offset ECHO_MMAP_CTRL_LEN, 'capacity' bytes long).
+//
+// 'head' and 'tail' are free-running byte counters: the data held spans
+// [tail, head), indexes into the data being obtained by masking with
+// (capacity - 1). Producers write data, then advance 'head'; consumers read
+// data, then advance 'tail' (both with release semantics); since the 
+// driver's own consumers (read) claim data by advancing 'tail' with a 
+// compare-and-swap, consumers sharing the ring with them must do the same. The 
+// ECHO_IOCTL_WAKEUP command wakes up processes that are blocked in 
+// read/write/poll after the counters were updated through the mapping.
+// The counters are 64-bit whatever the word size, so that 32-bit processes
+// see the same layout as the 64-bit kernel (their atomic operations on them
+// must be 64-bit as well).
+#define ECHO_MMAP_CTRL_LEN 4096
+
+struct echo_ring_ctrl {
+    __u64 head;
+    __u64 tail;
+    __u64 capacity;
+};
+
+
+// Batched commands: ECHO_IOCTL_BATCH takes a struct echo_batch pointing to
+// an array of 'count' operations, which are executed in order under a single
+// hold of the producers' lock (readers are only held off from the parts of
+// the content a reverse or transform is not done with yet). Writes copy 'len'
+// bytes from 'buf' into the ring (or as much as fits) and reads copy at most
+// 'len' bytes from the ring into 'buf' (without blocking in either case). On
+// return, 'result' holds the number of bytes transferred (0 for 
+// clear/reverse) or a negative errno, and 'completed' the number of 
+// operations that succeeded: execution stops at the first failing operation.
+// For transforms, 'buf' points to a struct echo_transform (see below), which
+// is updated on return.
+#define ECHO_BATCH_OP_WRITE   0x00
+#define ECHO_BATCH_OP_READ    0x01
+#define ECHO_BATCH_OP_CLEAR   0x02
+#define ECHO_BATCH_OP_REVERSE 0x03
+#define ECHO_BATCH_OP_TRANSFORM 0x04
+
+#define ECHO_BATCH_MAX_OPS 256
+
+struct echo_batch_op {
+    __u32 op;
+    __u32 reserved;
+    __s64 result;
+    __u64 buf;
+    __u64 len;
+};
+
+struct echo_batch {
+    __u64 ops;
+    __u32 count;
+    __u32 completed;
+};
+
+// Transforms: ECHO_IOCTL_TRANSFORM applies one of the following, in place, to
+// the content of the ring:
+// - reverse: reverses the content (same as ECHO_IOCTL_REVERSE).
+// - bswap: reverses the byte order of each 'width'-byte unit (2, 4 or 8),
+//   a trailing partial unit being left untouched.
+// - casefold: converts ASCII upper case letters to lower case.
+// - xor: XORs the content with the first 'width' bytes of 'key', repeated
+//   ('width' being 1, 2, 4 or 8).
+// - crc32c: computes the CRC32C of the content, using 'crc' as the seed and
+//   returning the checksum in it; the content is left unchanged.
+#define ECHO_TRANSFORM_REVERSE  0x00
+#define ECHO_TRANSFORM_BSWAP    0x01
+#define ECHO_TRANSFORM_CASEFOLD 0x02
+#define ECHO_TRANSFORM_XOR      0x03
+#define ECHO_TRANSFORM_CRC32C   0x04
+
+struct echo_transform {
+    __u32 type;
+    __u32 width;
+    __u8 key[8];
+    __u32 crc;
+    __u32 reserved;
+};
+
+// io_uring passthrough: commands can also be submitted as IORING_OP_URING_CMD
+// SQEs, 'cmd_op' holding the ioctl command (ECHO_IOCTL_CLEAR, 
+// ECHO_IOCTL_REVERSE, ECHO_IOCTL_TRANSFORM...) and the SQE's command area
+// the following struct, 'arg' being what would be passed to ioctl (e.g. a 
+// pointer to a struct echo_transform). The command's result is posted in 
+// the CQE.
+struct echo_uring_cmd {
+    __u64 arg;
+};
+
+// Notifications: ECHO_IOCTL_EVENTFD takes a pointer to an eventfd file 
+// descriptor (a __s32), which the driver signals whenever the ring's content
+// changes: on write, clear, reverse and transforms other than crc32c, which
+// leaves it unchanged (including within batches), and on ECHO_IOCTL_WAKEUP. A ring has at most one eventfd: 
+// registering another replaces it, and passing -1 unregisters it (as does
+// closing the file it was registered through). The same events also raise
+// SIGIO for files that enabled asynchronous notification (O_ASYNC / 
+// F_SETOWN).
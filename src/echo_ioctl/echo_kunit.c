@@ -0,0 +1,393 @@
+#include <kunit/test.h>         // Needed for the KUnit API
+#include <linux/module.h>       // Needed by all modules
+#include <linux/random.h>       // Needed for get_random_bytes
+
+#include "echo_transform.h"
+#include "../common/drv_bench.h"
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("yduchesne");
+MODULE_DESCRIPTION("Tests and benchmarks of the echo transforms");
+
+// ----------------------------------------------------------------------------
+// Parameters
+
+static bool bench;
+module_param(bench, bool, 0444);
+MODULE_PARM_DESC(bench, "Run the timed benchmarks (echo_transform_bench suite)");
+
+// ----------------------------------------------------------------------------
+// Tests
+//
+// Each transform is applied to a ring whose content starts at every offset
+// of the buffer, and spans every length, so that the content wraps around
+// the buffer's end at every position (including in the middle of a word, or
+// of a bswap unit); the result is compared with that of a byte-at-a-time 
+// reference. Transforms are applied both at once, and a chunk at a time, as
+// the driver does (see echo_ring_transform).
+
+#define ECHO_KUNIT_CAPACITY 64
+
+static const u8 echo_kunit_key[8] = { 0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef };
+
+// Copies 'src' into the content (in logical order), and back.
+static void echo_kunit_put(const struct echo_content *content, const u8 *src)
+{
+    for (size_t k = 0; k < content->used; k++)
+    {
+        content->buffer[(content->tail + k) & (content->capacity - 1)] = src[k];
+    }
+}
+
+static void echo_kunit_get(const struct echo_content *content, u8 *dst)
+{
+    for (size_t k = 0; k < content->used; k++)
+    {
+        dst[k] = content->buffer[(content->tail + k) & (content->capacity - 1)];
+    }
+}
+
+enum echo_kunit_op { ECHO_KUNIT_REVERSE, ECHO_KUNIT_BSWAP, ECHO_KUNIT_CASEFOLD, ECHO_KUNIT_XOR, ECHO_KUNIT_CRC32C };
+
+// 'width' is the unit's width for bswap, and the key's length for xor.
+static void echo_kunit_reference(enum echo_kunit_op op, u8 *data, size_t len, const u8 *key, unsigned int width)
+{
+    for (size_t k = 0; k < len; k++)
+    {
+        switch (op)
+        {
+            case ECHO_KUNIT_REVERSE:
+                if (k < len / 2)
+                {
+                    swap(data[k], data[len - 1 - k]);
+                }
+                break;
+            case ECHO_KUNIT_BSWAP:
+            {
+                // Swapping each byte of the first half of a whole unit with
+                // its mirror in the unit.
+                size_t unit = k - k % width;
+                size_t mirror = unit + width - 1 - k % width;
+                if (unit + width <= len && k < mirror)
+                {
+                    swap(data[k], data[mirror]);
+                }
+                break;
+            }
+            case ECHO_KUNIT_CASEFOLD:
+                if (data[k] >= 'A' && data[k] <= 'Z')
+                {
+                    data[k] += 'a' - 'A';
+                }
+                break;
+            case ECHO_KUNIT_XOR:
+                data[k] ^= key[k % width];
+                break;
+            case ECHO_KUNIT_CRC32C:
+                break;
+        }
+    }
+}
+
+// Applies a transform to the content, a 'chunk' bytes at a time (all at 
+// once if 0). Returns the checksum for crc32c.
+static u32 echo_kunit_apply(enum echo_kunit_op op, const struct echo_content *content, const u8 *key, unsigned int width, size_t chunk)
+{
+    size_t end = op == ECHO_KUNIT_REVERSE ? content->used / 2 : content->used;
+
+    if (op == ECHO_KUNIT_CRC32C)
+    {
+        return echo_transform_crc32c(content, ~0u);
+    }
+    if (chunk == 0)
+    {
+        chunk = max_t(size_t, end, 1);
+    }
+    for (size_t off = 0; off < end; off += chunk)
+    {
+        size_t len = min(end - off, chunk);
+        struct echo_content part = echo_content_part(content, off, len);
+        switch (op)
+        {
+            case ECHO_KUNIT_REVERSE:
+                echo_transform_reverse_range(content, off, off + len);
+                break;
+            case ECHO_KUNIT_BSWAP:
+                echo_transform_bswap(&part, width);
+                break;
+            case ECHO_KUNIT_CASEFOLD:
+                echo_transform_casefold(&part);
+                break;
+            case ECHO_KUNIT_XOR:
+                echo_transform_xor(&part, key, width);
+                break;
+            case ECHO_KUNIT_CRC32C:
+                break;
+        }
+    }
+    return 0;
+}
+
+static void echo_kunit_check(struct kunit *test, enum echo_kunit_op op, const u8 *key, unsigned int width, size_t chunk)
+{
+    char *buffer = kunit_kmalloc(test, ECHO_KUNIT_CAPACITY, GFP_KERNEL);
+    u8 *input = kunit_kmalloc(test, ECHO_KUNIT_CAPACITY, GFP_KERNEL);
+    u8 *expected = kunit_kmalloc(test, ECHO_KUNIT_CAPACITY, GFP_KERNEL);
+    u8 *actual = kunit_kmalloc(test, ECHO_KUNIT_CAPACITY, GFP_KERNEL);
+
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, buffer);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, input);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, expected);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, actual);
+
+    for (unsigned long tail = 0; tail < ECHO_KUNIT_CAPACITY; tail++)
+    {
+        for (size_t used = 0; used <= ECHO_KUNIT_CAPACITY; used++)
+        {
+            // Counters are free-running: the tail is usually past the
+            // capacity.
+            struct echo_content content = {
+                .buffer = buffer,
+                .capacity = ECHO_KUNIT_CAPACITY,
+                .tail = tail + 3 * ECHO_KUNIT_CAPACITY,
+                .used = used
+            };
+            get_random_bytes(input, used);
+            // Making sure that every case transition is exercised.
+            for (size_t k = 0; k < used; k += 7)
+            {
+                input[k] = "@AZ[`az{"[k % 8];
+            }
+            memcpy(expected, input, used);
+            echo_kunit_reference(op, expected, used, key, width);
+
+            echo_kunit_put(&content, input);
+            u32 crc = echo_kunit_apply(op, &content, key, width, chunk);
+            echo_kunit_get(&content, actual);
+            KUNIT_ASSERT_EQ_MSG(test, memcmp(actual, expected, used), 0, "tail: %lu, used: %zu, chunk: %zu", tail, used, chunk);
+            if (op == ECHO_KUNIT_CRC32C)
+            {
+                KUNIT_ASSERT_EQ_MSG(test, crc, crc32c(~0u, input, used), "tail: %lu, used: %zu", tail, used);
+            }
+        }
+    }
+}
+
+// Chunk sizes are multiples of 8, as in the driver (ECHO_MODIFY_CHUNK).
+static const size_t echo_kunit_chunks[] = { 0, 8, 16, 24 };
+
+static void echo_kunit_check_chunks(struct kunit *test, enum echo_kunit_op op, const u8 *key, unsigned int width)
+{
+    for (unsigned int c = 0; c < ARRAY_SIZE(echo_kunit_chunks); c++)
+    {
+        echo_kunit_check(test, op, key, width, echo_kunit_chunks[c]);
+    }
+}
+
+static void echo_kunit_reverse(struct kunit *test)
+{
+    echo_kunit_check_chunks(test, ECHO_KUNIT_REVERSE, NULL, 0);
+}
+
+// Reversing a chunk at a time, the first bytes of the content are final as
+// soon as their chunk is done: the driver lets readers consume them.
+static void echo_kunit_reverse_prefix(struct kunit *test)
+{
+    char buffer[ECHO_KUNIT_CAPACITY];
+    u8 expected[ECHO_KUNIT_CAPACITY];
+    u8 actual[ECHO_KUNIT_CAPACITY];
+    struct echo_content content = {
+        .buffer = buffer,
+        .capacity = ECHO_KUNIT_CAPACITY,
+        .tail = ECHO_KUNIT_CAPACITY - 5,
+        .used = ECHO_KUNIT_CAPACITY - 1
+    };
+
+    get_random_bytes(expected, content.used);
+    echo_kunit_put(&content, expected);
+    echo_kunit_reference(ECHO_KUNIT_REVERSE, expected, content.used, NULL, 0);
+    for (size_t off = 0; off < content.used / 2; off += 8)
+    {
+        size_t to = min(off + 8, content.used / 2);
+        echo_transform_reverse_range(&content, off, to);
+        echo_kunit_get(&content, actual);
+        KUNIT_ASSERT_EQ_MSG(test, memcmp(actual, expected, to), 0, "done: %zu", to);
+    }
+    KUNIT_EXPECT_EQ(test, memcmp(actual, expected, content.used), 0);
+}
+
+static void echo_kunit_bswap(struct kunit *test)
+{
+    for (unsigned int width = 2; width <= sizeof(u64); width *= 2)
+    {
+        echo_kunit_check_chunks(test, ECHO_KUNIT_BSWAP, NULL, width);
+    }
+}
+
+// A unit straddling the end of the buffer is swapped as a whole, and a 
+// trailing partial unit is left untouched.
+static void echo_kunit_bswap_straddling(struct kunit *test)
+{
+    char buffer[16];
+    static const u8 input[11] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+    static const u8 swapped[11] = { 7, 6, 5, 4, 3, 2, 1, 0, 8, 9, 10 };
+    u8 actual[11];
+    // Bytes 0-4 at the end of the buffer, then 5-10 at its start.
+    struct echo_content content = { .buffer = buffer, .capacity = sizeof(buffer), .tail = 11, .used = sizeof(input) };
+
+    echo_kunit_put(&content, input);
+    echo_transform_bswap(&content, 8);
+    echo_kunit_get(&content, actual);
+    KUNIT_EXPECT_EQ(test, memcmp(actual, swapped, sizeof(swapped)), 0);
+    KUNIT_EXPECT_EQ(test, (u8)buffer[11], 7);
+    KUNIT_EXPECT_EQ(test, (u8)buffer[2], 0);
+}
+
+static void echo_kunit_casefold(struct kunit *test)
+{
+    echo_kunit_check_chunks(test, ECHO_KUNIT_CASEFOLD, NULL, 0);
+}
+
+static void echo_kunit_casefold_all_bytes(struct kunit *test)
+{
+    char buffer[256];
+    struct echo_content content = { .buffer = buffer, .capacity = sizeof(buffer), .tail = 0, .used = sizeof(buffer) };
+
+    for (unsigned int b = 0; b < 256; b++)
+    {
+        buffer[b] = b;
+    }
+    echo_transform_casefold(&content);
+    for (unsigned int b = 0; b < 256; b++)
+    {
+        u8 expected = b >= 'A' && b <= 'Z' ? b + ('a' - 'A') : b;
+        KUNIT_EXPECT_EQ_MSG(test, (u8)buffer[b], expected, "byte: 0x%02x", b);
+    }
+}
+
+static void echo_kunit_xor(struct kunit *test)
+{
+    // Key lengths are divisors of 8 (see echo_transform_check).
+    for (unsigned int key_len = 1; key_len <= sizeof(echo_kunit_key); key_len *= 2)
+    {
+        echo_kunit_check_chunks(test, ECHO_KUNIT_XOR, echo_kunit_key, key_len);
+    }
+}
+
+// The checksum of wrapped content is that of its bytes in logical order;
+// the content is left unchanged.
+static void echo_kunit_crc32c(struct kunit *test)
+{
+    echo_kunit_check(test, ECHO_KUNIT_CRC32C, NULL, 0, 0);
+}
+
+// The standard check value of CRC32C, with the content wrapping around.
+static void echo_kunit_crc32c_check_value(struct kunit *test)
+{
+    char buffer[16];
+    struct echo_content content = { .buffer = buffer, .capacity = sizeof(buffer), .tail = 12, .used = 9 };
+
+    echo_kunit_put(&content, (const u8 *)"123456789");
+    KUNIT_EXPECT_EQ(test, ~echo_transform_crc32c(&content, ~0u), 0xe3069283u);
+}
+
+static struct kunit_case echo_kunit_cases[] = {
+    KUNIT_CASE(echo_kunit_reverse),
+    KUNIT_CASE(echo_kunit_reverse_prefix),
+    KUNIT_CASE(echo_kunit_bswap),
+    KUNIT_CASE(echo_kunit_bswap_straddling),
+    KUNIT_CASE(echo_kunit_casefold),
+    KUNIT_CASE(echo_kunit_casefold_all_bytes),
+    KUNIT_CASE(echo_kunit_xor),
+    KUNIT_CASE(echo_kunit_crc32c),
+    KUNIT_CASE(echo_kunit_crc32c_check_value),
+    {}
+};
+
+static struct kunit_suite echo_kunit_suite = {
+    .name = "echo_transform",
+    .test_cases = echo_kunit_cases,
+};
+
+// ----------------------------------------------------------------------------
+// Benchmarks
+//
+// Each transform is applied repeatedly to a full ring, whose content wraps
+// around at an odd offset (the worst case: unaligned words, and a word
+// straddling the end of the buffer); the cost per byte is reported (see 
+// drv_bench.h). They only run when the module is loaded with bench=1.
+
+#define ECHO_BENCH_CAPACITY (1024 * 1024)
+#define ECHO_BENCH_ROUNDS 64
+
+static u32 echo_bench_sink;
+
+static void echo_bench_run(struct kunit *test, const char *name, enum echo_kunit_op op, unsigned int width)
+{
+    if (!bench)
+    {
+        kunit_skip(test, "not loaded with bench=1");
+    }
+    char *buffer = kunit_kmalloc(test, ECHO_BENCH_CAPACITY, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, buffer);
+    get_random_bytes(buffer, ECHO_BENCH_CAPACITY);
+    struct echo_content content = {
+        .buffer = buffer,
+        .capacity = ECHO_BENCH_CAPACITY,
+        .tail = ECHO_BENCH_CAPACITY / 2 + 3,
+        .used = ECHO_BENCH_CAPACITY
+    };
+    struct drv_bench timing;
+    u32 crc = 0;
+
+    drv_bench_start(&timing);
+    for (unsigned int round = 0; round < ECHO_BENCH_ROUNDS; round++)
+    {
+        crc ^= echo_kunit_apply(op, &content, echo_kunit_key, width, 0);
+        cond_resched();
+    }
+    drv_bench_report(test, &timing, name, "byte", (u64)ECHO_BENCH_CAPACITY * ECHO_BENCH_ROUNDS);
+    // Only prevents the checksums from being optimized away.
+    WRITE_ONCE(echo_bench_sink, crc);
+}
+
+static void echo_bench_reverse(struct kunit *test)
+{
+    echo_bench_run(test, "reverse", ECHO_KUNIT_REVERSE, 0);
+}
+
+static void echo_bench_bswap(struct kunit *test)
+{
+    echo_bench_run(test, "bswap64", ECHO_KUNIT_BSWAP, sizeof(u64));
+}
+
+static void echo_bench_casefold(struct kunit *test)
+{
+    echo_bench_run(test, "casefold", ECHO_KUNIT_CASEFOLD, 0);
+}
+
+static void echo_bench_xor(struct kunit *test)
+{
+    echo_bench_run(test, "xor", ECHO_KUNIT_XOR, sizeof(echo_kunit_key));
+}
+
+static void echo_bench_crc32c(struct kunit *test)
+{
+    echo_bench_run(test, "crc32c", ECHO_KUNIT_CRC32C, 0);
+}
+
+static struct kunit_case echo_bench_cases[] = {
+    KUNIT_CASE(echo_bench_reverse),
+    KUNIT_CASE(echo_bench_bswap),
+    KUNIT_CASE(echo_bench_casefold),
+    KUNIT_CASE(echo_bench_xor),
+    KUNIT_CASE(echo_bench_crc32c),
+    {}
+};
+
+static struct kunit_suite echo_bench_suite = {
+    .name = "echo_transform_bench",
+    .test_cases = echo_bench_cases,
+};
+
+kunit_test_suites(&echo_kunit_suite, &echo_bench_suite);
@@ -0,0 +1,232 @@
+#ifndef ECHO_TRANSFORM_H
+#define ECHO_TRANSFORM_H
+
+#include <linux/types.h>
+#include <linux/minmax.h>       // Needed for min
+#include <linux/string.h>       // Needed for memcpy
+#include <linux/swab.h>         // Needed for swab16/32/64
+#include <linux/crc32c.h>       // Needed for crc32c
+#include <linux/version.h>      // Needed for LINUX_VERSION_CODE and KERNEL_VERSION macros
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,12,0)
+#include <linux/unaligned.h>    // Needed for get_unaligned/put_unaligned
+#else
+#include <asm/unaligned.h>      // Needed for get_unaligned/put_unaligned
+#endif
+
+// ----------------------------------------------------------------------------
+// Transforms
+//
+// The following functions are applied in place, on the bytes held by a ring
+// (in logical, tail to head, order), described by a struct echo_content: the
+// driver takes it from its ring, with producers excluded, and the tests 
+// (echo_kunit.c) from plain buffers. They process the content a (64-bit) 
+// word at a time wherever possible, falling back to single bytes only where
+// a word would straddle the end of the buffer or the end of the content.
+
+// 'used' bytes starting at index 'tail & (capacity - 1)' of 'buffer', and
+// wrapping around its end (capacity being a power of two).
+struct echo_content {
+    char *buffer;
+    size_t capacity;
+    unsigned long tail;
+    size_t used;
+};
+
+// Returns the (at most two) contiguous segments making up the content: from
+// the tail up to the end of the buffer, then from the start of the buffer up
+// to the head.
+static inline unsigned int echo_content_segments(const struct echo_content *content, char *seg[2], size_t seg_len[2])
+{
+    size_t used = content->used;
+    size_t pos = content->tail & (content->capacity - 1);
+
+    seg[0] = content->buffer + pos;
+    seg_len[0] = min(used, content->capacity - pos);
+    seg[1] = content->buffer;
+    seg_len[1] = used - seg_len[0];
+    return seg_len[1] ? 2 : 1;
+}
+
+// Returns the part of the content made of 'len' bytes from offset 'off'
+// (which the driver uses to transform large contents a chunk at a time).
+static inline struct echo_content echo_content_part(const struct echo_content *content, size_t off, size_t len)
+{
+    struct echo_content part = {
+        .buffer = content->buffer,
+        .capacity = content->capacity,
+        .tail = content->tail + off,
+        .used = len
+    };
+    return part;
+}
+
+// Swaps the bytes at offsets [from, to) of the first half of the content 
+// with their mirrors in the second half: whole words from both ends (each 
+// word being byte-swapped), then single bytes when close to the middle, to
+// 'to' or to the end of the buffer. Once the range [0, to) has been swapped,
+// the first 'to' bytes of the content are final.
+static inline void echo_transform_reverse_range(const struct echo_content *content, size_t from, size_t to)
+{
+    char *buffer = content->buffer;
+    size_t mask = content->capacity - 1;
+    unsigned long tail = content->tail;
+    size_t front = from;
+    size_t back = content->used - from;
+
+    while (back - front >= 2 && front < to)
+    {
+        size_t i = (tail + front) & mask;
+        size_t j = (tail + back - sizeof(u64)) & mask;
+        if (back - front >= 2 * sizeof(u64) && to - front >= sizeof(u64) &&
+            i + sizeof(u64) <= content->capacity && j + sizeof(u64) <= content->capacity)
+        {
+            u64 a = get_unaligned((u64 *)(buffer + i));
+            u64 b = get_unaligned((u64 *)(buffer + j));
+            put_unaligned(swab64(b), (u64 *)(buffer + i));
+            put_unaligned(swab64(a), (u64 *)(buffer + j));
+            front += sizeof(u64);
+            back -= sizeof(u64);
+        }
+        else
+        {
+            j = (tail + back - 1) & mask;
+            char tmp = buffer[i];
+            buffer[i] = buffer[j];
+            buffer[j] = tmp;
+            front++;
+            back--;
+        }
+    }
+}
+
+static inline void echo_transform_reverse(const struct echo_content *content)
+{
+    echo_transform_reverse_range(content, 0, content->used / 2);
+}
+
+// Reverses the byte order of each 'width'-byte unit; a trailing partial unit
+// is left untouched.
+static inline void echo_transform_bswap(const struct echo_content *content, unsigned int width)
+{
+    char *buffer = content->buffer;
+    size_t mask = content->capacity - 1;
+    unsigned long tail = content->tail;
+    size_t used = content->used;
+
+    for (size_t off = 0; off + width <= used; off += width)
+    {
+        size_t pos = (tail + off) & mask;
+        char *p = buffer + pos;
+        if (pos + width > content->capacity)
+        {
+            // The unit straddles the end of the buffer.
+            for (unsigned int k = 0; k < width / 2; k++)
+            {
+                size_t i = (pos + k) & mask;
+                size_t j = (pos + width - 1 - k) & mask;
+                char tmp = buffer[i];
+                buffer[i] = buffer[j];
+                buffer[j] = tmp;
+            }
+            continue;
+        }
+        switch (width)
+        {
+            case 2:
+                put_unaligned(swab16(get_unaligned((u16 *)p)), (u16 *)p);
+                break;
+            case 4:
+                put_unaligned(swab32(get_unaligned((u32 *)p)), (u32 *)p);
+                break;
+            case 8:
+                put_unaligned(swab64(get_unaligned((u64 *)p)), (u64 *)p);
+                break;
+        }
+    }
+}
+
+// Converts ASCII upper case letters to lower case, leaving other bytes 
+// untouched. Words are processed with the usual SWAR technique: for each
+// byte, the high bit of 'ge_a' (resp. 'gt_z') is set when its low 7 bits are
+// >= 'A' (resp. > 'Z'); upper case letters are the ASCII bytes for which 
+// exactly one of them is set, and get their 0x20 bit flipped.
+static inline void echo_transform_casefold(const struct echo_content *content)
+{
+    char *seg[2];
+    size_t seg_len[2];
+    unsigned int count = echo_content_segments(content, seg, seg_len);
+
+    for (unsigned int s = 0; s < count; s++)
+    {
+        char *p = seg[s];
+        size_t len = seg_len[s];
+        for (; len >= sizeof(u64); p += sizeof(u64), len -= sizeof(u64))
+        {
+            u64 w = get_unaligned((u64 *)p);
+            u64 low7 = w & 0x7f7f7f7f7f7f7f7fULL;
+            u64 ge_a = low7 + 0x3f3f3f3f3f3f3f3fULL;    // 0x80 - 'A'
+            u64 gt_z = low7 + 0x2525252525252525ULL;    // 0x7f - 'Z'
+            u64 upper = (ge_a ^ gt_z) & ~w & 0x8080808080808080ULL;
+            put_unaligned(w ^ (upper >> 2), (u64 *)p);
+        }
+        for (; len > 0; p++, len--)
+        {
+            if (*p >= 'A' && *p <= 'Z')
+            {
+                *p += 'a' - 'A';
+            }
+        }
+    }
+}
+
+// XORs the content with a repeating key of 'key_len' bytes (a divisor of 8,
+// so that the key pattern repeats identically in every word); the key is 
+// aligned on the content's first byte.
+static inline void echo_transform_xor(const struct echo_content *content, const u8 *key, unsigned int key_len)
+{
+    char *seg[2];
+    size_t seg_len[2];
+    unsigned int count = echo_content_segments(content, seg, seg_len);
+    size_t off = 0;
+
+    for (unsigned int s = 0; s < count; s++)
+    {
+        u8 pattern_bytes[sizeof(u64)];
+        u64 pattern;
+        char *p = seg[s];
+        size_t len = seg_len[s];
+
+        // Rotating the key so that it lines up with the segment's start.
+        for (unsigned int k = 0; k < sizeof(u64); k++)
+        {
+            pattern_bytes[k] = key[(off + k) % key_len];
+        }
+        memcpy(&pattern, pattern_bytes, sizeof(pattern));
+        off += len;
+
+        for (; len >= sizeof(u64); p += sizeof(u64), len -= sizeof(u64))
+        {
+            put_unaligned(get_unaligned((u64 *)p) ^ pattern, (u64 *)p);
+        }
+        for (unsigned int k = 0; k < len; k++)
+        {
+            p[k] ^= pattern_bytes[k];
+        }
+    }
+}
+
+static inline u32 echo_transform_crc32c(const struct echo_content *content, u32 seed)
+{
+    char *seg[2];
+    size_t seg_len[2];
+    unsigned int count = echo_content_segments(content, seg, seg_len);
+    u32 crc = seed;
+
+    for (unsigned int s = 0; s < count; s++)
+    {
+        crc = crc32c(crc, seg[s], seg_len[s]);
+    }
+    return crc;
+}
+
+#endif
\ No newline at end of file
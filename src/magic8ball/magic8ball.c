@@ -1,13 +1,22 @@
 #include <linux/kernel.h>       // Needed for kstrtoint
 #include <linux/version.h>      // Needed for LINUX_VERSION_CODE and KERNEL_VERSION macros
-#if LINUX_VERSION_CODE > KERNEL_VERSION(4,0,1)
-#include <linux/vmalloc.h>
-#endif
 #include <linux/init.h>         // Needed for the lifecycle macros
 #include <linux/module.h>       // Needed by all modules
 #include <linux/sched.h>        // Needed for the 'current' macro
 #include <linux/mutex.h>        // Needed for mutex
 #include <linux/proc_fs.h>      // Needed for proc-related functions
+#include <linux/slab.h>         // Needed for kzalloc/kfree
+#include <linux/random.h>       // Needed for get_random_bytes
+#include <linux/uaccess.h>      // Needed for copy_to_user/put_user
+#include <linux/rcupdate.h>     // Needed for RCU
+#include <linux/kref.h>         // Needed for kref
+#include <linux/vmalloc.h>      // Needed for vmalloc/vfree
+#include <linux/seq_file.h>     // Needed for seq_printf and single_open
+#include <linux/string.h>       // Needed for strsep/strim
+
+#include "magic8ball_alias.h"
+#include "magic8ball_answer.h"
+#include "../common/drv_stats.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("yduchesne");
@@ -20,347 +29,631 @@ MODULE_DESCRIPTION("Takes magic8ball count has input; returns magic8ball roll re
 #define MAGIG8BALL_BUF_LEN 256
 #define MAGIG8BALL_INPUT_LEN 1
 #define MAGIG8BALL_DEFAULT_MAGIG8BALL_COUNT 2
+#define MAGIC8BALL_RANDOM_BATCH 64
+#define MAGIC8BALL_CORPUS_PROC_NAME "magic8ball_corpus"
+#define MAGIC8BALL_CORPUS_MAX_LEN (1024 * 1024)
 
 // Messages
+//
+// The table is built at compile time, and lives in read-only data: each 
+// message is stored with the space separating it from the next one, its
+// length (precomputed, without the terminating null character), and its 
+// weight (messages are picked with probability proportional to it; see 
+// magic8ball_alias.h).
+
+#define MAGIC8BALL_MSG(msg) { msg " ", sizeof(msg " ") - 1, 1 }
+
+static const struct magic8ball_msg magic8ball_msgs[] = {
+    MAGIC8BALL_MSG("It is certain."),
+    MAGIC8BALL_MSG("It is decidedly so."),
+    MAGIC8BALL_MSG("Without a doubt."),
+    MAGIC8BALL_MSG("Yes. definitely."),
+    MAGIC8BALL_MSG("You may rely on it."),
+    MAGIC8BALL_MSG("As I see it, yes."),
+    MAGIC8BALL_MSG("Most likely."),
+    MAGIC8BALL_MSG("Outlook good."),
+    MAGIC8BALL_MSG("Yes."),
+    MAGIC8BALL_MSG("Signs point to yes."),
+    MAGIC8BALL_MSG("Reply hazy, try again."),
+    MAGIC8BALL_MSG("Ask again later."),
+    MAGIC8BALL_MSG("Better not tell you now."),
+    MAGIC8BALL_MSG("Cannot predict now."),
+    MAGIC8BALL_MSG("Concentrate and ask again."),
+    MAGIC8BALL_MSG("Don't count on it."),
+    MAGIC8BALL_MSG("My reply is no."),
+    MAGIC8BALL_MSG("My sources say no."),
+    MAGIC8BALL_MSG("Outlook not so good."),
+    MAGIC8BALL_MSG("Very doubtful.")
+};
 
-#define MAGIG8BALL_MSG0 "It is certain."
-#define MAGIG8BALL_MSG1 "It is decidedly so."
-#define MAGIG8BALL_MSG2 "Without a doubt."
-#define MAGIG8BALL_MSG3 "Yes. definitely."
-#define MAGIC8BALL_MSG4 "You may rely on it."
-#define MAGIC8BALL_MSG5 "As I see it, yes."
-#define MAGIC8BALL_MSG6 "Most likely."
-#define MAGIC8BALL_MSG7 "Outlook good."
-#define MAGIC8BALL_MSG8 "Yes."
-#define MAGIC8BALL_MSG9 "Signs point to yes."
-#define MAGIC8BALL_MSG10 "Reply hazy, try again."
-#define MAGIC8BALL_MSG11 "Ask again later."
-#define MAGIC8BALL_MSG12 "Better not tell you now."
-#define MAGIC8BALL_MSG13 "Cannot predict now."
-#define MAGIC8BALL_MSG14 "Concentrate and ask again."
-#define MAGIC8BALL_MSG15 "Don't count on it."
-#define MAGIC8BALL_MSG16 "My reply is no."
-#define MAGIC8BALL_MSG17 "My sources say no."
-#define MAGIC8BALL_MSG18 "Outlook not so good."
-#define MAGIC8BALL_MSG19 "Very doubtful."
-
-#define MAGIC8BALL_NUM_MSG 20
+#define MAGIC8BALL_NUM_MSG ARRAY_SIZE(magic8ball_msgs)
 
 // ----------------------------------------------------------------------------
 // Module state
 
 static struct proc_dir_entry *proc_magic8ball;
+static struct proc_dir_entry *proc_magic8ball_corpus;
 
 
+// 'magic8ball_count' is the count with which files are opened (protected by
+// 'crit_sec_mutex'): each open file then has its own (see
+// magic8ball_session).
 typedef struct _proc_data 
 {
-    char* buffer;
-    char** messages;
     int magic8ball_count;
-    size_t size;
     struct mutex crit_sec_mutex;
 
 } proc_data;
 
 
 proc_data data;
+static struct drv_stats magic8ball_stats;
+
+static inline void magic8ball_lock(enum drv_stats_op op)
+{
+    u64 start = drv_stats_clock();
+    mutex_lock(&data.crit_sec_mutex);
+    drv_stats_lock_time(&magic8ball_stats, op, start);
+}
 
 // ----------------------------------------------------------------------------
-// IO operations
+// Corpus
+//
+// The messages answers are made of. The built-in corpus is the static 
+// table above; a new one may be loaded at runtime, by writing messages (one
+// per line) to /proc/magic8ball_corpus. It is built off to the side when 
+// the file is closed, then published with RCU: readers never block, nor 
+// take the mutex (which only serializes publications).
+//
+// Messages may be weighted: a line of the form '<weight><TAB><message>'
+// gives the message that weight (a line without a tab has weight 1, and
+// messages of weight 0 are left out). Unless all weights are equal, an 
+// alias table is built with the corpus (see magic8ball_alias_build), so 
+// that picking a message takes constant time, whatever the corpus' size.
+//
+// A session holds a reference on the corpus it draws an answer from, 
+// acquired when the answer starts (an answer thus never mixes corpora). 
+// Replaced corpora are freed once the last answer using them is done, 
+// after a grace period (a reader may still be acquiring a reference).
+
+struct magic8ball_corpus {
+    struct kref ref;
+    struct rcu_head rcu;
+    size_t num_msgs;
+    const struct magic8ball_msg *msgs;
+    // NULL when picking is uniform.
+    const struct magic8ball_alias *alias;
+};
+
+static struct magic8ball_corpus magic8ball_builtin_corpus = {
+    .num_msgs = MAGIC8BALL_NUM_MSG,
+    .msgs = magic8ball_msgs
+};
+
+static struct magic8ball_corpus __rcu *magic8ball_corpus = &magic8ball_builtin_corpus;
 
-static int safe_copy(const char* src, int len, char* dst, int dstIndex, int maxLen)
+static void magic8ball_corpus_free(struct kref *ref)
 {
-    int count = 0;
-    for (int srcIndex = 0; srcIndex < len; srcIndex++, count++)
+    struct magic8ball_corpus *corpus = container_of(ref, struct magic8ball_corpus, ref);
+    if (corpus != &magic8ball_builtin_corpus)
+    {
+        kvfree_rcu(corpus, rcu);
+    }
+}
+
+static struct magic8ball_corpus *magic8ball_corpus_get(void)
+{
+    struct magic8ball_corpus *corpus;
+
+    rcu_read_lock();
+    // The corpus may be replaced (and its last reference dropped) between
+    // the two: the new one is then obtained.
+    do
+    {
+        corpus = rcu_dereference(magic8ball_corpus);
+    } 
+    while (!kref_get_unless_zero(&corpus->ref));
+    rcu_read_unlock();
+    return corpus;
+}
+
+static void magic8ball_corpus_put(struct magic8ball_corpus *corpus)
+{
+    if (corpus)
+    {
+        kref_put(&corpus->ref, magic8ball_corpus_free);
+    }
+}
+
+// Builds a corpus from the given text (null-terminated, modified), in a 
+// single allocation: the corpus, its table, its alias table, then the 
+// messages (each with its separating space, as in the built-in table).
+// Empty lines are skipped.
+static struct magic8ball_corpus *magic8ball_corpus_build(char *text, size_t len)
+{
+    size_t max_msgs = 1;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (text[i] == '\n')
+        {
+            max_msgs++;
+        }
+    }
+
+    // Each message takes at most its line, plus a space.
+    size_t table_len = sizeof(struct magic8ball_corpus) + max_msgs * (sizeof(struct magic8ball_msg) + sizeof(struct magic8ball_alias));
+    struct magic8ball_corpus *corpus = kvmalloc(table_len + len + max_msgs, GFP_KERNEL);
+    if (!corpus)
     {
-        // (DICE_BUF_LEN - 1) -> ensuring we have one slot left for the 
-        // string termination character at the end.
-        if (dstIndex >= maxLen)
+        return ERR_PTR(-ENOMEM);
+    }
+    struct magic8ball_msg *msgs = (struct magic8ball_msg *)(corpus + 1);
+    struct magic8ball_alias *alias = (struct magic8ball_alias *)(msgs + max_msgs);
+    char *msg_text = (char *)corpus + table_len;
+    size_t num_msgs = 0;
+    bool uniform = true;
+    int status = -EINVAL;
+
+    char *line;
+    while ((line = strsep(&text, "\n")) != NULL)
+    {
+        u32 weight = 1;
+        char *tab = strchr(line, '\t');
+        if (tab)
+        {
+            *tab = '\0';
+            if (kstrtou32(strim(line), 10, &weight))
+            {
+                goto Error;
+            }
+            line = tab + 1;
+        }
+        line = strim(line);
+        size_t line_len = strlen(line);
+        if (line_len == 0 || weight == 0)
+        {
+            continue;
+        }
+        if (line_len >= MAGIG8BALL_BUF_LEN)
         {
-            //printk(KERN_DEBUG "Cannot copy: end of destination buffer reached\n");
             goto Error;
         }
-        //printk(KERN_DEBUG "Copying character %c in source buffer at index %d to destination buffer at index %d\n", src[srcIndex], srcIndex, (dstIndex + count));
-        dst[dstIndex + count] = src[srcIndex];
+        memcpy(msg_text, line, line_len);
+        msg_text[line_len] = ' ';
+        msgs[num_msgs].text = msg_text;
+        msgs[num_msgs].len = line_len + 1;
+        msgs[num_msgs].weight = weight;
+        uniform = uniform && weight == msgs[0].weight;
+        msg_text += line_len + 1;
+        num_msgs++;
     }
-    
-    // Appending space char at end of copied string.
-    // Ensuring enough space is left.
-    if ( (dstIndex + count) == maxLen )
+    if (num_msgs == 0)
     {
-        printk(KERN_ERR "Cannot copy: end of destination buffer reached\n");
         goto Error;
     }
-    dst[dstIndex + count] = ' ';
-    count++;
+    if (!uniform)
+    {
+        status = magic8ball_alias_build(alias, msgs, num_msgs);
+        if (status)
+        {
+            goto Error;
+        }
+    }
 
-    printk(KERN_INFO "Copied %d characters to destination buffer (initial len: %d)\n", count, len);
-
-    return count;
+    kref_init(&corpus->ref);
+    corpus->num_msgs = num_msgs;
+    corpus->msgs = msgs;
+    corpus->alias = uniform ? NULL : alias;
+    return corpus;
 
     Error:
-        return -1;
+        kvfree(corpus);
+        return ERR_PTR(status);
+}
+
+static void magic8ball_corpus_publish(struct magic8ball_corpus *corpus)
+{
+    struct magic8ball_corpus *old;
+
+    magic8ball_lock(DRV_STATS_WRITE);
+    old = rcu_dereference_protected(magic8ball_corpus, lockdep_is_held(&data.crit_sec_mutex));
+    rcu_assign_pointer(magic8ball_corpus, corpus);
+    mutex_unlock(&data.crit_sec_mutex);
+    // Dropping the reference held through the pointer.
+    magic8ball_corpus_put(old);
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
+// ----------------------------------------------------------------------------
+// Sessions
+//
+// Each open file is a session, with its own count and random numbers: the
+// default count is captured when the file is opened, and writes to a file
+// opened for reading and writing only change that file's count. Writes to a
+// write-only file (e.g. 'echo 4 > /proc/magic8ball') change the default, for
+// the files opened afterwards. Sessions thus never affect each other, and
+// reads take no lock.
+//
+// An answer is generated as it is read, so that its size is bounded by the
+// count only: the session keeps track of the answer's progress (see
+// magic8ball_answer.h).
+
+struct magic8ball_session {
+    int magic8ball_count;
+    // The answer being read, and the corpus it draws from.
+    struct magic8ball_corpus *corpus;
+    struct magic8ball_answer answer;
+    // Random numbers are generated in batches (a single call to 
+    // get_random_bytes() per MAGIC8BALL_RANDOM_BATCH numbers).
+    u32 random[MAGIC8BALL_RANDOM_BATCH];
+    unsigned int next_random;
+};
+
+static u32 magic8ball_random(struct magic8ball_session *session)
+{
+    if (session->next_random == MAGIC8BALL_RANDOM_BATCH)
+    {
+        get_random_bytes(session->random, sizeof(session->random));
+        session->next_random = 0;
+    }
+    return session->random[session->next_random++];
+}
+
+// Returns a uniformly distributed value in [0, ceil), using Lemire's
+// multiply-shift reduction (as the dice module does): unlike 
+// 'x % ceil', it is not biased, and costs no division.
+static u32 magic8ball_random_below(struct magic8ball_session *session, u32 ceil)
+{
+    u64 product = (u64)magic8ball_random(session) * ceil;
+    u32 low = (u32)product;
+    if (unlikely(low < ceil))
+    {
+        u32 threshold = -ceil % ceil;
+        while (low < threshold)
+        {
+            product = (u64)magic8ball_random(session) * ceil;
+            low = (u32)product;
+        }
+    }
+    return product >> 32;
+}
+
+// Picks a message, in constant time: a uniformly chosen entry, then (if
+// the corpus is weighted) a biased coin between the entry's message and
+// its alias. Both draws come from the session's batch of random numbers.
+static const struct magic8ball_msg *magic8ball_pick(struct magic8ball_session *session, const struct magic8ball_corpus *corpus)
+{
+    u32 index = magic8ball_random_below(session, corpus->num_msgs);
+    if (corpus->alias && magic8ball_random(session) >= corpus->alias[index].prob)
+    {
+        index = corpus->alias[index].alias;
+    }
+    return &corpus->msgs[index];
+}
+
+// Picks the next message of the session's answer (see magic8ball_answer_next).
+static const struct magic8ball_msg *magic8ball_session_pick(void *arg)
+{
+    struct magic8ball_session *session = arg;
+    cond_resched();
+    return magic8ball_pick(session, session->corpus);
+}
+
+static int magic8ball_open(struct inode *inode, struct file *file)
+{
+    struct magic8ball_session *session = kzalloc(sizeof(*session), GFP_KERNEL);
+    if (!session)
+    {
+        return -ENOMEM;
+    }
+    session->next_random = MAGIC8BALL_RANDOM_BATCH;
+    magic8ball_lock(DRV_STATS_READ);
+    session->magic8ball_count = data.magic8ball_count;
+    mutex_unlock(&data.crit_sec_mutex);
+    file->private_data = session;
+    // Answers are random: they can only be read sequentially.
+    return nonseekable_open(inode, file);
+}
+
+// Starts a new answer (when reading from position 0).
+static void magic8ball_restart(struct magic8ball_session *session)
+{
+    magic8ball_corpus_put(session->corpus);
+    session->corpus = magic8ball_corpus_get();
+    magic8ball_answer_start(&session->answer, session->magic8ball_count);
+}
+
+static int magic8ball_release(struct inode *inode, struct file *file)
+{
+    struct magic8ball_session *session = file->private_data;
+    magic8ball_corpus_put(session->corpus);
+    kfree(session);
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// IO operations
+
 static ssize_t magic8ball_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
-#else
-static int magic8ball_write(struct file *file,const char * buf, unsigned long count, void *data)
-#endif
 {
-    printk(KERN_INFO "magic8ball::write");
-    mutex_lock(&data.crit_sec_mutex);
+    struct magic8ball_session *session = file->private_data;
+    char input[MAGIG8BALL_BUF_LEN];
 
     size_t len = min(MAGIG8BALL_BUF_LEN - 1, count);
-    printk(KERN_INFO "actual size: %lu, to size: %lu, from size: %lu\n", len, MAGIG8BALL_BUF_LEN, count);
-    int status = copy_from_user(data.buffer, buf, len);
-    // Insuring that buffer is a valid string
-    data.buffer[len] = '\0';
+    int status = copy_from_user(input, buf, len);
     if (status)
     {
-        printk(KERN_ERR "Error copying data from user space (status code: %d)", status);
+        status = -EFAULT;
         goto Error;
     }
-    printk(KERN_DEBUG "Got magic8ball count from user: '%s' (copied %lu chars. %lu)\n", data.buffer, len, strlen(data.buffer));
+    // Insuring that buffer is a valid string
+    input[len] = '\0';
 
     int new_magic8ball_count;
-    status = kstrtoint(data.buffer, 10, &new_magic8ball_count);
+    status = kstrtoint(input, 10, &new_magic8ball_count);
+    if (!status && new_magic8ball_count < 0)
+    {
+        status = -EINVAL;
+    }
     if (status)
     {
-        printk(KERN_ERR "Could no convert magic8ball count '%s' (status code: %d)\n", data.buffer, status);
+        pr_debug("magic8ball::write: could not convert magic8ball count '%s' (status code: %d)\n", input, status);
         goto Error;        
     }
-    printk(KERN_INFO "Parsed magic8ball count: %d\n", new_magic8ball_count);
-    data.magic8ball_count = new_magic8ball_count;
+    pr_debug("magic8ball::write: parsed magic8ball count: %d\n", new_magic8ball_count);
+    if (!(file->f_mode & FMODE_READ))
+    {
+        magic8ball_lock(DRV_STATS_WRITE);
+        data.magic8ball_count = new_magic8ball_count;
+        mutex_unlock(&data.crit_sec_mutex);
+    }
+    else
+    {
+        // The new count applies to the next answer, read from the start.
+        session->magic8ball_count = new_magic8ball_count;
+        *ppos = 0;
+    }
 
-    mutex_unlock(&data.crit_sec_mutex);
+    drv_stats_account(&magic8ball_stats, DRV_STATS_WRITE, len);
     return len;
 
     Error:
-        mutex_unlock(&data.crit_sec_mutex);
-        return -EFAULT;
+        drv_stats_account(&magic8ball_stats, DRV_STATS_WRITE, status);
+        return status;
 
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
-static int eof[1];
-static ssize_t magic8ball_read(struct file *file, char *buf, size_t len, loff_t *ppos)
-#else
-static int magic8ball_read(char *buf, char **start, off_t offset, int len, int *eof, void *unused)
-#endif
+// An answer is made of 'magic8ball_count' messages, followed by a null
+// character; reading past it returns end-of-file, until a new answer is
+// started: by reopening the file, or by writing a count to it (which
+// rewinds it). It may be read in any 
+// number of calls, of any size: messages are picked as they are needed, 
+// and copied straight from the table to the reader's buffer (no 
+// allocation), a message that does not fit being continued by the next
+// call. Memory use is thus constant, whatever the count.
+static ssize_t magic8ball_read(struct file *file, char __user *buf, size_t len, loff_t *ppos)
 {
-    printk(KERN_INFO "magic8ball::read");
-    mutex_lock(&data.crit_sec_mutex);
+    struct magic8ball_session *session = file->private_data;
+    size_t total_len = 0;
 
-    int total_len = 0;
-    int max_len = ( data.magic8ball_count * sizeof(char*) + data.magic8ball_count * MAGIG8BALL_BUF_LEN );
-    printk(KERN_INFO "tmp buffer max len: %d", max_len);
-    char* random_messages = (char*)vmalloc(max_len);
-    if (!random_messages)
+    if (*ppos == 0)
     {
-        goto Error;
+        magic8ball_restart(session);
     }
-    if (*eof) { 
-        *eof = 0; 
-    }
-    else
+    while (total_len < len)
     {
-        *eof = 1;
-
-        for (int magic8ball_num = 0; magic8ball_num < data.magic8ball_count; magic8ball_num++)
+        const char *text;
+        size_t copy_len = magic8ball_answer_next(&session->answer, len - total_len, &text, magic8ball_session_pick, session);
+        if (copy_len == 0)
         {
-            unsigned random_index;
-            unsigned num_msg = MAGIC8BALL_NUM_MSG;
-            char* random_msg;
-            
-            // () not needed with sizeof object
-            get_random_bytes(&random_index, sizeof random_index); 
-
-            // Best to use unsigned constants with unsigned objects.
-            random_index = 0u + (random_index % num_msg);
-            random_msg = data.messages[random_index];
-            int random_msg_len = strnlen(random_msg, MAGIG8BALL_BUF_LEN);
-            int actual_len = safe_copy(random_msg, random_msg_len, random_messages, total_len, max_len);
-            printk(KERN_DEBUG "Got random message: %s (index: %u, len: %d, actual_len: %d)", random_msg, random_index, random_msg_len, actual_len);
-            if (actual_len < 0)
-            {
-                printk(KERN_ERR "Error copying random message to result buffer");
-                goto Error;
-            }
-            total_len += actual_len;
+            break;
         }
-
-        // Ensuring we have enough space for adding the 
-        // string termination char and appending it to the result.
-        if (total_len == max_len)
+        if (copy_to_user(buf + total_len, text, copy_len))
         {
-            printk(KERN_ERR "Full buffer capacity reached: could not copy random messages");
-            goto Error;
-        }
-        random_messages[total_len] = '\0';
-        total_len += 1;
-
-        printk(KERN_ERR "Copying data to user space");
-        int status = copy_to_user(buf, random_messages, total_len);
-        if (status)
-        {
-            printk(KERN_ERR "Error copying data to user space (status code: %d)", status);
             goto Error;
         }
+        magic8ball_answer_advance(&session->answer, copy_len);
+        total_len += copy_len;
     }
 
-
-    mutex_unlock(&data.crit_sec_mutex);
-    if (random_messages)
-    {
-        vfree(random_messages);
-    }
+    pr_debug("magic8ball::read: returned %zu bytes at %lld (%d messages left)\n", total_len, *ppos, session->answer.messages_left);
+    *ppos += total_len;
+    drv_stats_account(&magic8ball_stats, DRV_STATS_READ, total_len);
     return total_len;
 
     Error:
-        mutex_unlock(&data.crit_sec_mutex);
-        if (random_messages)
+        // Returning what was copied before the fault, if anything.
+        if (total_len > 0)
         {
-            vfree(random_messages);
+            *ppos += total_len;
+            drv_stats_account(&magic8ball_stats, DRV_STATS_READ, total_len);
+            return total_len;
         }
+        drv_stats_account(&magic8ball_stats, DRV_STATS_READ, -EFAULT);
         return -EFAULT;
     
 }
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
 static const struct proc_ops proc_fops = {
+    .proc_open = magic8ball_open,
     .proc_read = magic8ball_read,
-    .proc_write = magic8ball_write
+    .proc_write = magic8ball_write,
+    .proc_release = magic8ball_release
 };
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
+#else
 static const struct file_operations  proc_fops = {
     .owner = THIS_MODULE,
+    .open = magic8ball_open,
     .read = magic8ball_read,
-    .write = magic8ball_write
+    .write = magic8ball_write,
+    .release = magic8ball_release
 };
 #endif
 
 // ----------------------------------------------------------------------------
-// Lifecycle
+// Corpus control entry
+//
+// Reading /proc/magic8ball_corpus lists the current messages. Text written
+// to it is accumulated (up to MAGIC8BALL_CORPUS_MAX_LEN bytes), then loaded 
+// as the new corpus when the file is closed, e.g.:
+//
+//   cat answers.txt > /proc/magic8ball_corpus
+//
+// Closing cannot fail: a text that is not a valid corpus (no messages, or
+// a message longer than MAGIG8BALL_BUF_LEN - 1 bytes) is only reported in 
+// the kernel log, the current corpus being kept.
+
+struct magic8ball_corpus_upload {
+    char *text;
+    size_t len;
+};
 
-static int __init magic8ball_init(void)
+static int magic8ball_corpus_show(struct seq_file *m, void *unused)
 {
-    printk(KERN_INFO "-> magic8ball::init\n");
+    struct magic8ball_corpus *corpus = magic8ball_corpus_get();
+    for (size_t i = 0; i < corpus->num_msgs; i++)
+    {
+        const struct magic8ball_msg *msg = &corpus->msgs[i];
+        // Listed as they can be written back, without the separating space.
+        if (corpus->alias)
+        {
+            seq_printf(m, "%u\t", msg->weight);
+        }
+        seq_printf(m, "%.*s\n", (int)(msg->len - 1), msg->text);
+    }
+    magic8ball_corpus_put(corpus);
+    return 0;
+}
 
-    #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
-    proc_magic8ball = proc_create(MAGIG8BALL_PROC_NAME, 0777, NULL, &proc_fops);
-    if(proc_magic8ball == NULL)
+static int magic8ball_corpus_open(struct inode *inode, struct file *file)
+{
+    struct magic8ball_corpus_upload *upload = NULL;
+    if (file->f_mode & FMODE_WRITE)
     {
-        goto Error;
+        upload = kzalloc(sizeof(*upload), GFP_KERNEL);
+        if (!upload)
+        {
+            return -ENOMEM;
+        }
     }
-    #else
-    proc_magic8ball = create_proc_entry(MAGIG8BALL_PROC_NAME, 0, 0);
-    if(proc_magic8ball == NULL)
+    int status = single_open(file, magic8ball_corpus_show, upload);
+    if (status)
     {
-        goto Error;
+        kfree(upload);
     }
-    proc_magic8ball->read_proc = magic8ball_read;
-    proc_magic8ball->write_proc = magic8ball_write;
-    #endif
-
+    return status;
+}
 
-    #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,29)
-    proc_magic8ball->owner = THIS_MODULE;
-    #endif
+static ssize_t magic8ball_corpus_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    struct magic8ball_corpus_upload *upload = ((struct seq_file *)file->private_data)->private;
 
-    data.buffer = vmalloc(MAGIG8BALL_BUF_LEN);
-    data.magic8ball_count = MAGIG8BALL_DEFAULT_MAGIG8BALL_COUNT;
-    // Allocating message pointers in contiguous memory using kalloc.
-    // Each individual message, for its part, is allocated in 
-    // potentially non-contiguous (virtual) memory. 
-    size_t messages_ptr_len = ( MAGIC8BALL_NUM_MSG * sizeof(char*) + MAGIC8BALL_NUM_MSG * sizeof(char) );
-    printk(KERN_INFO "Allocating %d bytes to store message pointers", messages_ptr_len);
-    data.messages = (char**) kmalloc(messages_ptr_len, GFP_KERNEL);
-    if (!data.messages)
-    {
-        printk(KERN_ERR "Could not allocate memory for storing message pointers");
-        goto Error;
+    if (count > MAGIC8BALL_CORPUS_MAX_LEN - upload->len)
+    {
+        return -EFBIG;
     }
-    for (int i = 0; i < MAGIC8BALL_NUM_MSG; i++)
+    if (!upload->text)
     {
-        data.messages[i] = (char*) vmalloc(MAGIG8BALL_BUF_LEN);
-        if (!data.messages[i])
+        // Keeping room for the string termination char.
+        upload->text = vmalloc(MAGIC8BALL_CORPUS_MAX_LEN + 1);
+        if (!upload->text)
         {
-            printk(KERN_ERR "Could not allocate memory for storing message string (index: %d)", i);
-            goto Error;
+            return -ENOMEM;
         }
-        switch(i)
+    }
+    if (copy_from_user(upload->text + upload->len, buf, count))
+    {
+        return -EFAULT;
+    }
+    upload->len += count;
+    *ppos += count;
+    return count;
+}
+
+static int magic8ball_corpus_release(struct inode *inode, struct file *file)
+{
+    struct magic8ball_corpus_upload *upload = ((struct seq_file *)file->private_data)->private;
+
+    if (upload && upload->len > 0)
+    {
+        upload->text[upload->len] = '\0';
+        struct magic8ball_corpus *corpus = magic8ball_corpus_build(upload->text, upload->len);
+        if (IS_ERR(corpus))
         {
-            case 0:
-                strncpy(data.messages[i], MAGIG8BALL_MSG0, MAGIG8BALL_BUF_LEN);
-                break;
-            case 1:
-                strncpy(data.messages[i], MAGIG8BALL_MSG1, MAGIG8BALL_BUF_LEN);
-                break;
-            case 2:
-                strncpy(data.messages[i], MAGIG8BALL_MSG2, MAGIG8BALL_BUF_LEN);
-                break;
-            case 3:
-                strncpy(data.messages[i], MAGIG8BALL_MSG3, MAGIG8BALL_BUF_LEN);
-                break;
-            case 4:
-                strncpy(data.messages[i], MAGIC8BALL_MSG4, MAGIG8BALL_BUF_LEN);
-                break;
-            case 5:
-                strncpy(data.messages[i], MAGIC8BALL_MSG5, MAGIG8BALL_BUF_LEN);
-                break;
-            case 6:
-                strncpy(data.messages[i], MAGIC8BALL_MSG6, MAGIG8BALL_BUF_LEN);
-                break;
-            case 7:
-                strncpy(data.messages[i], MAGIC8BALL_MSG7, MAGIG8BALL_BUF_LEN);
-                break;
-            case 8:
-                strncpy(data.messages[i], MAGIC8BALL_MSG8, MAGIG8BALL_BUF_LEN);
-                break;
-            case 9:
-                strncpy(data.messages[i], MAGIC8BALL_MSG9, MAGIG8BALL_BUF_LEN);
-                break;
-            case 10:
-                strncpy(data.messages[i], MAGIC8BALL_MSG10, MAGIG8BALL_BUF_LEN);
-                break;
-            case 11:
-                strncpy(data.messages[i], MAGIC8BALL_MSG11, MAGIG8BALL_BUF_LEN);
-                break;
-            case 12:
-                strncpy(data.messages[i], MAGIC8BALL_MSG12, MAGIG8BALL_BUF_LEN);
-                break;
-            case 13:
-                strncpy(data.messages[i], MAGIC8BALL_MSG13, MAGIG8BALL_BUF_LEN);
-                break;
-            case 14:
-                strncpy(data.messages[i], MAGIC8BALL_MSG14, MAGIG8BALL_BUF_LEN);
-                break;
-            case 15:
-                strncpy(data.messages[i], MAGIC8BALL_MSG15, MAGIG8BALL_BUF_LEN);
-                break;
-            case 16:
-                strncpy(data.messages[i], MAGIC8BALL_MSG16, MAGIG8BALL_BUF_LEN);
-                break;
-            case 17:
-                strncpy(data.messages[i], MAGIC8BALL_MSG17, MAGIG8BALL_BUF_LEN);
-                break;
-            case 18:
-                strncpy(data.messages[i], MAGIC8BALL_MSG18, MAGIG8BALL_BUF_LEN);
-                break;
-            case 19:
-                strncpy(data.messages[i], MAGIC8BALL_MSG19, MAGIG8BALL_BUF_LEN);
-                break;
+            pr_warn("magic8ball: could not load corpus (status code: %ld)\n", PTR_ERR(corpus));
         }
-        size_t actual_len = strnlen(data.messages[i], MAGIG8BALL_BUF_LEN);
-        printk(KERN_INFO "Stored string #%d into dynamically allocted buffer (len=%d): %s", (i + 1), actual_len, data.messages[i]);
+        else
+        {
+            magic8ball_corpus_publish(corpus);
+            pr_info("magic8ball: loaded corpus of %zu messages\n", corpus->num_msgs);
+        }
+    }
+    if (upload)
+    {
+        vfree(upload->text);
+        kfree(upload);
     }
+    return single_release(inode, file);
+}
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+static const struct proc_ops proc_corpus_fops = {
+    .proc_open = magic8ball_corpus_open,
+    .proc_read = seq_read,
+    .proc_write = magic8ball_corpus_write,
+    .proc_lseek = seq_lseek,
+    .proc_release = magic8ball_corpus_release
+};
+#else
+static const struct file_operations proc_corpus_fops = {
+    .owner = THIS_MODULE,
+    .open = magic8ball_corpus_open,
+    .read = seq_read,
+    .write = magic8ball_corpus_write,
+    .llseek = seq_lseek,
+    .release = magic8ball_corpus_release
+};
+#endif
+
+// ----------------------------------------------------------------------------
+// Lifecycle
+
+static int __init magic8ball_init(void)
+{
+    printk(KERN_INFO "-> magic8ball::init\n");
+
+    if (drv_stats_init(&magic8ball_stats, MAGIG8BALL_PROC_NAME))
+    {
+        return -ENOMEM;
+    }
+
+    // Initialized before the proc entry is created: files can be opened
+    // as soon as it is.
+    data.magic8ball_count = MAGIG8BALL_DEFAULT_MAGIG8BALL_COUNT;
     mutex_init(&data.crit_sec_mutex);
+    // The reference held through the corpus pointer.
+    kref_init(&magic8ball_builtin_corpus.ref);
+
+    proc_magic8ball = proc_create(MAGIG8BALL_PROC_NAME, 0777, NULL, &proc_fops);
+    if(proc_magic8ball == NULL)
+    {
+        goto Error;
+    }
+    proc_magic8ball_corpus = proc_create(MAGIC8BALL_CORPUS_PROC_NAME, 0644, NULL, &proc_corpus_fops);
+    if(proc_magic8ball_corpus == NULL)
+    {
+        goto Error;
+    }
+
     printk(KERN_INFO "<- magic8ball::init\n");
     return 0;
 
     Error:
         printk(KERN_ERR "Error occurred. Aborting module initialization (could not create proc entry %s)\n", MAGIG8BALL_PROC_NAME);
+        if (proc_magic8ball)
+        {
+            remove_proc_entry(MAGIG8BALL_PROC_NAME, 0);
+        }
+        drv_stats_destroy(&magic8ball_stats);
         return -ENOMEM;
   
 }
@@ -368,25 +661,17 @@ static int __init magic8ball_init(void)
 static void __exit magic8ball_exit(void)
 {
     printk(KERN_INFO, "-> magic8ball::exit\n");
-    if (data.buffer)
-    {
-        vfree(data.buffer);
-    }
-    if (data.messages)
-    {
-        for (int i = 0; i < MAGIC8BALL_NUM_MSG; i++)
-        {
-            if (data.messages[i])
-            {
-                vfree(data.messages[i]);
-            }
-        }
-        kfree(data.messages);
-    }
     if (proc_magic8ball)
     {
         remove_proc_entry(MAGIG8BALL_PROC_NAME, 0);
     }
+    if (proc_magic8ball_corpus)
+    {
+        remove_proc_entry(MAGIC8BALL_CORPUS_PROC_NAME, 0);
+    }
+    // All files are closed: only the corpus pointer holds a reference.
+    magic8ball_corpus_put(rcu_dereference_protected(magic8ball_corpus, 1));
+    drv_stats_destroy(&magic8ball_stats);
     printk(KERN_INFO, "<- magic8ball::exit\n");
 }
 
@@ -0,0 +1,101 @@
+#ifndef MAGIC8BALL_ALIAS_H
+#define MAGIC8BALL_ALIAS_H
+
+#include <linux/types.h>
+#include <linux/errno.h>        // Needed for ENOMEM
+#include <linux/limits.h>       // Needed for U32_MAX
+#include <linux/slab.h>         // Needed for kvmalloc_array/kvfree
+#include <linux/math64.h>       // Needed for mul_u64_u64_div_u64
+
+// ----------------------------------------------------------------------------
+// Alias tables
+//
+// Weighted messages are picked in constant time, using an alias table (see 
+// magic8ball.c for how corpora are built and used; the tests, in 
+// magic8ball_kunit.c, check the probabilities the tables imply).
+
+struct magic8ball_msg {
+    const char* text;
+    size_t len;
+    u32 weight;
+};
+
+// An alias table entry (Walker's method): message i is picked if a 
+// uniform 32-bit number falls below 'prob', and message 'alias' otherwise.
+struct magic8ball_alias {
+    u32 prob;
+    u32 alias;
+};
+
+// Builds the alias table of the given messages, using Vose's method: each
+// message's weight is scaled so that the average is 'total', then each 
+// entry is filled with an underweight message, topped up with (and 
+// aliased to) an overweight one, until all are used. Scaled weights are 
+// below 2^52 (weights are 32-bit, and there are fewer than 2^20 messages),
+// and are compared exactly: only the final probabilities are rounded.
+static inline int magic8ball_alias_build(struct magic8ball_alias *alias, const struct magic8ball_msg *msgs, u32 num_msgs)
+{
+    u64 total = 0;
+    for (u32 i = 0; i < num_msgs; i++)
+    {
+        total += msgs[i].weight;
+    }
+
+    u64 *scaled = kvmalloc_array(num_msgs, sizeof(u64) + 2 * sizeof(u32), GFP_KERNEL);
+    if (!scaled)
+    {
+        return -ENOMEM;
+    }
+    u32 *small = (u32 *)(scaled + num_msgs);
+    u32 *large = small + num_msgs;
+    u32 num_small = 0;
+    u32 num_large = 0;
+
+    for (u32 i = 0; i < num_msgs; i++)
+    {
+        scaled[i] = (u64)msgs[i].weight * num_msgs;
+        if (scaled[i] < total)
+        {
+            small[num_small++] = i;
+        }
+        else
+        {
+            large[num_large++] = i;
+        }
+    }
+    while (num_small > 0 && num_large > 0)
+    {
+        u32 s = small[--num_small];
+        u32 l = large[--num_large];
+        alias[s].prob = mul_u64_u64_div_u64(scaled[s], 1ULL << 32, total);
+        alias[s].alias = l;
+        scaled[l] -= total - scaled[s];
+        if (scaled[l] < total)
+        {
+            small[num_small++] = l;
+        }
+        else
+        {
+            large[num_large++] = l;
+        }
+    }
+    // The remaining entries are full (or off by rounding): they alias 
+    // themselves.
+    while (num_large > 0)
+    {
+        u32 l = large[--num_large];
+        alias[l].prob = U32_MAX;
+        alias[l].alias = l;
+    }
+    while (num_small > 0)
+    {
+        u32 s = small[--num_small];
+        alias[s].prob = U32_MAX;
+        alias[s].alias = s;
+    }
+
+    kvfree(scaled);
+    return 0;
+}
+
+#endif
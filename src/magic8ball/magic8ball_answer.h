@@ -0,0 +1,83 @@
+#ifndef MAGIC8BALL_ANSWER_H
+#define MAGIC8BALL_ANSWER_H
+
+#include <linux/types.h>
+#include <linux/minmax.h>       // Needed for min
+
+#include "magic8ball_alias.h"
+
+// ----------------------------------------------------------------------------
+// Answers
+//
+// An answer is made of a number of messages, followed by a null character.
+// It is generated as it is read, in parts of any size: messages are picked
+// as they are needed, and a message that does not fit in what is read is
+// continued by the next part. The answer only keeps track of its progress
+// (messages left to pick, and how much of the current message has been
+// read), so that its size is bounded by the count only.
+//
+// The driver (magic8ball.c) copies the parts to the reader's buffer, picking
+// messages from the session's corpus; the tests (magic8ball_kunit.c) read
+// them with parts of every size.
+
+struct magic8ball_answer {
+    int messages_left;
+    const struct magic8ball_msg *msg;
+    size_t msg_offset;
+    bool terminated;
+};
+
+// Picks the next message of an answer.
+typedef const struct magic8ball_msg *(*magic8ball_pick_fn)(void *arg);
+
+static inline void magic8ball_answer_start(struct magic8ball_answer *answer, int count)
+{
+    answer->messages_left = count;
+    answer->msg = NULL;
+    answer->msg_offset = 0;
+    answer->terminated = false;
+}
+
+// Returns the length of the answer's next part (at most 'len' bytes, its
+// text being stored into 'text'): the rest of the current message (a new
+// one being picked first, if there is none), or the terminating null
+// character. Returns 0 once the whole answer has been read. The part is
+// only consumed by magic8ball_answer_advance: if it cannot be copied, the
+// same part is returned again.
+static inline size_t magic8ball_answer_next(struct magic8ball_answer *answer, size_t len, const char **text, magic8ball_pick_fn pick, void *arg)
+{
+    if (!answer->msg)
+    {
+        if (answer->messages_left == 0)
+        {
+            if (answer->terminated || len == 0)
+            {
+                return 0;
+            }
+            *text = "";
+            return 1;
+        }
+        answer->msg = pick(arg);
+        answer->msg_offset = 0;
+        answer->messages_left--;
+    }
+    *text = answer->msg->text + answer->msg_offset;
+    return min(answer->msg->len - answer->msg_offset, len);
+}
+
+// Consumes 'n' bytes (at most what magic8ball_answer_next returned).
+static inline void magic8ball_answer_advance(struct magic8ball_answer *answer, size_t n)
+{
+    if (!answer->msg)
+    {
+        answer->terminated = answer->terminated || n > 0;
+        return;
+    }
+    answer->msg_offset += n;
+    if (answer->msg_offset == answer->msg->len)
+    {
+        answer->msg = NULL;
+    }
+}
+
+#endif
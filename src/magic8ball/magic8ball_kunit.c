@@ -0,0 +1,381 @@
+#include <kunit/test.h>         // Needed for the KUnit API
+#include <linux/module.h>       // Needed by all modules
+#include <linux/random.h>       // Needed for get_random_bytes
+#include <linux/math64.h>       // Needed for mul_u64_u64_div_u64
+
+#include "magic8ball_alias.h"
+#include "magic8ball_answer.h"
+#include "../common/drv_bench.h"
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("yduchesne");
+MODULE_DESCRIPTION("Tests and benchmarks of the magic8ball alias tables and answers");
+
+// ----------------------------------------------------------------------------
+// Parameters
+
+static bool bench;
+module_param(bench, bool, 0444);
+MODULE_PARM_DESC(bench, "Run the timed benchmarks (magic8ball_bench suite)");
+
+// ----------------------------------------------------------------------------
+// Tests
+//
+// The probability with which a table picks each message is computed exactly
+// (in units of 2^-32 / num_msgs: an entry contributes 'prob' to its message
+// and the rest to its alias), then compared with the message's weight. Each 
+// entry's probability is rounded down once, so a message may lose up to one
+// unit per entry contributing to it.
+
+#define MAGIC8BALL_KUNIT_MAX_MSGS 1024
+
+static void magic8ball_kunit_check(struct kunit *test, const u32 *weights, u32 num_msgs)
+{
+    struct magic8ball_msg *msgs = kunit_kcalloc(test, num_msgs, sizeof(*msgs), GFP_KERNEL);
+    struct magic8ball_alias *alias = kunit_kcalloc(test, num_msgs, sizeof(*alias), GFP_KERNEL);
+    u64 *implied = kunit_kcalloc(test, num_msgs, sizeof(*implied), GFP_KERNEL);
+    u32 *sources = kunit_kcalloc(test, num_msgs, sizeof(*sources), GFP_KERNEL);
+    u64 total = 0;
+
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, msgs);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, alias);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, implied);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, sources);
+
+    for (u32 i = 0; i < num_msgs; i++)
+    {
+        msgs[i].weight = weights[i];
+        total += weights[i];
+    }
+    KUNIT_ASSERT_EQ(test, magic8ball_alias_build(alias, msgs, num_msgs), 0);
+
+    for (u32 i = 0; i < num_msgs; i++)
+    {
+        u32 other = alias[i].alias;
+        KUNIT_ASSERT_LT_MSG(test, other, num_msgs, "entry: %u", i);
+        if (other == i)
+        {
+            implied[i] += 1ULL << 32;
+            sources[i]++;
+            continue;
+        }
+        implied[i] += alias[i].prob;
+        implied[other] += (1ULL << 32) - alias[i].prob;
+        sources[i]++;
+        sources[other]++;
+    }
+
+    for (u32 i = 0; i < num_msgs; i++)
+    {
+        u64 expected = mul_u64_u64_div_u64((u64)weights[i] * num_msgs, 1ULL << 32, total);
+        if (weights[i] == 0)
+        {
+            KUNIT_EXPECT_EQ_MSG(test, implied[i], 0, "message: %u (weight 0)", i);
+            continue;
+        }
+        // Rounding only ever moves probability from an entry's message to
+        // its alias.
+        KUNIT_EXPECT_LE_MSG(test, implied[i], expected + sources[i], "message: %u, weight: %u, implied: %llu, expected: %llu", i, weights[i], implied[i], expected);
+        KUNIT_EXPECT_GE_MSG(test, implied[i] + sources[i], expected, "message: %u, weight: %u, implied: %llu, expected: %llu", i, weights[i], implied[i], expected);
+    }
+}
+
+static void magic8ball_kunit_uniform(struct kunit *test)
+{
+    u32 weights[20];
+    for (u32 i = 0; i < ARRAY_SIZE(weights); i++)
+    {
+        weights[i] = 3;
+    }
+    magic8ball_kunit_check(test, weights, ARRAY_SIZE(weights));
+}
+
+static void magic8ball_kunit_single(struct kunit *test)
+{
+    static const u32 weights[] = { 7 };
+    magic8ball_kunit_check(test, weights, ARRAY_SIZE(weights));
+}
+
+static void magic8ball_kunit_skewed(struct kunit *test)
+{
+    static const u32 weights[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 100, 1000 };
+    static const u32 heavy[] = { U32_MAX, 1, 1, 1, U32_MAX - 1, 2 };
+    magic8ball_kunit_check(test, weights, ARRAY_SIZE(weights));
+    magic8ball_kunit_check(test, heavy, ARRAY_SIZE(heavy));
+}
+
+// Corpora leave such messages out, but the table must still never pick them.
+static void magic8ball_kunit_zero_weight(struct kunit *test)
+{
+    static const u32 weights[] = { 0, 5, 0, 1, 0, 0, 2 };
+    magic8ball_kunit_check(test, weights, ARRAY_SIZE(weights));
+}
+
+static void magic8ball_kunit_random(struct kunit *test)
+{
+    u32 *weights = kunit_kmalloc_array(test, MAGIC8BALL_KUNIT_MAX_MSGS, sizeof(*weights), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, weights);
+
+    for (u32 num_msgs = 2; num_msgs <= MAGIC8BALL_KUNIT_MAX_MSGS; num_msgs *= 2)
+    {
+        get_random_bytes(weights, num_msgs * sizeof(*weights));
+        // Alternating between small weights (many ties with the average)
+        // and full 32-bit ones.
+        if (num_msgs % 3 == 1)
+        {
+            for (u32 i = 0; i < num_msgs; i++)
+            {
+                weights[i] = 1 + weights[i] % 4;
+            }
+        }
+        magic8ball_kunit_check(test, weights, num_msgs);
+    }
+}
+
+static struct kunit_case magic8ball_kunit_cases[] = {
+    KUNIT_CASE(magic8ball_kunit_uniform),
+    KUNIT_CASE(magic8ball_kunit_single),
+    KUNIT_CASE(magic8ball_kunit_skewed),
+    KUNIT_CASE(magic8ball_kunit_zero_weight),
+    KUNIT_CASE(magic8ball_kunit_random),
+    {}
+};
+
+static struct kunit_suite magic8ball_kunit_suite = {
+    .name = "magic8ball_alias",
+    .test_cases = magic8ball_kunit_cases,
+};
+
+// ----------------------------------------------------------------------------
+// Answer tests
+//
+// Answers are read in parts of every size, as by successive reads: the
+// messages are picked in turn from a small table (rather than at random),
+// so that the answer's text is known in advance.
+
+#define MAGIC8BALL_KUNIT_MSG(msg) { msg " ", sizeof(msg " ") - 1, 1 }
+
+static const struct magic8ball_msg magic8ball_kunit_msgs[] = {
+    MAGIC8BALL_KUNIT_MSG("Yes."),
+    MAGIC8BALL_KUNIT_MSG("Reply hazy, try again."),
+    MAGIC8BALL_KUNIT_MSG("No."),
+    MAGIC8BALL_KUNIT_MSG("Very doubtful.")
+};
+
+#define MAGIC8BALL_KUNIT_ANSWER_LEN 256
+
+struct magic8ball_kunit_picks {
+    unsigned int next;
+};
+
+static const struct magic8ball_msg *magic8ball_kunit_pick(void *arg)
+{
+    struct magic8ball_kunit_picks *picks = arg;
+    return &magic8ball_kunit_msgs[picks->next++ % ARRAY_SIZE(magic8ball_kunit_msgs)];
+}
+
+// Reads a whole answer, 'piece' bytes at a time at most, into 'out'.
+// Returns its length.
+static size_t magic8ball_kunit_read(struct magic8ball_answer *answer, char *out, size_t out_len, size_t piece)
+{
+    struct magic8ball_kunit_picks picks = { 0 };
+    size_t done = 0;
+
+    while (done < out_len)
+    {
+        size_t read_len = min(piece, out_len - done);
+        size_t total_len = 0;
+        // One read: parts until the piece is full, or the answer is over.
+        while (total_len < read_len)
+        {
+            const char *text;
+            size_t part = magic8ball_answer_next(answer, read_len - total_len, &text, magic8ball_kunit_pick, &picks);
+            if (part == 0)
+            {
+                break;
+            }
+            memcpy(out + done + total_len, text, part);
+            magic8ball_answer_advance(answer, part);
+            total_len += part;
+        }
+        if (total_len == 0)
+        {
+            break;
+        }
+        done += total_len;
+    }
+    return done;
+}
+
+static void magic8ball_kunit_answer_pieces(struct kunit *test)
+{
+    static const int counts[] = { 1, 2, 5, 7 };
+    char expected[MAGIC8BALL_KUNIT_ANSWER_LEN];
+    char out[MAGIC8BALL_KUNIT_ANSWER_LEN];
+
+    for (unsigned int c = 0; c < ARRAY_SIZE(counts); c++)
+    {
+        size_t expected_len = 0;
+        for (int i = 0; i < counts[c]; i++)
+        {
+            const struct magic8ball_msg *msg = &magic8ball_kunit_msgs[i % ARRAY_SIZE(magic8ball_kunit_msgs)];
+            memcpy(expected + expected_len, msg->text, msg->len);
+            expected_len += msg->len;
+        }
+        expected[expected_len++] = '\0';
+
+        for (size_t piece = 1; piece <= expected_len + 1; piece++)
+        {
+            struct magic8ball_answer answer;
+            magic8ball_answer_start(&answer, counts[c]);
+            memset(out, 'x', sizeof(out));
+            size_t len = magic8ball_kunit_read(&answer, out, sizeof(out), piece);
+            KUNIT_EXPECT_EQ_MSG(test, len, expected_len, "count: %d, piece: %zu", counts[c], piece);
+            KUNIT_EXPECT_EQ_MSG(test, memcmp(out, expected, expected_len), 0, "count: %d, piece: %zu", counts[c], piece);
+            KUNIT_EXPECT_EQ_MSG(test, answer.messages_left, 0, "count: %d, piece: %zu", counts[c], piece);
+        }
+    }
+}
+
+// Without messages, the answer is only the null character.
+static void magic8ball_kunit_answer_empty(struct kunit *test)
+{
+    struct magic8ball_answer answer;
+    char out[4];
+
+    magic8ball_answer_start(&answer, 0);
+    KUNIT_EXPECT_EQ(test, magic8ball_kunit_read(&answer, out, sizeof(out), 1), 1);
+    KUNIT_EXPECT_EQ(test, out[0], '\0');
+    KUNIT_EXPECT_EQ(test, magic8ball_kunit_read(&answer, out, sizeof(out), 1), 0);
+}
+
+// A part that is not consumed (its copy having failed) is returned again,
+// without a new message being picked.
+static void magic8ball_kunit_answer_retry(struct kunit *test)
+{
+    struct magic8ball_kunit_picks picks = { 0 };
+    struct magic8ball_answer answer;
+    const char *text;
+    const char *again;
+
+    magic8ball_answer_start(&answer, 1);
+    KUNIT_EXPECT_EQ(test, magic8ball_answer_next(&answer, 3, &text, magic8ball_kunit_pick, &picks), 3);
+    KUNIT_EXPECT_EQ(test, magic8ball_answer_next(&answer, 3, &again, magic8ball_kunit_pick, &picks), 3);
+    KUNIT_EXPECT_TRUE(test, text == again);
+    KUNIT_EXPECT_EQ(test, picks.next, 1);
+    magic8ball_answer_advance(&answer, 2);
+    KUNIT_EXPECT_EQ(test, magic8ball_answer_next(&answer, 16, &text, magic8ball_kunit_pick, &picks), magic8ball_kunit_msgs[0].len - 2);
+    KUNIT_EXPECT_TRUE(test, text == magic8ball_kunit_msgs[0].text + 2);
+}
+
+static struct kunit_case magic8ball_answer_kunit_cases[] = {
+    KUNIT_CASE(magic8ball_kunit_answer_pieces),
+    KUNIT_CASE(magic8ball_kunit_answer_empty),
+    KUNIT_CASE(magic8ball_kunit_answer_retry),
+    {}
+};
+
+static struct kunit_suite magic8ball_answer_kunit_suite = {
+    .name = "magic8ball_answer",
+    .test_cases = magic8ball_answer_kunit_cases,
+};
+
+// ----------------------------------------------------------------------------
+// Benchmarks
+//
+// Builds the alias tables of large corpora of randomly weighted messages,
+// and reads long answers a page at a time; the cost per message is reported
+// (see drv_bench.h). They only run when the module is loaded with bench=1.
+
+#define MAGIC8BALL_BENCH_MAX_MSGS (1024 * 1024)
+#define MAGIC8BALL_BENCH_ROUNDS 8
+
+static void magic8ball_bench_build(struct kunit *test)
+{
+    if (!bench)
+    {
+        kunit_skip(test, "not loaded with bench=1");
+    }
+    struct magic8ball_msg *msgs = kunit_kcalloc(test, MAGIC8BALL_BENCH_MAX_MSGS, sizeof(*msgs), GFP_KERNEL);
+    struct magic8ball_alias *alias = kunit_kcalloc(test, MAGIC8BALL_BENCH_MAX_MSGS, sizeof(*alias), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, msgs);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, alias);
+
+    for (u32 i = 0; i < MAGIC8BALL_BENCH_MAX_MSGS; i++)
+    {
+        get_random_bytes(&msgs[i].weight, sizeof(msgs[i].weight));
+        msgs[i].weight = 1 + msgs[i].weight % 1000;
+    }
+
+    for (u32 num_msgs = 1024; num_msgs <= MAGIC8BALL_BENCH_MAX_MSGS; num_msgs *= 32)
+    {
+        char name[32];
+        struct drv_bench timing;
+
+        drv_bench_start(&timing);
+        for (unsigned int round = 0; round < MAGIC8BALL_BENCH_ROUNDS; round++)
+        {
+            KUNIT_ASSERT_EQ(test, magic8ball_alias_build(alias, msgs, num_msgs), 0);
+            cond_resched();
+        }
+        snprintf(name, sizeof(name), "build_%u", num_msgs);
+        drv_bench_report(test, &timing, name, "message", (u64)num_msgs * MAGIC8BALL_BENCH_ROUNDS);
+    }
+}
+
+#define MAGIC8BALL_BENCH_ANSWER_MSGS (4 * 1024 * 1024)
+
+static void magic8ball_bench_answer(struct kunit *test)
+{
+    if (!bench)
+    {
+        kunit_skip(test, "not loaded with bench=1");
+    }
+    char *page = kunit_kmalloc(test, PAGE_SIZE, GFP_KERNEL);
+    struct magic8ball_kunit_picks picks = { 0 };
+    struct magic8ball_answer answer;
+    struct drv_bench timing;
+    u64 read_len = 0;
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, page);
+
+    magic8ball_answer_start(&answer, MAGIC8BALL_BENCH_ANSWER_MSGS);
+    drv_bench_start(&timing);
+    for (;;)
+    {
+        size_t total_len = 0;
+        while (total_len < PAGE_SIZE)
+        {
+            const char *text;
+            size_t part = magic8ball_answer_next(&answer, PAGE_SIZE - total_len, &text, magic8ball_kunit_pick, &picks);
+            if (part == 0)
+            {
+                break;
+            }
+            memcpy(page + total_len, text, part);
+            magic8ball_answer_advance(&answer, part);
+            total_len += part;
+        }
+        if (total_len == 0)
+        {
+            break;
+        }
+        read_len += total_len;
+        cond_resched();
+    }
+    drv_bench_report(test, &timing, "answer", "message", MAGIC8BALL_BENCH_ANSWER_MSGS);
+    KUNIT_EXPECT_EQ(test, picks.next, MAGIC8BALL_BENCH_ANSWER_MSGS);
+    KUNIT_EXPECT_GE(test, read_len, (u64)MAGIC8BALL_BENCH_ANSWER_MSGS);
+}
+
+static struct kunit_case magic8ball_bench_cases[] = {
+    KUNIT_CASE(magic8ball_bench_build),
+    KUNIT_CASE(magic8ball_bench_answer),
+    {}
+};
+
+static struct kunit_suite magic8ball_bench_suite = {
+    .name = "magic8ball_bench",
+    .test_cases = magic8ball_bench_cases,
+};
+
+kunit_test_suites(&magic8ball_kunit_suite, &magic8ball_answer_kunit_suite, &magic8ball_bench_suite);
@@ -0,0 +1,44 @@
+/**
+ * @file blkram_ioctl.h
+ * @author yduchesne
+ * @brief ioctl interface of the blkram block driver.
+ *
+ */
+
+#ifndef BLKRAM_IOCTL_H
+#define BLKRAM_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define BLKRAM_IOCTL_MAGIC 0xB7
+#define BLKRAM_IOCTL_COPY_CMD 0x00
+
+/**
+ * @brief Range copied by BLKRAM_IOCTL_COPY.
+ *
+ * Offsets and length are in bytes, and must be multiples of the device's
+ * logical block size. The ranges may overlap (the copy then behaves as
+ * memmove()).
+ *
+ */
+struct blkram_copy_range
+{
+	__u64 src;
+	__u64 dst;
+	__u64 len;
+};
+
+/**
+ * @brief Copies a range of the device to another, inside the driver.
+ *
+ * No data goes through user space or the block layer: the copy runs at
+ * memory speed. The device must be opened for writing. The copy is atomic
+ * with respect to block requests (the queue is frozen while it runs), and
+ * the page cache of the device is kept consistent (dirty pages of both
+ * ranges are written back first, and the destination's are dropped after).
+ *
+ */
+#define BLKRAM_IOCTL_COPY _IOW(BLKRAM_IOCTL_MAGIC, BLKRAM_IOCTL_COPY_CMD, struct blkram_copy_range)
+
+#endif
@@ -0,0 +1,373 @@
+/**
+ * @file blkram_store.h
+ * @author yduchesne
+ * @brief The data store of the blkram driver (ramdrv.c): the pages holding
+ * the device's data, or the reserved memory range it is kept in.
+ *
+ * It is kept apart from the block layer glue so that it can be tested on its
+ * own (see ramdrv_kunit.c).
+ *
+ */
+
+#ifndef BLKRAM_STORE_H
+#define BLKRAM_STORE_H
+
+#include <linux/types.h>
+#include <linux/atomic.h>
+#include <linux/bug.h>
+#include <linux/errno.h>
+#include <linux/minmax.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/xarray.h>
+#include <linux/rwsem.h>
+#include <linux/memcontrol.h>
+#include <linux/sched.h>
+#include <linux/sched/mm.h>
+#include <linux/string.h>
+#include <linux/sizes.h>
+
+// Marks the stored pages that zeros were written to since the shrinker last
+// looked at them (the only ones that may hold only zeros).
+#define BLK_RAM_MAYBE_ZERO XA_MARK_1
+
+// Reserved memory is zeroed and copied this many bytes at a time, with a
+// chance to reschedule in between (the ranges' length being up to the user).
+#define BLK_RAM_CHUNK SZ_1M
+
+/**
+ * @brief The device's data.
+ *
+ * Offsets and lengths are in bytes, and are not checked against the
+ * device's capacity (the caller does).
+ *
+ */
+struct blk_ram_store
+{
+	/**
+	 * @brief The driver's data (kept in memory), as pages indexed by their
+	 * number on the device.
+	 *
+	 * Pages are allocated on first write: a page that is absent reads as
+	 * zeros. Pages that zeros were written to since the shrinker last
+	 * scanned them are marked with BLK_RAM_MAYBE_ZERO: the others hold
+	 * some non-zero data.
+	 *
+	 */
+	struct xarray pages;
+
+	/**
+	 * @brief The driver's data, when kept in a reserved physical memory
+	 * range (phys_addr module parameter) instead of pages: the range's
+	 * mapping (NULL otherwise).
+	 *
+	 * The range is outside of the page allocator (e.g. set aside at boot
+	 * with memmap=<size>$<address>), so its content survives reloading the
+	 * module and warm (kexec) reboots. It is mapped write-back.
+	 *
+	 */
+	void *mem;
+
+	/**
+	 * @brief Held for reading while accessing pages, and for writing while
+	 * freeing them (discards, shrinker).
+	 *
+	 */
+	struct rw_semaphore pages_lock;
+
+	/**
+	 * @brief Number of stored pages, and number of those marked
+	 * BLK_RAM_MAYBE_ZERO.
+	 *
+	 */
+	atomic_long_t nr_pages;
+	atomic_long_t nr_maybe_zero;
+
+	/**
+	 * @brief Memory cgroup the pages are charged to (that of the process
+	 * that created the device; NULL with reserved memory).
+	 *
+	 */
+	struct mem_cgroup *memcg;
+};
+
+/**
+ * @brief Initializes an empty store (memcg and mem are set by the caller,
+ * if needed).
+ *
+ */
+static inline void blk_ram_store_init(struct blk_ram_store *store)
+{
+	xa_init(&store->pages);
+	init_rwsem(&store->pages_lock);
+}
+
+/**
+ * @brief Allocates the page at the given index, charging it to the device's
+ * memory cgroup.
+ *
+ * Requests may run in any context: the cgroup is made the active one for the
+ * allocation. The page is inserted unless another one was in the meantime,
+ * which is then returned.
+ *
+ * @return the page, or NULL if memory could not be allocated.
+ */
+static inline struct page *blk_ram_alloc_page(struct blk_ram_store *store,
+											  pgoff_t index)
+{
+	struct mem_cgroup *old_memcg = set_active_memcg(store->memcg);
+	struct page *page = alloc_page(GFP_NOIO | __GFP_ZERO | __GFP_ACCOUNT |
+								   __GFP_NOWARN);
+	struct page *cur = NULL;
+
+	if (page)
+		cur = xa_cmpxchg(&store->pages, index, NULL, page,
+						 GFP_NOIO | __GFP_ACCOUNT);
+	set_active_memcg(old_memcg);
+
+	if (!page)
+		return NULL;
+	if (cur)
+	{
+		__free_page(page);
+		return xa_is_err(cur) ? NULL : cur;
+	}
+	atomic_long_inc(&store->nr_pages);
+	return page;
+}
+
+/**
+ * @brief Frees the page at the given index (if any).
+ *
+ * The caller must hold pages_lock for writing.
+ */
+static inline void blk_ram_free_page(struct blk_ram_store *store,
+									 pgoff_t index)
+{
+	struct page *page;
+
+	if (xa_get_mark(&store->pages, index, BLK_RAM_MAYBE_ZERO))
+		atomic_long_dec(&store->nr_maybe_zero);
+	page = xa_erase(&store->pages, index);
+	if (page)
+	{
+		__free_page(page);
+		atomic_long_dec(&store->nr_pages);
+	}
+}
+
+static inline void blk_ram_mark_maybe_zero(struct blk_ram_store *store,
+										   pgoff_t index)
+{
+	if (xa_get_mark(&store->pages, index, BLK_RAM_MAYBE_ZERO))
+		return;
+	xa_lock(&store->pages);
+	if (!xa_get_mark(&store->pages, index, BLK_RAM_MAYBE_ZERO))
+	{
+		__xa_set_mark(&store->pages, index, BLK_RAM_MAYBE_ZERO);
+		atomic_long_inc(&store->nr_maybe_zero);
+	}
+	xa_unlock(&store->pages);
+}
+
+/**
+ * @brief Copies len bytes at offset pos of the device to buf.
+ *
+ * The caller must hold pages_lock for reading.
+ */
+static inline void blk_ram_read(struct blk_ram_store *store, u64 pos,
+								void *buf, size_t len)
+{
+	if (store->mem)
+	{
+		memcpy(buf, store->mem + pos, len);
+		return;
+	}
+	while (len > 0)
+	{
+		size_t offset = offset_in_page(pos);
+		size_t n = min_t(size_t, len, PAGE_SIZE - offset);
+		struct page *page = xa_load(&store->pages, pos >> PAGE_SHIFT);
+
+		if (page)
+			memcpy(buf, page_address(page) + offset, n);
+		else
+			memset(buf, 0, n);
+		pos += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+/**
+ * @brief Copies len bytes from buf to offset pos of the device.
+ *
+ * Zeros written to absent pages are not stored (those pages already read
+ * as zeros), and mark present ones BLK_RAM_MAYBE_ZERO: non-zero data
+ * leaves the page with at least one non-zero byte. The caller must hold
+ * pages_lock for reading.
+ *
+ * @return 0, or -ENOMEM if a page could not be allocated.
+ */
+static inline int blk_ram_write(struct blk_ram_store *store, u64 pos,
+								const void *buf, size_t len)
+{
+	if (store->mem)
+	{
+		memcpy(store->mem + pos, buf, len);
+		return 0;
+	}
+	while (len > 0)
+	{
+		pgoff_t index = pos >> PAGE_SHIFT;
+		size_t offset = offset_in_page(pos);
+		size_t n = min_t(size_t, len, PAGE_SIZE - offset);
+		struct page *page = xa_load(&store->pages, index);
+		bool zeros = !memchr_inv(buf, 0, n);
+
+		if (page || !zeros)
+		{
+			if (!page)
+				page = blk_ram_alloc_page(store, index);
+			if (!page)
+				return -ENOMEM;
+			memcpy(page_address(page) + offset, buf, n);
+			if (zeros)
+				blk_ram_mark_maybe_zero(store, index);
+		}
+		pos += n;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * @brief Zeroes len bytes at offset pos of the device (discards, write
+ * zeroes): the pages entirely covered are freed.
+ *
+ * The caller must hold pages_lock for writing.
+ */
+static inline void blk_ram_zero_range(struct blk_ram_store *store, u64 pos,
+									  u64 len)
+{
+	if (store->mem)
+	{
+		while (len > 0)
+		{
+			size_t n = min_t(u64, len, BLK_RAM_CHUNK);
+
+			memset(store->mem + pos, 0, n);
+			pos += n;
+			len -= n;
+			cond_resched();
+		}
+		return;
+	}
+	while (len > 0)
+	{
+		pgoff_t index = pos >> PAGE_SHIFT;
+		size_t offset = offset_in_page(pos);
+		size_t n = min_t(u64, len, PAGE_SIZE - offset);
+
+		if (n == PAGE_SIZE)
+		{
+			blk_ram_free_page(store, index);
+		}
+		else
+		{
+			struct page *page = xa_load(&store->pages, index);
+			if (page)
+			{
+				memset(page_address(page) + offset, 0, n);
+				blk_ram_mark_maybe_zero(store, index);
+			}
+		}
+		pos += n;
+		len -= n;
+	}
+}
+
+static inline void blk_ram_free_pages(struct blk_ram_store *store)
+{
+	struct page *page;
+	unsigned long index;
+
+	xa_for_each(&store->pages, index, page)
+		blk_ram_free_page(store, index);
+	xa_destroy(&store->pages);
+}
+
+/**
+ * @brief Copies len bytes from offset src to offset dst of the device's
+ * data, a page at a time, straight from page to page.
+ *
+ * Reserved memory is copied BLK_RAM_CHUNK bytes at a time. Otherwise, the
+ * offsets and the length are multiples of the logical block size (the page
+ * size): where the source page is absent, the destination's is freed, and where it
+ * is present, it is copied into the destination's (allocated if needed).
+ *
+ * Overlapping ranges are supported (as with memmove()): pages (or chunks) are
+ * copied front to back when the destination precedes the source, and back to
+ * front otherwise, so that none overwrites source data not yet copied. The
+ * caller must keep requests out (the driver freezes the queue): pages_lock
+ * is held for writing, which only keeps the shrinker out.
+ *
+ */
+static inline int blk_ram_copy_within(struct blk_ram_store *store, u64 dst,
+									  u64 src, u64 len)
+{
+	pgoff_t nr = len >> PAGE_SHIFT;
+	pgoff_t done;
+	u64 off;
+	int ret = 0;
+
+	if (store->mem)
+	{
+		for (off = 0; off < len; off += BLK_RAM_CHUNK)
+		{
+			size_t n = min_t(u64, len - off, BLK_RAM_CHUNK);
+			u64 chunk = dst < src ? off : len - off - n;
+
+			memmove(store->mem + dst + chunk, store->mem + src + chunk, n);
+			cond_resched();
+		}
+		return 0;
+	}
+	if (WARN_ON(!PAGE_ALIGNED(dst | src | len)))
+		return -EINVAL;
+	if (dst == src)
+		return 0;
+
+	down_write(&store->pages_lock);
+	for (done = 0; done < nr; done++)
+	{
+		pgoff_t offset = dst < src ? done : nr - done - 1;
+		pgoff_t src_index = (src >> PAGE_SHIFT) + offset;
+		pgoff_t dst_index = (dst >> PAGE_SHIFT) + offset;
+		struct page *src_page = xa_load(&store->pages, src_index);
+		struct page *dst_page;
+
+		cond_resched();
+		if (!src_page)
+		{
+			blk_ram_free_page(store, dst_index);
+			continue;
+		}
+		dst_page = xa_load(&store->pages, dst_index);
+		if (!dst_page)
+			dst_page = blk_ram_alloc_page(store, dst_index);
+		if (!dst_page)
+		{
+			ret = -ENOMEM;
+			break;
+		}
+		copy_highpage(dst_page, src_page);
+		if (xa_get_mark(&store->pages, src_index, BLK_RAM_MAYBE_ZERO))
+			blk_ram_mark_maybe_zero(store, dst_index);
+	}
+	up_write(&store->pages_lock);
+	return ret;
+}
+
+#endif
@@ -24,6 +24,23 @@
 #include <linux/blkdev.h>
 #include <linux/blk-mq.h>
 #include <linux/idr.h>
+#include <linux/version.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/uaccess.h>
+#include <linux/xarray.h>
+#include <linux/rwsem.h>
+#include <linux/shrinker.h>
+#include <linux/memcontrol.h>
+#include <linux/sched/mm.h>
+#include <linux/cpumask.h>
+#include <linux/smp.h>
+#include <linux/string.h>
+#include <linux/io.h>
+#include <linux/ioport.h>
+
+#include "blkram_ioctl.h"
+#include "blkram_store.h"
 
 // Units
 #define KERNEL_SECTOR_SIZE 512
@@ -31,11 +48,92 @@
 #define B_PER_MB (KB_PER_MB * 1024)
 
 uint32_t capacity_mb = 40;
+module_param(capacity_mb, uint, 0444);
+MODULE_PARM_DESC(capacity_mb, "Capacity of the device, in MiB (default: 40)");
+
+// Reserved memory
+
+static unsigned long phys_addr = 0;
+module_param(phys_addr, ulong, 0444);
+MODULE_PARM_DESC(phys_addr, "Physical address of a reserved memory range (capacity_mb long) holding the data, instead of allocated pages (default: 0, none)");
 uint32_t max_segments = 32;
 uint32_t max_segment_size = 65536;
 uint32_t lbs = PAGE_SIZE;
 uint32_t pbs = PAGE_SIZE;
 
+// Queue parameters
+
+uint32_t nr_hw_queues = 1;
+module_param(nr_hw_queues, uint, 0444);
+MODULE_PARM_DESC(nr_hw_queues, "Number of hardware queues (default: 1, at most the number of CPUs)");
+
+uint32_t queue_depth = 128;
+module_param(queue_depth, uint, 0444);
+MODULE_PARM_DESC(queue_depth, "Number of tags per hardware queue, or in total if shared_tags is set (default: 128)");
+
+static bool shared_tags = false;
+module_param(shared_tags, bool, 0444);
+MODULE_PARM_DESC(shared_tags, "Share a single set of tags between the hardware queues (default: false)");
+
+static char *completion = "inline";
+module_param(completion, charp, 0444);
+MODULE_PARM_DESC(completion, "Where requests complete: inline (default), submit or softirq (both with nr_hw_queues=1), or cpus");
+
+static char *complete_cpus = "";
+module_param(complete_cpus, charp, 0444);
+MODULE_PARM_DESC(complete_cpus, "CPUs requests complete on, as a CPU list (e.g. 0-3,8), with completion=cpus");
+
+/**
+ * @brief Where requests complete.
+ *
+ * - inline: in queue_rq, on the CPU that dispatched the request (usually the
+ *           submitter's, or kblockd's when dispatch is deferred).
+ * - submit: in softirq context, on the CPU that submitted the request (the
+ *           completion is sent there if needed).
+ * - softirq: in softirq context, on the CPU that dispatched the request.
+ * - cpus: in interrupt context, on an online CPU of complete_cpus (one on
+ *         the dispatching CPU's NUMA node if any, requests being spread
+ *         over those).
+ *
+ * submit and softirq require a single hardware queue: blk-mq only defers
+ * completions to softirq context in that case.
+ *
+ */
+enum blk_ram_completion
+{
+	BLK_RAM_COMPLETE_INLINE,
+	BLK_RAM_COMPLETE_SUBMIT,
+	BLK_RAM_COMPLETE_SOFTIRQ,
+	BLK_RAM_COMPLETE_CPUS,
+};
+
+static const char *const blk_ram_completion_names[] = {
+	"inline",
+	"submit",
+	"softirq",
+	"cpus",
+};
+
+/**
+ * @brief Per-request data (allocated by blk-mq along with each request).
+ *
+ */
+struct blk_ram_cmd
+{
+	/**
+	 * @brief Status the request completes with, when completion is
+	 * deferred.
+	 *
+	 */
+	blk_status_t status;
+
+	/**
+	 * @brief Sends the completion to another CPU (completion=cpus).
+	 *
+	 */
+	call_single_data_t csd;
+};
+
 /**
  * @brief Struct used to preserve the driver's in-memory state.
  *
@@ -49,12 +147,32 @@ struct blk_ram_dev_t
 	sector_t capacity_num_sectors;
 
 	/**
-	 * @brief The driver's data (kept in memory).
+	 * @brief The driver's data (see blkram_store.h).
 	 *
 	 */
-	u8 *data;
+	struct blk_ram_store store;
+
+	/**
+	 * @brief Frees stored pages that hold only zeros, under memory pressure
+	 * (not registered with reserved memory).
+	 *
+	 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	struct shrinker *shrinker;
+#else
+	struct shrinker shrinker;
+#endif
+
 	struct blk_mq_tag_set tag_set;
 
+	/**
+	 * @brief Where requests complete, and on which CPUs with
+	 * BLK_RAM_COMPLETE_CPUS.
+	 *
+	 */
+	enum blk_ram_completion completion;
+	cpumask_var_t complete_cpus;
+
 	/**
 	 * @brief Corresponds to "our" RAM disk device.
 	 *
@@ -83,6 +201,242 @@ static int major;
 static DEFINE_IDA(blk_ram_indexes);
 static struct blk_ram_dev_t *blk_ram_dev = NULL;
 
+// ============================================================================
+// Memory pressure
+
+/**
+ * The data being in memory only, the pages that can be reclaimed without
+ * losing any are those holding only zeros (they read the same once freed).
+ * The shrinker looks at the pages zeros were written to since it last
+ * scanned them (only those may hold only zeros: their number is what it
+ * reports as freeable), frees those that hold only zeros, and unmarks the
+ * others. It never waits for requests: if they hold pages_lock, it gives up
+ * until the next call.
+ *
+ * The shrinker is not memory cgroup aware (that requires the pages to be
+ * kept in a list_lru): it runs on global memory pressure.
+ */
+
+static struct blk_ram_dev_t *blk_ram_from_shrinker(struct shrinker *shrinker)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	return shrinker->private_data;
+#else
+	return container_of(shrinker, struct blk_ram_dev_t, shrinker);
+#endif
+}
+
+static unsigned long blk_ram_shrink_count(struct shrinker *shrinker,
+										  struct shrink_control *sc)
+{
+	struct blk_ram_dev_t *blkram = blk_ram_from_shrinker(shrinker);
+	unsigned long count = atomic_long_read(&blkram->store.nr_maybe_zero);
+
+	return count ? count : SHRINK_EMPTY;
+}
+
+static unsigned long blk_ram_shrink_scan(struct shrinker *shrinker,
+										 struct shrink_control *sc)
+{
+	struct blk_ram_dev_t *blkram = blk_ram_from_shrinker(shrinker);
+	unsigned long scanned = 0;
+	unsigned long freed = 0;
+	unsigned long index;
+	struct page *page;
+
+	if (!down_write_trylock(&blkram->store.pages_lock))
+		return SHRINK_STOP;
+	xa_for_each_marked(&blkram->store.pages, index, page, BLK_RAM_MAYBE_ZERO)
+	{
+		if (scanned == sc->nr_to_scan)
+			break;
+		scanned++;
+		if (memchr_inv(page_address(page), 0, PAGE_SIZE))
+		{
+			xa_clear_mark(&blkram->store.pages, index, BLK_RAM_MAYBE_ZERO);
+			atomic_long_dec(&blkram->store.nr_maybe_zero);
+		}
+		else
+		{
+			blk_ram_free_page(&blkram->store, index);
+			freed++;
+		}
+	}
+	up_write(&blkram->store.pages_lock);
+
+	sc->nr_scanned = scanned;
+	pr_debug("Scanned %lu pages, freed %lu", scanned, freed);
+	return freed;
+}
+
+static int blk_ram_shrinker_register(struct blk_ram_dev_t *blkram)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	blkram->shrinker = shrinker_alloc(0, "blkram");
+	if (!blkram->shrinker)
+		return -ENOMEM;
+	blkram->shrinker->count_objects = blk_ram_shrink_count;
+	blkram->shrinker->scan_objects = blk_ram_shrink_scan;
+	blkram->shrinker->private_data = blkram;
+	shrinker_register(blkram->shrinker);
+	return 0;
+#else
+	blkram->shrinker.count_objects = blk_ram_shrink_count;
+	blkram->shrinker.scan_objects = blk_ram_shrink_scan;
+	blkram->shrinker.seeks = DEFAULT_SEEKS;
+	return register_shrinker(&blkram->shrinker, "blkram");
+#endif
+}
+
+static void blk_ram_shrinker_unregister(struct blk_ram_dev_t *blkram)
+{
+	if (blkram->store.mem)
+		return;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	shrinker_free(blkram->shrinker);
+#else
+	unregister_shrinker(&blkram->shrinker);
+#endif
+}
+
+// Memory use is reported under /sys/block/blkram/:
+// - stored_bytes: memory held by the stored pages;
+// - reclaimable_bytes: part of it that the shrinker may free (pages marked
+//   BLK_RAM_MAYBE_ZERO, which it frees if they still hold only zeros);
+// - pinned_bytes: the rest.
+// They are read from the store's counters, without scanning the pages.
+// With reserved memory, no pages are stored: all read 0.
+
+static ssize_t blk_ram_stored_bytes_show(struct device *dev,
+										 struct device_attribute *attr,
+										 char *buf)
+{
+	struct blk_ram_dev_t *blkram = dev_to_disk(dev)->private_data;
+
+	return sysfs_emit(buf, "%lu\n",
+					  atomic_long_read(&blkram->store.nr_pages) << PAGE_SHIFT);
+}
+
+static ssize_t blk_ram_reclaimable_bytes_show(struct device *dev,
+											  struct device_attribute *attr,
+											  char *buf)
+{
+	struct blk_ram_dev_t *blkram = dev_to_disk(dev)->private_data;
+
+	return sysfs_emit(buf, "%lu\n",
+					  atomic_long_read(&blkram->store.nr_maybe_zero)
+						  << PAGE_SHIFT);
+}
+
+static ssize_t blk_ram_pinned_bytes_show(struct device *dev,
+										 struct device_attribute *attr,
+										 char *buf)
+{
+	struct blk_ram_dev_t *blkram = dev_to_disk(dev)->private_data;
+	long nr_maybe_zero = atomic_long_read(&blkram->store.nr_maybe_zero);
+	long nr_pages = atomic_long_read(&blkram->store.nr_pages);
+
+	return sysfs_emit(buf, "%lu\n",
+					  (unsigned long)max(nr_pages - nr_maybe_zero, 0L)
+						  << PAGE_SHIFT);
+}
+
+static struct device_attribute blk_ram_attr_stored_bytes =
+	__ATTR(stored_bytes, 0444, blk_ram_stored_bytes_show, NULL);
+static struct device_attribute blk_ram_attr_reclaimable_bytes =
+	__ATTR(reclaimable_bytes, 0444, blk_ram_reclaimable_bytes_show, NULL);
+static struct device_attribute blk_ram_attr_pinned_bytes =
+	__ATTR(pinned_bytes, 0444, blk_ram_pinned_bytes_show, NULL);
+
+static struct attribute *blk_ram_attrs[] = {
+	&blk_ram_attr_stored_bytes.attr,
+	&blk_ram_attr_reclaimable_bytes.attr,
+	&blk_ram_attr_pinned_bytes.attr,
+	NULL,
+};
+
+static const struct attribute_group blk_ram_attr_group = {
+	.attrs = blk_ram_attrs,
+};
+
+static const struct attribute_group *blk_ram_attr_groups[] = {
+	&blk_ram_attr_group,
+	NULL,
+};
+
+// ============================================================================
+// Requests
+
+static void blk_ram_complete_rq(struct request *rq)
+{
+	struct blk_ram_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	blk_mq_end_request(rq, cmd->status);
+}
+
+static void blk_ram_complete_csd(void *data)
+{
+	blk_ram_complete_rq(data);
+}
+
+static int blk_ram_init_request(struct blk_mq_tag_set *set, struct request *rq,
+								unsigned int hctx_idx, unsigned int numa_node)
+{
+	struct blk_ram_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	INIT_CSD(&cmd->csd, blk_ram_complete_csd, rq);
+	return 0;
+}
+
+/**
+ * @brief Returns the online CPU of complete_cpus to complete a request on:
+ * preferably one on the current NUMA node (sharing its memory, and possibly
+ * caches), requests being spread over the candidates.
+ *
+ * Node masks may include offline CPUs: a local candidate that is offline is
+ * replaced by another local one, if any is online.
+ *
+ */
+static unsigned int blk_ram_complete_cpu(struct blk_ram_dev_t *blkram)
+{
+	const struct cpumask *node_cpus = cpumask_of_node(numa_node_id());
+	unsigned int cpu = cpumask_any_and_distribute(blkram->complete_cpus,
+												  node_cpus);
+
+	if (cpu < nr_cpu_ids && cpu_online(cpu))
+		return cpu;
+	for_each_cpu_and(cpu, blkram->complete_cpus, node_cpus)
+	{
+		if (cpu_online(cpu))
+			return cpu;
+	}
+	return cpumask_any_and_distribute(blkram->complete_cpus, cpu_online_mask);
+}
+
+static void blk_ram_end_request(struct blk_ram_dev_t *blkram,
+								struct request *rq, blk_status_t err)
+{
+	struct blk_ram_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	cmd->status = err;
+	switch (blkram->completion)
+	{
+	case BLK_RAM_COMPLETE_SUBMIT:
+	case BLK_RAM_COMPLETE_SOFTIRQ:
+		// Calls blk_ram_complete_rq, where the queue flags say (see init).
+		blk_mq_complete_request(rq);
+		break;
+	case BLK_RAM_COMPLETE_CPUS:
+		// Completing inline if no CPU of the set is online.
+		if (smp_call_function_single_async(blk_ram_complete_cpu(blkram),
+										   &cmd->csd))
+			blk_ram_complete_rq(rq);
+		break;
+	default:
+		blk_ram_complete_rq(rq);
+	}
+}
+
 static blk_status_t blk_ram_queue_rq(struct blk_mq_hw_ctx *hctx,
 									 const struct blk_mq_queue_data *bd)
 {
@@ -105,49 +459,221 @@ static blk_status_t blk_ram_queue_rq(struct blk_mq_hw_ctx *hctx,
 
 	blk_mq_start_request(rq);
 
-	rq_for_each_segment(bv, rq, iter)
+	switch (req_op(rq))
 	{
-		unsigned int len = bv.bv_len;
-		void *buf = page_address(bv.bv_page) + bv.bv_offset;
-
-		// Ensure requested length is within device's capacity.
-		if (pos + len > capacity_bytes)
+	case REQ_OP_READ:
+	case REQ_OP_WRITE:
+		down_read(&blkram->store.pages_lock);
+		rq_for_each_segment(bv, rq, iter)
 		{
-			err = BLK_STS_IOERR;
-			break;
+			unsigned int len = bv.bv_len;
+			void *buf = page_address(bv.bv_page) + bv.bv_offset;
+
+			// Ensure requested length is within device's capacity.
+			// (rq_for_each_segment is a nested loop: errors jump out of it.)
+			if (pos + len > capacity_bytes)
+			{
+				err = BLK_STS_IOERR;
+				goto unlock;
+			}
+
+			if (req_op(rq) == REQ_OP_READ)
+			{
+				blk_ram_read(&blkram->store, pos, buf, len);
+			}
+			else if (blk_ram_write(&blkram->store, pos, buf, len))
+			{
+				err = BLK_STS_RESOURCE;
+				goto unlock;
+			}
+			pos += len;
 		}
-
-		switch (req_op(rq))
+	unlock:
+		up_read(&blkram->store.pages_lock);
+		break;
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		if (pos + blk_rq_bytes(rq) > capacity_bytes)
 		{
-		case REQ_OP_READ:
-			memcpy(buf, blkram->data + pos, len);
-			break;
-		case REQ_OP_WRITE:
-			memcpy(blkram->data + pos, buf, len);
-			break;
-		default:
 			err = BLK_STS_IOERR;
-			goto end_request;
+			break;
 		}
-		pos += len;
+		// Freeing pages excludes any other access to them.
+		down_write(&blkram->store.pages_lock);
+		blk_ram_zero_range(&blkram->store, pos, blk_rq_bytes(rq));
+		up_write(&blkram->store.pages_lock);
+		break;
+	default:
+		err = BLK_STS_IOERR;
 	}
 
-end_request:
 	if (err != BLK_STS_OK)
 		pr_debug("Error handling block request: 0x%x", err);
 	pr_debug("-> Finished handling block request");
-	blk_mq_end_request(rq, err);
+	blk_ram_end_request(blkram, rq, err);
 	return BLK_STS_OK;
 }
 
 static const struct blk_mq_ops blk_ram_mq_ops = {
 	.queue_rq = blk_ram_queue_rq,
+	.complete = blk_ram_complete_rq,
+	.init_request = blk_ram_init_request,
 };
 
+// ============================================================================
+// ioctl
+
+/**
+ * @brief Handles BLKRAM_IOCTL_COPY (see blkram_ioctl.h).
+ *
+ * The page cache sits above the driver: dirty pages of both ranges are
+ * written back before copying (the source must be current, and writeback of
+ * the destination must not overwrite the copy), and the destination's pages
+ * are invalidated after. The queue is frozen during the copy: in-flight
+ * requests complete first, and new ones wait for the copy to be done.
+ *
+ */
+static int blk_ram_copy_range(struct block_device *bdev,
+							  struct blk_ram_dev_t *blkram,
+							  const struct blkram_copy_range *range)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+	struct address_space *mapping = bdev->bd_mapping;
+#else
+	struct address_space *mapping = bdev->bd_inode->i_mapping;
+#endif
+	struct request_queue *q = blkram->disk->queue;
+	u64 capacity_bytes = (u64)blkram->capacity_num_sectors << SECTOR_SHIFT;
+	unsigned int block_size = bdev_logical_block_size(bdev);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+	unsigned int memflags;
+#endif
+	int invalidated;
+	int ret;
+
+	if (range->len == 0)
+		return 0;
+	if (!IS_ALIGNED(range->src | range->dst | range->len, block_size))
+		return -EINVAL;
+	if (range->len > capacity_bytes ||
+		range->src > capacity_bytes - range->len ||
+		range->dst > capacity_bytes - range->len)
+		return -EINVAL;
+
+	ret = filemap_write_and_wait_range(mapping, range->src,
+									   range->src + range->len - 1);
+	if (ret)
+		return ret;
+	ret = filemap_write_and_wait_range(mapping, range->dst,
+									   range->dst + range->len - 1);
+	if (ret)
+		return ret;
+
+	pr_debug("Copying %llu bytes from 0x%llx to 0x%llx", range->len,
+			 range->src, range->dst);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+	// Freezing also makes allocations NOIO until unfrozen.
+	memflags = blk_mq_freeze_queue(q);
+	ret = blk_ram_copy_within(&blkram->store, range->dst, range->src, range->len);
+	blk_mq_unfreeze_queue(q, memflags);
+#else
+	blk_mq_freeze_queue(q);
+	ret = blk_ram_copy_within(&blkram->store, range->dst, range->src, range->len);
+	blk_mq_unfreeze_queue(q);
+#endif
+
+	// Even a partial copy changed the destination.
+	invalidated = invalidate_inode_pages2_range(mapping, range->dst >> PAGE_SHIFT,
+												(range->dst + range->len - 1) >> PAGE_SHIFT);
+	return ret ? ret : invalidated;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+static int blk_ram_ioctl(struct block_device *bdev, blk_mode_t mode,
+						 unsigned int cmd, unsigned long arg)
+{
+	bool writable = mode & BLK_OPEN_WRITE;
+#else
+static int blk_ram_ioctl(struct block_device *bdev, fmode_t mode,
+						 unsigned int cmd, unsigned long arg)
+{
+	bool writable = mode & FMODE_WRITE;
+#endif
+	struct blk_ram_dev_t *blkram = bdev->bd_disk->private_data;
+	struct blkram_copy_range range;
+
+	switch (cmd)
+	{
+	case BLKRAM_IOCTL_COPY:
+		if (!writable)
+			return -EBADF;
+		if (copy_from_user(&range, (void __user *)arg, sizeof(range)))
+			return -EFAULT;
+		return blk_ram_copy_range(bdev, blkram, &range);
+	default:
+		return -ENOTTY;
+	}
+}
+
 static const struct block_device_operations blk_ram_rq_ops = {
 	.owner = THIS_MODULE,
+	.ioctl = blk_ram_ioctl,
+	.compat_ioctl = blkdev_compat_ptr_ioctl,
 };
 
+// ============================================================================
+// Reserved memory
+
+/**
+ * @brief Maps the reserved memory range holding the data.
+ *
+ * The range must be page-aligned, and must not overlap memory managed by
+ * the kernel ("System RAM"): memremap() would otherwise return the kernel's
+ * own mapping of pages the page allocator hands out. It is claimed (in
+ * /proc/iomem) while the module is loaded. Its content is left as is.
+ *
+ */
+static int blk_ram_map_reserved(struct blk_ram_dev_t *blkram, u64 size)
+{
+	if (!PAGE_ALIGNED(phys_addr) || !PAGE_ALIGNED(size))
+	{
+		pr_err("phys_addr and capacity must be page-aligned");
+		return -EINVAL;
+	}
+	if (region_intersects(phys_addr, size, IORESOURCE_SYSTEM_RAM,
+						  IORES_DESC_NONE) != REGION_DISJOINT)
+	{
+		pr_err("Range 0x%lx-0x%llx overlaps system RAM", phys_addr,
+			   phys_addr + size - 1);
+		return -EINVAL;
+	}
+	if (!request_mem_region(phys_addr, size, "blkram"))
+	{
+		pr_err("Range 0x%lx-0x%llx is in use", phys_addr,
+			   phys_addr + size - 1);
+		return -EBUSY;
+	}
+	blkram->store.mem = memremap(phys_addr, size, MEMREMAP_WB);
+	if (!blkram->store.mem)
+	{
+		pr_err("Error mapping range 0x%lx-0x%llx", phys_addr,
+			   phys_addr + size - 1);
+		release_mem_region(phys_addr, size);
+		return -ENOMEM;
+	}
+	pr_notice("Using reserved memory at 0x%lx (%llu bytes)", phys_addr, size);
+	return 0;
+}
+
+static void blk_ram_unmap_reserved(struct blk_ram_dev_t *blkram, u64 size)
+{
+	if (!blkram->store.mem)
+		return;
+	memunmap(blkram->store.mem);
+	release_mem_region(phys_addr, size);
+	blkram->store.mem = NULL;
+}
+
 // ============================================================================
 // Lifecycle
 
@@ -167,7 +693,19 @@ static int __init blk_ram_init(void)
 	int ret = 0;
 	int minor;
 	struct gendisk *disk;
-	uint64_t capacity_bytes = capacity_mb * B_PER_MB; //capacity_mb >> 20;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+	struct queue_limits lim = {
+		.logical_block_size = lbs,
+		.physical_block_size = pbs,
+		.max_segments = max_segments,
+		.max_segment_size = max_segment_size,
+		// Discarded (or zeroed) whole pages are freed.
+		.discard_granularity = PAGE_SIZE,
+		.max_hw_discard_sectors = UINT_MAX >> SECTOR_SHIFT,
+		.max_write_zeroes_sectors = UINT_MAX >> SECTOR_SHIFT,
+	};
+#endif
+	uint64_t capacity_bytes = (uint64_t)capacity_mb * B_PER_MB; //capacity_mb >> 20;
 	pr_notice("capacity_mb=0x%x (%u)", capacity_mb, capacity_mb);
 	pr_notice("capacity_bytes=0x%llx (%llu)", capacity_bytes, capacity_bytes);
 
@@ -192,46 +730,137 @@ static int __init blk_ram_init(void)
 
 	// Capacity in number of sectors
 	blk_ram_dev->capacity_num_sectors = capacity_bytes >> SECTOR_SHIFT;
-	blk_ram_dev->data = kvmalloc(capacity_bytes, GFP_KERNEL);
 	pr_notice("blk_ram_dev->capacity_num_sectors: %llu", blk_ram_dev->capacity_num_sectors);
 
-	if (blk_ram_dev->data == NULL)
+	// Pages are allocated as they are written, and charged to the memory
+	// cgroup of the process loading the module, unless the data is in
+	// reserved memory (which has nothing to charge, nor to reclaim).
+	blk_ram_store_init(&blk_ram_dev->store);
+	if (phys_addr)
+	{
+		ret = blk_ram_map_reserved(blk_ram_dev, capacity_bytes);
+		if (ret)
+			goto data_err;
+	}
+	else
+	{
+		blk_ram_dev->store.memcg = get_mem_cgroup_from_mm(current->mm);
+	}
+
+	ret = match_string(blk_ram_completion_names,
+					   ARRAY_SIZE(blk_ram_completion_names), completion);
+	if (ret < 0)
+	{
+		pr_err("Invalid completion: %s", completion);
+		goto data_err;
+	}
+	blk_ram_dev->completion = ret;
+	// blk-mq only defers completions to softirq context with a single
+	// hardware queue (or when they must be sent to another CPU): with
+	// several, submit and softirq would silently complete inline.
+	nr_hw_queues = clamp_t(uint32_t, nr_hw_queues, 1, nr_cpu_ids);
+	if ((blk_ram_dev->completion == BLK_RAM_COMPLETE_SUBMIT ||
+		 blk_ram_dev->completion == BLK_RAM_COMPLETE_SOFTIRQ) &&
+		nr_hw_queues > 1)
+	{
+		pr_err("completion=%s requires nr_hw_queues=1", completion);
+		ret = -EINVAL;
+		goto data_err;
+	}
+	if (!zalloc_cpumask_var(&blk_ram_dev->complete_cpus, GFP_KERNEL))
 	{
-		pr_err("memory allocation failed for the RAM disk");
 		ret = -ENOMEM;
 		goto data_err;
 	}
+	if (blk_ram_dev->completion == BLK_RAM_COMPLETE_CPUS)
+	{
+		ret = cpulist_parse(complete_cpus, blk_ram_dev->complete_cpus);
+		if (ret || !cpumask_intersects(blk_ram_dev->complete_cpus, cpu_online_mask))
+		{
+			pr_err("Invalid complete_cpus (no online CPU): %s", complete_cpus);
+			ret = -EINVAL;
+			goto data_err;
+		}
+	}
+
+	if (!blk_ram_dev->store.mem)
+	{
+		ret = blk_ram_shrinker_register(blk_ram_dev);
+		if (ret)
+		{
+			pr_err("Error registering the shrinker");
+			goto data_err;
+		}
+	}
 
 	// Initializing tag set
 	memset(&blk_ram_dev->tag_set, 0, sizeof(blk_ram_dev->tag_set));
 	blk_ram_dev->tag_set.ops = &blk_ram_mq_ops;
-	blk_ram_dev->tag_set.queue_depth = 128;
+	blk_ram_dev->tag_set.queue_depth = queue_depth;
 	blk_ram_dev->tag_set.numa_node = NUMA_NO_NODE;
-	blk_ram_dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
-	blk_ram_dev->tag_set.cmd_size = 0;
+	// Requests may sleep (allocating pages, or waiting for the shrinker to
+	// release pages_lock).
+	blk_ram_dev->tag_set.flags = BLK_MQ_F_BLOCKING;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 14, 0)
+	// Merging is always on from 6.14.
+	blk_ram_dev->tag_set.flags |= BLK_MQ_F_SHOULD_MERGE;
+#endif
+	if (shared_tags)
+		blk_ram_dev->tag_set.flags |= BLK_MQ_F_TAG_HCTX_SHARED;
+	blk_ram_dev->tag_set.cmd_size = sizeof(struct blk_ram_cmd);
 	blk_ram_dev->tag_set.driver_data = blk_ram_dev;
-	blk_ram_dev->tag_set.nr_hw_queues = 1;
+	blk_ram_dev->tag_set.nr_hw_queues = nr_hw_queues;
+	pr_notice("Queues: %u x %u tags%s, completion: %s",
+			  blk_ram_dev->tag_set.nr_hw_queues, queue_depth,
+			  shared_tags ? " (shared)" : "", completion);
 
 	ret = blk_mq_alloc_tag_set(&blk_ram_dev->tag_set);
 	if (ret)
-		goto data_err;
+		goto shrinker_err;
 
-	// Allocating struct gendisk instance
+	// Allocating struct gendisk instance (along with its queue's limits from
+	// 6.9 on; older kernels get them set on the queue below)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+	disk = blk_ram_dev->disk =
+		blk_mq_alloc_disk(&blk_ram_dev->tag_set, &lim, blk_ram_dev);
+#else
 	disk = blk_ram_dev->disk =
 		blk_mq_alloc_disk(&blk_ram_dev->tag_set, blk_ram_dev);
-
-	blk_queue_logical_block_size(disk->queue, lbs);
-	blk_queue_physical_block_size(disk->queue, pbs);
-	blk_queue_max_segments(disk->queue, max_segments);
-	blk_queue_max_segment_size(disk->queue, max_segment_size);
+#endif
 
 	if (IS_ERR(disk))
 	{
 		ret = PTR_ERR(disk);
+		blk_ram_dev->disk = NULL;
 		pr_err("Error allocating a disk");
 		goto tagset_err;
 	}
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 9, 0)
+	blk_queue_logical_block_size(disk->queue, lbs);
+	blk_queue_physical_block_size(disk->queue, pbs);
+	blk_queue_max_segments(disk->queue, max_segments);
+	blk_queue_max_segment_size(disk->queue, max_segment_size);
+	// Discarded (or zeroed) whole pages are freed.
+	disk->queue->limits.discard_granularity = PAGE_SIZE;
+	blk_queue_max_discard_sectors(disk->queue, UINT_MAX >> SECTOR_SHIFT);
+	blk_queue_max_write_zeroes_sectors(disk->queue, UINT_MAX >> SECTOR_SHIFT);
+#endif
+
+	// Deferred completions run where blk-mq sends them: on the submitting
+	// CPU when QUEUE_FLAG_SAME_FORCE is set, and on the completing CPU
+	// when QUEUE_FLAG_SAME_COMP is not (see rq_affinity in the queue's
+	// sysfs directory, which can still be changed afterwards).
+	if (blk_ram_dev->completion == BLK_RAM_COMPLETE_SUBMIT)
+	{
+		blk_queue_flag_set(QUEUE_FLAG_SAME_COMP, disk->queue);
+		blk_queue_flag_set(QUEUE_FLAG_SAME_FORCE, disk->queue);
+	}
+	else if (blk_ram_dev->completion == BLK_RAM_COMPLETE_SOFTIRQ)
+	{
+		blk_queue_flag_clear(QUEUE_FLAG_SAME_COMP, disk->queue);
+	}
+
 	// This is not necessary as we don't support partitions, and creating
 	// more RAM backed devices with the existing module
 	minor = ret = ida_alloc(&blk_ram_indexes, GFP_KERNEL);
@@ -243,6 +872,7 @@ static int __init blk_ram_init(void)
 	disk->minors = 1;
 	snprintf(disk->disk_name, DISK_NAME_LEN, "blkram");
 	disk->fops = &blk_ram_rq_ops;
+	disk->private_data = blk_ram_dev;
 	disk->flags = GENHD_FL_NO_PART;
 	set_capacity(disk, blk_ram_dev->capacity_num_sectors);
 
@@ -251,7 +881,8 @@ static int __init blk_ram_init(void)
 	pr_notice("- first_minor: %d", disk->first_minor);
 	pr_notice("- minors: %d", disk->minors);
 
-	ret = add_disk(disk);
+	// Memory use is reported through the disk's sysfs attributes.
+	ret = device_add_disk(NULL, disk, blk_ram_attr_groups);
 	if (ret < 0)
 		goto cleanup_disk;
 
@@ -261,8 +892,14 @@ static int __init blk_ram_init(void)
 cleanup_disk:
 	put_disk(blk_ram_dev->disk);
 tagset_err:
-	kfree(blk_ram_dev->data);
+	blk_mq_free_tag_set(&blk_ram_dev->tag_set);
+shrinker_err:
+	blk_ram_shrinker_unregister(blk_ram_dev);
 data_err:
+	blk_ram_unmap_reserved(blk_ram_dev, capacity_bytes);
+	free_cpumask_var(blk_ram_dev->complete_cpus);
+	blk_ram_free_pages(&blk_ram_dev->store);
+	mem_cgroup_put(blk_ram_dev->store.memcg);
 	kfree(blk_ram_dev);
 unregister_blkdev:
 	unregister_blkdev(major, "blkram");
@@ -279,6 +916,13 @@ static void __exit blk_ram_exit(void)
 		del_gendisk(blk_ram_dev->disk);
 		put_disk(blk_ram_dev->disk);
 	}
+	blk_mq_free_tag_set(&blk_ram_dev->tag_set);
+	blk_ram_shrinker_unregister(blk_ram_dev);
+	blk_ram_unmap_reserved(blk_ram_dev,
+						   (u64)blk_ram_dev->capacity_num_sectors << SECTOR_SHIFT);
+	free_cpumask_var(blk_ram_dev->complete_cpus);
+	blk_ram_free_pages(&blk_ram_dev->store);
+	mem_cgroup_put(blk_ram_dev->store.memcg);
 	unregister_blkdev(major, "blkram");
 	kfree(blk_ram_dev);
 
@@ -0,0 +1,404 @@
+/**
+ * @file ramdrv_kunit.c
+ * @author yduchesne
+ * @brief Tests and benchmarks of the blkram data store (blkram_store.h).
+ *
+ * The store is exercised on its own, without a disk: each case gets an empty
+ * store, kept in pages (or in a buffer standing for reserved memory), and a
+ * reference buffer that every operation is mirrored into.
+ *
+ * Benchmarks only run when the module is loaded with bench=1.
+ *
+ */
+
+#include <kunit/test.h>
+#include <linux/module.h>
+#include <linux/random.h>
+
+#include "blkram_store.h"
+#include "../common/drv_bench.h"
+
+MODULE_AUTHOR("yduchesne");
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Tests and benchmarks of the blkram data store");
+
+static bool bench;
+module_param(bench, bool, 0444);
+MODULE_PARM_DESC(bench, "Run the timed benchmarks (blk_ram_store_bench suite)");
+
+// ============================================================================
+// Fixture
+
+#define BLK_RAM_KUNIT_PAGES 16
+#define BLK_RAM_KUNIT_SIZE (BLK_RAM_KUNIT_PAGES * PAGE_SIZE)
+#define BLK_RAM_KUNIT_ROUNDS 500
+
+/**
+ * @brief A store, and what it is expected to hold.
+ *
+ */
+struct blk_ram_kunit
+{
+	struct blk_ram_store store;
+	u8 *expected;
+	u8 *buf;
+};
+
+static int blk_ram_kunit_init(struct kunit *test)
+{
+	struct blk_ram_kunit *ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+
+	if (!ctx)
+		return -ENOMEM;
+	ctx->expected = kunit_kzalloc(test, BLK_RAM_KUNIT_SIZE, GFP_KERNEL);
+	ctx->buf = kunit_kzalloc(test, BLK_RAM_KUNIT_SIZE, GFP_KERNEL);
+	if (!ctx->expected || !ctx->buf)
+		return -ENOMEM;
+	blk_ram_store_init(&ctx->store);
+	test->priv = ctx;
+	return 0;
+}
+
+static void blk_ram_kunit_exit(struct kunit *test)
+{
+	struct blk_ram_kunit *ctx = test->priv;
+
+	blk_ram_free_pages(&ctx->store);
+}
+
+/**
+ * @brief Keeps the data in a buffer, as with reserved memory.
+ *
+ */
+static void blk_ram_kunit_use_mem(struct kunit *test)
+{
+	struct blk_ram_kunit *ctx = test->priv;
+
+	ctx->store.mem = kunit_kzalloc(test, BLK_RAM_KUNIT_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ctx->store.mem);
+}
+
+/**
+ * @brief Checks that the store reads as expected, and that its pages are
+ * accounted for: every page that is not marked BLK_RAM_MAYBE_ZERO must hold
+ * some non-zero data.
+ *
+ */
+static void blk_ram_kunit_verify(struct kunit *test)
+{
+	struct blk_ram_kunit *ctx = test->priv;
+	struct blk_ram_store *store = &ctx->store;
+	unsigned long nr_pages = 0;
+	unsigned long nr_maybe_zero = 0;
+	unsigned long index;
+	struct page *page;
+
+	down_read(&store->pages_lock);
+	blk_ram_read(store, 0, ctx->buf, BLK_RAM_KUNIT_SIZE);
+	up_read(&store->pages_lock);
+	KUNIT_ASSERT_EQ_MSG(test, memcmp(ctx->buf, ctx->expected,
+									 BLK_RAM_KUNIT_SIZE), 0,
+						"the store does not read as expected");
+
+	xa_for_each(&store->pages, index, page)
+	{
+		nr_pages++;
+		if (xa_get_mark(&store->pages, index, BLK_RAM_MAYBE_ZERO))
+			nr_maybe_zero++;
+		else
+			KUNIT_EXPECT_TRUE_MSG(test,
+								  memchr_inv(page_address(page), 0,
+											 PAGE_SIZE) != NULL,
+								  "page %lu is unmarked, but zero", index);
+	}
+	KUNIT_EXPECT_EQ(test, nr_pages, atomic_long_read(&store->nr_pages));
+	KUNIT_EXPECT_EQ(test, nr_maybe_zero,
+					atomic_long_read(&store->nr_maybe_zero));
+}
+
+/**
+ * @brief Picks a range of the device: mostly small and unaligned, some
+ * spanning several pages, and some zero-length.
+ *
+ */
+static void blk_ram_kunit_range(u64 *pos, size_t *len)
+{
+	*pos = get_random_u32() % BLK_RAM_KUNIT_SIZE;
+	switch (get_random_u32() % 4)
+	{
+	case 0:
+		*len = get_random_u32() % 64;
+		break;
+	case 1:
+		*len = get_random_u32() % (3 * PAGE_SIZE);
+		break;
+	default:
+		*len = get_random_u32() % PAGE_SIZE;
+	}
+	*len = min_t(u64, *len, BLK_RAM_KUNIT_SIZE - *pos);
+}
+
+/**
+ * @brief Applies random writes (of data, or of zeros) and zeroed ranges,
+ * checking the whole store after each.
+ *
+ */
+static void blk_ram_kunit_writes(struct kunit *test)
+{
+	struct blk_ram_kunit *ctx = test->priv;
+	struct blk_ram_store *store = &ctx->store;
+	unsigned int round;
+
+	for (round = 0; round < BLK_RAM_KUNIT_ROUNDS; round++)
+	{
+		unsigned int op = get_random_u32() % 3;
+		u64 pos;
+		size_t len;
+
+		blk_ram_kunit_range(&pos, &len);
+		if (op == 2)
+		{
+			down_write(&store->pages_lock);
+			blk_ram_zero_range(store, pos, len);
+			up_write(&store->pages_lock);
+			memset(ctx->expected + pos, 0, len);
+		}
+		else
+		{
+			if (op == 0)
+				get_random_bytes(ctx->buf, len);
+			else
+				memset(ctx->buf, 0, len);
+			down_read(&store->pages_lock);
+			KUNIT_ASSERT_EQ(test, blk_ram_write(store, pos, ctx->buf, len),
+							0);
+			up_read(&store->pages_lock);
+			memcpy(ctx->expected + pos, ctx->buf, len);
+		}
+		blk_ram_kunit_verify(test);
+	}
+}
+
+/**
+ * @brief Applies random page-aligned copies (overlapping ones included),
+ * over a device holding absent pages, zero pages and data pages.
+ *
+ */
+static void blk_ram_kunit_copies(struct kunit *test)
+{
+	struct blk_ram_kunit *ctx = test->priv;
+	struct blk_ram_store *store = &ctx->store;
+	unsigned int round;
+	pgoff_t index;
+
+	for (index = 0; index < BLK_RAM_KUNIT_PAGES; index++)
+	{
+		u64 pos = index * PAGE_SIZE;
+
+		switch (get_random_u32() % 3)
+		{
+		case 0:
+			continue;
+		case 1:
+			get_random_bytes(ctx->buf, PAGE_SIZE);
+			break;
+		default:
+			// Data, then zeros: the page is stored, and marked.
+			memset(ctx->buf, 0xa5, PAGE_SIZE);
+			down_read(&store->pages_lock);
+			KUNIT_ASSERT_EQ(test, blk_ram_write(store, pos, ctx->buf,
+												PAGE_SIZE), 0);
+			up_read(&store->pages_lock);
+			memset(ctx->buf, 0, PAGE_SIZE);
+		}
+		down_read(&store->pages_lock);
+		KUNIT_ASSERT_EQ(test, blk_ram_write(store, pos, ctx->buf, PAGE_SIZE),
+						0);
+		up_read(&store->pages_lock);
+		memcpy(ctx->expected + pos, ctx->buf, PAGE_SIZE);
+	}
+	blk_ram_kunit_verify(test);
+
+	for (round = 0; round < BLK_RAM_KUNIT_ROUNDS; round++)
+	{
+		pgoff_t nr = get_random_u32() % (BLK_RAM_KUNIT_PAGES + 1);
+		u64 src = (u64)(get_random_u32() % (BLK_RAM_KUNIT_PAGES - nr + 1))
+				  << PAGE_SHIFT;
+		u64 dst = (u64)(get_random_u32() % (BLK_RAM_KUNIT_PAGES - nr + 1))
+				  << PAGE_SHIFT;
+		u64 len = (u64)nr << PAGE_SHIFT;
+
+		KUNIT_ASSERT_EQ(test, blk_ram_copy_within(store, dst, src, len), 0);
+		memmove(ctx->expected + dst, ctx->expected + src, len);
+		blk_ram_kunit_verify(test);
+	}
+}
+
+static void blk_ram_kunit_read_empty(struct kunit *test)
+{
+	struct blk_ram_kunit *ctx = test->priv;
+
+	memset(ctx->buf, 0xff, BLK_RAM_KUNIT_SIZE);
+	blk_ram_kunit_verify(test);
+	KUNIT_EXPECT_EQ(test, atomic_long_read(&ctx->store.nr_pages), 0);
+}
+
+/**
+ * @brief Zeros are only stored into pages that are already present, which
+ * they mark (once) BLK_RAM_MAYBE_ZERO.
+ *
+ */
+static void blk_ram_kunit_zero_writes(struct kunit *test)
+{
+	struct blk_ram_kunit *ctx = test->priv;
+	struct blk_ram_store *store = &ctx->store;
+
+	down_read(&store->pages_lock);
+	KUNIT_ASSERT_EQ(test, blk_ram_write(store, 0, ctx->buf,
+										BLK_RAM_KUNIT_SIZE), 0);
+	KUNIT_EXPECT_EQ(test, atomic_long_read(&store->nr_pages), 0);
+
+	ctx->buf[0] = 1;
+	KUNIT_ASSERT_EQ(test, blk_ram_write(store, PAGE_SIZE + 1, ctx->buf, 1),
+					0);
+	KUNIT_EXPECT_EQ(test, atomic_long_read(&store->nr_pages), 1);
+	KUNIT_EXPECT_EQ(test, atomic_long_read(&store->nr_maybe_zero), 0);
+
+	ctx->buf[0] = 0;
+	KUNIT_ASSERT_EQ(test, blk_ram_write(store, PAGE_SIZE + 1, ctx->buf, 1),
+					0);
+	KUNIT_ASSERT_EQ(test, blk_ram_write(store, PAGE_SIZE, ctx->buf, 2), 0);
+	up_read(&store->pages_lock);
+	KUNIT_EXPECT_EQ(test, atomic_long_read(&store->nr_pages), 1);
+	KUNIT_EXPECT_EQ(test, atomic_long_read(&store->nr_maybe_zero), 1);
+	KUNIT_EXPECT_TRUE(test, xa_get_mark(&store->pages, 1,
+										BLK_RAM_MAYBE_ZERO));
+	blk_ram_kunit_verify(test);
+
+	// Freed as a whole, the page is no longer counted.
+	down_write(&store->pages_lock);
+	blk_ram_zero_range(store, PAGE_SIZE, PAGE_SIZE);
+	up_write(&store->pages_lock);
+	KUNIT_EXPECT_EQ(test, atomic_long_read(&store->nr_pages), 0);
+	KUNIT_EXPECT_EQ(test, atomic_long_read(&store->nr_maybe_zero), 0);
+}
+
+static void blk_ram_kunit_writes_reserved(struct kunit *test)
+{
+	blk_ram_kunit_use_mem(test);
+	blk_ram_kunit_writes(test);
+}
+
+static void blk_ram_kunit_copies_reserved(struct kunit *test)
+{
+	blk_ram_kunit_use_mem(test);
+	blk_ram_kunit_copies(test);
+}
+
+static struct kunit_case blk_ram_kunit_cases[] = {
+	KUNIT_CASE(blk_ram_kunit_read_empty),
+	KUNIT_CASE(blk_ram_kunit_zero_writes),
+	KUNIT_CASE(blk_ram_kunit_writes),
+	KUNIT_CASE(blk_ram_kunit_copies),
+	KUNIT_CASE(blk_ram_kunit_writes_reserved),
+	KUNIT_CASE(blk_ram_kunit_copies_reserved),
+	{}
+};
+
+static struct kunit_suite blk_ram_kunit_suite = {
+	.name = "blk_ram_store",
+	.init = blk_ram_kunit_init,
+	.exit = blk_ram_kunit_exit,
+	.test_cases = blk_ram_kunit_cases,
+};
+
+// ============================================================================
+// Benchmarks
+
+#define BLK_RAM_BENCH_SIZE (64 * 1024 * 1024)
+#define BLK_RAM_BENCH_CHUNK (64 * 1024)
+
+/**
+ * @brief Reports the cost per page of an operation on len bytes (see
+ * drv_bench.h).
+ *
+ */
+static void blk_ram_bench_report(struct kunit *test,
+								 const struct drv_bench *timing,
+								 const char *name, u64 len)
+{
+	drv_bench_report(test, timing, name, "page", len >> PAGE_SHIFT);
+}
+
+/**
+ * @brief Writes (allocating the pages, then overwriting them), reads, then
+ * copies half of a BLK_RAM_BENCH_SIZE store, BLK_RAM_BENCH_CHUNK bytes at a
+ * time.
+ *
+ */
+static void blk_ram_bench_store(struct kunit *test)
+{
+	struct blk_ram_store store = {};
+	struct drv_bench timing;
+	u8 *buf;
+	u64 pos;
+	int pass;
+
+	if (!bench)
+		kunit_skip(test, "not loaded with bench=1");
+	buf = kunit_kmalloc(test, BLK_RAM_BENCH_CHUNK, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+	get_random_bytes(buf, BLK_RAM_BENCH_CHUNK);
+	blk_ram_store_init(&store);
+
+	for (pass = 0; pass < 2; pass++)
+	{
+		drv_bench_start(&timing);
+		for (pos = 0; pos < BLK_RAM_BENCH_SIZE; pos += BLK_RAM_BENCH_CHUNK)
+		{
+			down_read(&store.pages_lock);
+			if (blk_ram_write(&store, pos, buf, BLK_RAM_BENCH_CHUNK))
+			{
+				up_read(&store.pages_lock);
+				blk_ram_free_pages(&store);
+				KUNIT_FAIL(test, "out of memory");
+				return;
+			}
+			up_read(&store.pages_lock);
+			cond_resched();
+		}
+		blk_ram_bench_report(test, &timing, pass ? "overwrite" : "write",
+							 BLK_RAM_BENCH_SIZE);
+	}
+
+	drv_bench_start(&timing);
+	for (pos = 0; pos < BLK_RAM_BENCH_SIZE; pos += BLK_RAM_BENCH_CHUNK)
+	{
+		down_read(&store.pages_lock);
+		blk_ram_read(&store, pos, buf, BLK_RAM_BENCH_CHUNK);
+		up_read(&store.pages_lock);
+		cond_resched();
+	}
+	blk_ram_bench_report(test, &timing, "read", BLK_RAM_BENCH_SIZE);
+
+	drv_bench_start(&timing);
+	KUNIT_EXPECT_EQ(test, blk_ram_copy_within(&store, 0,
+											  BLK_RAM_BENCH_SIZE / 2,
+											  BLK_RAM_BENCH_SIZE / 2), 0);
+	blk_ram_bench_report(test, &timing, "copy_within",
+						 BLK_RAM_BENCH_SIZE / 2);
+
+	blk_ram_free_pages(&store);
+}
+
+static struct kunit_case blk_ram_bench_cases[] = {
+	KUNIT_CASE(blk_ram_bench_store),
+	{}
+};
+
+static struct kunit_suite blk_ram_bench_suite = {
+	.name = "blk_ram_store_bench",
+	.test_cases = blk_ram_bench_cases,
+};
+
+kunit_test_suites(&blk_ram_kunit_suite, &blk_ram_bench_suite);
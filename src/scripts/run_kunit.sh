@@ -0,0 +1,34 @@
+#!/bin/bash
+
+set -e
+
+if [ -z "$1" ] || [ -z "$2" ]; then
+    echo "expected: $0 <kernel source tree> <directory holding a .kunitconfig> [kunit.py run arguments]"
+    exit 1
+fi
+
+ksrc=$(realpath "$1")
+kunitconfig=$(realpath "$2")
+shift 2
+src=$(realpath "$(dirname "$0")/..")
+kunit="$ksrc/tools/testing/kunit/kunit.py"
+
+if ! [ -f "$kunit" ]; then
+    echo "$kunit not found (KSRC must point to a kernel source tree)."
+    exit 1
+fi
+
+# kunit.py builds the suites into a kernel (UML by default, or a QEMU guest
+# with --arch) and runs it, which needs no root access. The suites are made
+# part of the tree by linking the drivers' sources into it, and hooking them
+# into drivers/misc (once: the lines following the 'linux_drivers' comments
+# undo it when removed).
+ln -sfn "$src" "$ksrc/drivers/misc/linux_drivers"
+if ! grep -q "^# linux_drivers" "$ksrc/drivers/misc/Kconfig"; then
+    printf '# linux_drivers (run_kunit.sh)\nsource "drivers/misc/linux_drivers/Kconfig"\n' >> "$ksrc/drivers/misc/Kconfig"
+fi
+if ! grep -q "^# linux_drivers" "$ksrc/drivers/misc/Makefile"; then
+    printf '# linux_drivers (run_kunit.sh)\nobj-y += linux_drivers/\n' >> "$ksrc/drivers/misc/Makefile"
+fi
+
+exec python3 "$kunit" run --kunitconfig="$kunitconfig" "$@"